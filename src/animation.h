@@ -0,0 +1,31 @@
+#ifndef FIRST_TRY_ANIMATION_H
+#define FIRST_TRY_ANIMATION_H
+
+#include <glm/glm.hpp>
+
+#define GLM_ENABLE_EXPERIMENTAL
+
+#include <glm/gtx/quaternion.hpp>
+
+struct AnimationBoneKeyframe {
+    glm::vec3 position;
+    glm::quat rotation;
+
+    double time;
+};
+
+// Local transform of a bone relative to its parent.
+struct BoneTransform {
+    glm::vec3 position;
+    glm::quat rotation;
+};
+
+// Normalized lerp along the shortest arc. Cheaper than slerp and close enough between nearby rotations.
+glm::quat nlerpQuaternion(const glm::quat& from, glm::quat to, float ratio) {
+    if (glm::dot(from, to) < 0.0f) {
+        to = -to;
+    }
+    return glm::normalize(from * (1.0f - ratio) + to * ratio);
+}
+
+#endif //FIRST_TRY_ANIMATION_H
@@ -0,0 +1,236 @@
+#ifndef FIRST_TRY_ANIMATION_CLIP_H
+#define FIRST_TRY_ANIMATION_CLIP_H
+
+#include <glm/glm.hpp>
+
+#define GLM_ENABLE_EXPERIMENTAL
+
+#include <glm/gtx/quaternion.hpp>
+
+#include "animation.h"
+#include "animation_compression.h"
+#include "binary_io.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Keyframes of one animation for all bones of a model. Tracks are indexed by bone id and stored back to back,
+// so sampling a pose walks a single array.
+class AnimationClip {
+public:
+    explicit AnimationClip(const std::string& name) : name_(name) {}
+
+    const std::string& name() const {
+        return name_;
+    }
+
+    double startTime() const {
+        return start_time_;
+    }
+
+    double duration() const {
+        return duration_;
+    }
+
+    // Maps an ever increasing playback time into the clip, looping it.
+    double loopTime(double time) const {
+        return duration_ > 0.0 ? std::fmod(time, duration_) + start_time_ : start_time_;
+    }
+
+    void addTrack(size_t bone, const std::vector<AnimationBoneKeyframe>& keyframes) {
+        if (keyframes.empty()) {
+            return;
+        }
+        if (bone >= tracks_.size()) {
+            tracks_.resize(bone + 1);
+        }
+        tracks_[bone].offset = static_cast<uint32_t>(keyframes_.size());
+        tracks_[bone].count = static_cast<uint32_t>(keyframes.size());
+        keyframes_.insert(keyframes_.end(), keyframes.begin(), keyframes.end());
+
+        double end_time = start_time_ + duration_;
+        if (keyframes_.size() == keyframes.size() || keyframes.front().time < start_time_) {
+            start_time_ = keyframes.front().time;
+        }
+        if (keyframes_.size() == keyframes.size() || keyframes.back().time > end_time) {
+            end_time = keyframes.back().time;
+        }
+        duration_ = end_time - start_time_;
+    }
+
+    bool hasTrack(size_t bone) const {
+        if (compressed_) {
+            return bone < compressed_->numTracks() && !compressed_->emptyTrack(bone);
+        }
+        return bone < tracks_.size() && tracks_[bone].count != 0;
+    }
+
+    // Local transform of the bone at the given clip time. The bone must have a track.
+    void sample(size_t bone, double time, BoneTransform& transform) const {
+        if (compressed_) {
+            transform.position = compressed_->samplePosition(bone, time);
+            transform.rotation = compressed_->sampleRotation(bone, time);
+            return;
+        }
+        const AnimationBoneKeyframe* begin = &keyframes_[tracks_[bone].offset];
+        const AnimationBoneKeyframe* end = begin + tracks_[bone].count;
+        const AnimationBoneKeyframe* next = std::upper_bound(
+                begin, end, time,
+                [](double value, const AnimationBoneKeyframe& keyframe) { return value < keyframe.time; });
+        if (next == begin || next == end) {
+            const AnimationBoneKeyframe& keyframe = next == begin ? *begin : end[-1];
+            transform.position = keyframe.position;
+            transform.rotation = keyframe.rotation;
+            return;
+        }
+        const AnimationBoneKeyframe& previous_keyframe = next[-1];
+        const AnimationBoneKeyframe& next_keyframe = next[0];
+        float mix_ratio = static_cast<float>((time - previous_keyframe.time) /
+                                             (next_keyframe.time - previous_keyframe.time));
+        transform.position = (1 - mix_ratio) * previous_keyframe.position + mix_ratio * next_keyframe.position;
+        transform.rotation = glm::slerp(previous_keyframe.rotation, next_keyframe.rotation, mix_ratio);
+    }
+
+    // Times of the keys of all tracks, ascending and without repeats. Only for clips that are not compressed.
+    std::vector<double> keyTimes() const {
+        assert(!compressed_);
+        std::vector<double> times;
+        times.reserve(keyframes_.size());
+        for (const AnimationBoneKeyframe& keyframe : keyframes_) {
+            times.push_back(keyframe.time);
+        }
+        std::sort(times.begin(), times.end());
+        times.erase(std::unique(times.begin(), times.end()), times.end());
+        return times;
+    }
+
+    // Replaces the keyframes with a compressed clip.
+    CompressionStats compress(const CompressionSettings& settings) {
+        std::vector<std::vector<AnimationBoneKeyframe>> tracks(tracks_.size());
+        for (size_t bone = 0; bone < tracks_.size(); ++bone) {
+            tracks[bone].assign(keyframes_.begin() + tracks_[bone].offset,
+                                keyframes_.begin() + tracks_[bone].offset + tracks_[bone].count);
+        }
+        CompressionStats stats;
+        compressed_.reset(new CompressedClip(CompressedClip::compress(tracks, settings, &stats)));
+        std::vector<AnimationBoneKeyframe>().swap(keyframes_);
+        std::vector<Track>().swap(tracks_);
+        return stats;
+    }
+
+    // Part of the clip covering [begin, end]. Every track keeps the keys around the range as well, so sampling
+    // anywhere inside of it gives the same result as sampling the whole clip.
+    AnimationClip slice(double begin, double end) const {
+        AnimationClip result(name_);
+        std::vector<AnimationBoneKeyframe> keyframes;
+        for (size_t bone = 0; bone < tracks_.size(); ++bone) {
+            const AnimationBoneKeyframe* track_begin = keyframes_.data() + tracks_[bone].offset;
+            const AnimationBoneKeyframe* track_end = track_begin + tracks_[bone].count;
+            if (track_begin == track_end) {
+                continue;
+            }
+            auto by_time = [](const AnimationBoneKeyframe& keyframe, double value) { return keyframe.time < value; };
+            const AnimationBoneKeyframe* first = std::lower_bound(track_begin, track_end, begin, by_time);
+            const AnimationBoneKeyframe* last = std::lower_bound(first, track_end, end, by_time);
+            if (first != track_begin) {
+                --first;
+            }
+            if (last == track_end) {
+                --last;
+            }
+            keyframes.assign(first, last + 1);
+            result.addTrack(bone, keyframes);
+        }
+        return result;
+    }
+
+    void write(std::ostream& stream) const {
+        writeString(stream, name_);
+        writeValue(stream, start_time_);
+        writeValue(stream, duration_);
+        writeValue<uint8_t>(stream, compressed_ ? 1 : 0);
+        if (compressed_) {
+            compressed_->write(stream);
+        } else {
+            writeVector(stream, tracks_);
+            writeVector(stream, keyframes_);
+        }
+    }
+
+    static AnimationClip read(std::istream& stream) {
+        AnimationClip clip(readString(stream));
+        clip.start_time_ = readValue<double>(stream);
+        clip.duration_ = readValue<double>(stream);
+        if (readValue<uint8_t>(stream)) {
+            clip.compressed_.reset(new CompressedClip(CompressedClip::read(stream)));
+        } else {
+            readVector(stream, clip.tracks_);
+            readVector(stream, clip.keyframes_);
+        }
+        return clip;
+    }
+
+    size_t sizeInBytes() const {
+        return sizeof(AnimationClip) + name_.size() + tracks_.size() * sizeof(Track) +
+               keyframes_.size() * sizeof(AnimationBoneKeyframe) + (compressed_ ? compressed_->sizeInBytes() : 0);
+    }
+
+private:
+    struct Track {
+        uint32_t offset = 0;
+        uint32_t count = 0;
+    };
+
+    std::string name_;
+    std::vector<AnimationBoneKeyframe> keyframes_;
+    std::vector<Track> tracks_;
+    std::unique_ptr<CompressedClip> compressed_;
+    double start_time_ = 0.0;
+    double duration_ = 0.0;
+};
+
+// One clip contributing to a pose. Layers are applied in order and each one blends its sample over the result
+// of the layers before it, so a cross-fade is two full body layers and an upper body layer is one with a mask.
+struct AnimationLayer {
+    const AnimationClip* clip;
+    double time;                         // Clip time, see AnimationClip::loopTime
+    float weight;
+    const std::vector<float>* bone_mask; // Weight multiplier per bone, all bones count fully when null
+};
+
+// Samples all layers into the pose in a single pass over the bones. Bones no layer animates keep the bind pose.
+// With a bone list only those bones are sampled, the others keep their previous value.
+void blendLayers(const AnimationLayer* layers, size_t num_layers, const std::vector<BoneTransform>& bind_pose,
+                 std::vector<BoneTransform>& pose, const std::vector<int>* bones = nullptr) {
+    pose.resize(bind_pose.size());
+    BoneTransform sample;
+    size_t num_bones = bones ? bones->size() : bind_pose.size();
+    for (size_t index = 0; index < num_bones; ++index) {
+        size_t bone = bones ? (*bones)[index] : index;
+        BoneTransform result = bind_pose[bone];
+        for (size_t i = 0; i < num_layers; ++i) {
+            const AnimationLayer& layer = layers[i];
+            float weight = layer.weight;
+            if (layer.bone_mask) {
+                weight *= (*layer.bone_mask)[bone];
+            }
+            if (weight <= 0.0f || !layer.clip->hasTrack(bone)) {
+                continue;
+            }
+            layer.clip->sample(bone, layer.time, sample);
+            if (weight >= 1.0f) {
+                result = sample;
+            } else {
+                result.position = glm::mix(result.position, sample.position, weight);
+                result.rotation = nlerpQuaternion(result.rotation, sample.rotation, weight);
+            }
+        }
+        pose[bone] = result;
+    }
+}
+
+#endif //FIRST_TRY_ANIMATION_CLIP_H
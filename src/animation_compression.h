@@ -0,0 +1,371 @@
+#ifndef FIRST_TRY_ANIMATION_COMPRESSION_H
+#define FIRST_TRY_ANIMATION_COMPRESSION_H
+
+#include <glm/glm.hpp>
+
+#define GLM_ENABLE_EXPERIMENTAL
+
+#include <glm/gtx/quaternion.hpp>
+
+#include "animation.h"
+#include "binary_io.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+struct CompressionSettings {
+    float max_position_error = 0.0005f; // In model units
+    float max_rotation_error = 0.0005f; // In radians
+};
+
+struct CompressionStats {
+    size_t raw_bytes = 0;
+    size_t compressed_bytes = 0;
+    size_t raw_keys = 0;
+    size_t kept_position_keys = 0;
+    size_t kept_rotation_keys = 0;
+    // Measured by sampling the compressed clip at every source key.
+    float max_position_error = 0.0f;
+    float max_rotation_error = 0.0f;
+
+    double ratio() const {
+        return compressed_bytes == 0 ? 0.0 : static_cast<double>(raw_bytes) / compressed_bytes;
+    }
+
+    void merge(const CompressionStats& other) {
+        raw_bytes += other.raw_bytes;
+        compressed_bytes += other.compressed_bytes;
+        raw_keys += other.raw_keys;
+        kept_position_keys += other.kept_position_keys;
+        kept_rotation_keys += other.kept_rotation_keys;
+        max_position_error = std::max(max_position_error, other.max_position_error);
+        max_rotation_error = std::max(max_rotation_error, other.max_rotation_error);
+    }
+};
+
+const float SMALLEST_THREE_RANGE = 0.70710678f; // Largest value of a component that is not the largest one
+
+// Smallest three encoding: the largest component is dropped and restored from the unit length, the other three
+// are quantized to 15 bits each. The index of the dropped component is kept in the top bits of the first two words.
+void packQuaternion(glm::quat rotation, uint16_t* packed) {
+    float components[4] = {rotation.x, rotation.y, rotation.z, rotation.w};
+    int largest = 0;
+    for (int i = 1; i < 4; ++i) {
+        if (std::fabs(components[i]) > std::fabs(components[largest])) {
+            largest = i;
+        }
+    }
+    // q and -q are the same rotation, so the dropped component can always be made positive.
+    float sign = components[largest] < 0.0f ? -1.0f : 1.0f;
+    int word = 0;
+    for (int i = 0; i < 4; ++i) {
+        if (i == largest) {
+            continue;
+        }
+        float normalized = (sign * components[i] / SMALLEST_THREE_RANGE) * 0.5f + 0.5f;
+        long value = std::lround(normalized * 32767.0f);
+        packed[word++] = static_cast<uint16_t>(std::min(std::max(value, 0L), 32767L));
+    }
+    packed[0] |= (largest & 1) << 15;
+    packed[1] |= (largest >> 1) << 15;
+}
+
+glm::quat unpackQuaternion(const uint16_t* packed) {
+    int largest = (packed[0] >> 15) | ((packed[1] >> 15) << 1);
+    float components[4];
+    float squared_sum = 0.0f;
+    int word = 0;
+    for (int i = 0; i < 4; ++i) {
+        if (i == largest) {
+            continue;
+        }
+        float value = ((packed[word++] & 0x7FFF) / 32767.0f * 2.0f - 1.0f) * SMALLEST_THREE_RANGE;
+        components[i] = value;
+        squared_sum += value * value;
+    }
+    components[largest] = std::sqrt(std::max(0.0f, 1.0f - squared_sum));
+    return {components[3], components[0], components[1], components[2]};
+}
+
+// Angle of the rotation between two unit quaternions. Computed from the chord length, as acos of the dot product
+// has no precision left for the small angles that matter here.
+float rotationDistance(const glm::quat& a, const glm::quat& b) {
+    double sign = glm::dot(a, b) < 0.0f ? -1.0 : 1.0;
+    double dx = a.x - sign * b.x;
+    double dy = a.y - sign * b.y;
+    double dz = a.z - sign * b.z;
+    double dw = a.w - sign * b.w;
+    double chord = std::sqrt(dx * dx + dy * dy + dz * dz + dw * dw);
+    return static_cast<float>(4.0 * std::asin(std::min(1.0, chord * 0.5)));
+}
+
+// Clip with quantized keys and per-channel key reduction. Tracks are addressed by index, as in the source data.
+class CompressedClip {
+public:
+    static CompressedClip compress(const std::vector<std::vector<AnimationBoneKeyframe>>& tracks,
+                                   const CompressionSettings& settings, CompressionStats* stats = nullptr) {
+        CompressedClip clip;
+        double end_time = 0.0;
+        bool first_key = true;
+        for (const auto& track : tracks) {
+            if (track.empty()) {
+                continue;
+            }
+            if (first_key || track.front().time < clip.start_time_) {
+                clip.start_time_ = track.front().time;
+            }
+            if (first_key || track.back().time > end_time) {
+                end_time = track.back().time;
+            }
+            first_key = false;
+        }
+        clip.duration_ = end_time - clip.start_time_;
+
+        clip.tracks_.resize(tracks.size());
+        for (size_t i = 0; i < tracks.size(); ++i) {
+            clip.compressTrack(tracks[i], settings, clip.tracks_[i]);
+        }
+
+        if (stats) {
+            *stats = CompressionStats();
+            for (size_t i = 0; i < tracks.size(); ++i) {
+                stats->raw_keys += tracks[i].size();
+                stats->kept_position_keys += clip.tracks_[i].position_count;
+                stats->kept_rotation_keys += clip.tracks_[i].rotation_count;
+                for (const auto& keyframe : tracks[i]) {
+                    float position_error = glm::length(clip.samplePosition(i, keyframe.time) - keyframe.position);
+                    float rotation_error = rotationDistance(clip.sampleRotation(i, keyframe.time),
+                                                            glm::normalize(keyframe.rotation));
+                    stats->max_position_error = std::max(stats->max_position_error, position_error);
+                    stats->max_rotation_error = std::max(stats->max_rotation_error, rotation_error);
+                }
+            }
+            stats->raw_bytes = stats->raw_keys * sizeof(AnimationBoneKeyframe);
+            stats->compressed_bytes = clip.sizeInBytes();
+        }
+        return clip;
+    }
+
+    size_t numTracks() const {
+        return tracks_.size();
+    }
+
+    bool emptyTrack(size_t track) const {
+        return tracks_[track].rotation_count == 0;
+    }
+
+    double startTime() const {
+        return start_time_;
+    }
+
+    double duration() const {
+        return duration_;
+    }
+
+    // Maps an ever increasing playback time into the clip, looping it.
+    double loopTime(double time) const {
+        return duration_ > 0.0 ? std::fmod(time, duration_) + start_time_ : start_time_;
+    }
+
+    glm::vec3 samplePosition(size_t track_index, double time) const {
+        const Track& track = tracks_[track_index];
+        float ratio;
+        size_t key = findKey(position_times_, track.position_offset, track.position_count, time, ratio);
+        glm::vec3 previous = decodePosition(track, key);
+        if (ratio == 0.0f) {
+            return previous;
+        }
+        return glm::mix(previous, decodePosition(track, key + 1), ratio);
+    }
+
+    glm::quat sampleRotation(size_t track_index, double time) const {
+        const Track& track = tracks_[track_index];
+        float ratio;
+        size_t key = findKey(rotation_times_, track.rotation_offset, track.rotation_count, time, ratio);
+        glm::quat previous = unpackQuaternion(&rotations_[3 * key]);
+        if (ratio == 0.0f) {
+            return previous;
+        }
+        // The encoder measures its error with the same interpolation.
+        return nlerpQuaternion(previous, unpackQuaternion(&rotations_[3 * (key + 1)]), ratio);
+    }
+
+    size_t sizeInBytes() const {
+        return sizeof(CompressedClip) + tracks_.size() * sizeof(Track) +
+               (position_times_.size() + rotation_times_.size()) * sizeof(float) +
+               (positions_.size() + rotations_.size()) * sizeof(uint16_t);
+    }
+
+    void write(std::ostream& stream) const {
+        writeValue(stream, start_time_);
+        writeValue(stream, duration_);
+        writeVector(stream, tracks_);
+        writeVector(stream, position_times_);
+        writeVector(stream, positions_);
+        writeVector(stream, rotation_times_);
+        writeVector(stream, rotations_);
+    }
+
+    static CompressedClip read(std::istream& stream) {
+        CompressedClip clip;
+        clip.start_time_ = readValue<double>(stream);
+        clip.duration_ = readValue<double>(stream);
+        readVector(stream, clip.tracks_);
+        readVector(stream, clip.position_times_);
+        readVector(stream, clip.positions_);
+        readVector(stream, clip.rotation_times_);
+        readVector(stream, clip.rotations_);
+        return clip;
+    }
+
+private:
+    struct Track {
+        uint32_t position_offset = 0;
+        uint32_t position_count = 0;
+        uint32_t rotation_offset = 0;
+        uint32_t rotation_count = 0;
+        glm::vec3 position_min;
+        glm::vec3 position_scale; // Range of the track divided by the number of quantization steps
+    };
+
+    // Returns the absolute index of the key preceding time and the interpolation ratio towards the next one.
+    size_t findKey(const std::vector<float>& times, uint32_t offset, uint32_t count, double time,
+                   float& ratio) const {
+        ratio = 0.0f;
+        float local_time = static_cast<float>(time - start_time_);
+        const float* begin = &times[offset];
+        const float* end = begin + count;
+        const float* next = std::upper_bound(begin, end, local_time);
+        if (next == begin) {
+            return offset;
+        }
+        if (next == end) {
+            return offset + count - 1;
+        }
+        ratio = (local_time - next[-1]) / (next[0] - next[-1]);
+        return offset + (next - begin) - 1;
+    }
+
+    glm::vec3 decodePosition(const Track& track, size_t key) const {
+        const uint16_t* packed = &positions_[3 * key];
+        return track.position_min + track.position_scale * glm::vec3(packed[0], packed[1], packed[2]);
+    }
+
+    // Longest run of keys one segment may replace. Every extension retests the keys it skips, so this bounds the
+    // cost of long near linear tracks, such as motion capture, at one extra key per run.
+    static const size_t MAX_SEGMENT_KEYS = 64;
+
+    // Keeps the first key, then greedily extends a linear segment while every skipped key stays within the
+    // error bound. A track that never leaves the bound around its first key collapses to that single key.
+    template<typename Value, typename Original, typename Interpolate, typename Distance>
+    static std::vector<size_t> reduceKeys(const std::vector<AnimationBoneKeyframe>& keyframes,
+                                          const std::vector<float>& times, const std::vector<Value>& decoded,
+                                          Original original, Interpolate interpolate, Distance distance,
+                                          float max_error) {
+        std::vector<size_t> kept(1, 0);
+        size_t count = keyframes.size();
+        bool constant = true;
+        for (size_t i = 1; i < count && constant; ++i) {
+            constant = distance(decoded[0], original(keyframes[i])) <= max_error;
+        }
+        if (constant) {
+            return kept;
+        }
+
+        size_t anchor = 0;
+        for (size_t end = anchor + 2; end < count; ++end) {
+            bool fits = true;
+            for (size_t i = anchor + 1; i < end && fits; ++i) {
+                float ratio = (times[i] - times[anchor]) / (times[end] - times[anchor]);
+                fits = distance(interpolate(decoded[anchor], decoded[end], ratio), original(keyframes[i])) <=
+                       max_error;
+            }
+            if (!fits || end - anchor > MAX_SEGMENT_KEYS) {
+                anchor = end - 1;
+                kept.push_back(anchor);
+            }
+        }
+        if (count > 1) {
+            kept.push_back(count - 1);
+        }
+        return kept;
+    }
+
+    void compressTrack(const std::vector<AnimationBoneKeyframe>& keyframes, const CompressionSettings& settings,
+                       Track& track) {
+        if (keyframes.empty()) {
+            return;
+        }
+        size_t count = keyframes.size();
+
+        glm::vec3 position_min = keyframes[0].position;
+        glm::vec3 position_max = keyframes[0].position;
+        for (const auto& keyframe : keyframes) {
+            position_min = glm::min(position_min, keyframe.position);
+            position_max = glm::max(position_max, keyframe.position);
+        }
+        track.position_min = position_min;
+        track.position_scale = (position_max - position_min) / 65535.0f;
+
+        // Keys are reduced against their quantized values, so quantization error is part of the bound.
+        // Times as stored, so the reduction interpolates exactly like sampling does.
+        std::vector<float> times(count);
+        std::vector<uint16_t> quantized_positions(3 * count);
+        std::vector<glm::vec3> decoded_positions(count);
+        std::vector<uint16_t> quantized_rotations(3 * count);
+        std::vector<glm::quat> decoded_rotations(count);
+        for (size_t i = 0; i < count; ++i) {
+            times[i] = static_cast<float>(keyframes[i].time - start_time_);
+            for (int axis = 0; axis < 3; ++axis) {
+                float extent = position_max[axis] - position_min[axis];
+                float normalized = extent > 0.0f ? (keyframes[i].position[axis] - position_min[axis]) / extent : 0.0f;
+                quantized_positions[3 * i + axis] = static_cast<uint16_t>(std::lround(normalized * 65535.0f));
+            }
+            decoded_positions[i] = track.position_min + track.position_scale *
+                                                        glm::vec3(quantized_positions[3 * i],
+                                                                  quantized_positions[3 * i + 1],
+                                                                  quantized_positions[3 * i + 2]);
+            packQuaternion(glm::normalize(keyframes[i].rotation), &quantized_rotations[3 * i]);
+            decoded_rotations[i] = unpackQuaternion(&quantized_rotations[3 * i]);
+        }
+
+        std::vector<size_t> position_keys = reduceKeys<glm::vec3>(
+                keyframes, times, decoded_positions,
+                [](const AnimationBoneKeyframe& keyframe) { return keyframe.position; },
+                [](const glm::vec3& a, const glm::vec3& b, float ratio) { return glm::mix(a, b, ratio); },
+                [](const glm::vec3& a, const glm::vec3& b) { return glm::length(a - b); },
+                settings.max_position_error);
+        std::vector<size_t> rotation_keys = reduceKeys<glm::quat>(
+                keyframes, times, decoded_rotations,
+                [](const AnimationBoneKeyframe& keyframe) { return glm::normalize(keyframe.rotation); },
+                [](const glm::quat& a, const glm::quat& b, float ratio) { return nlerpQuaternion(a, b, ratio); },
+                [](const glm::quat& a, const glm::quat& b) { return rotationDistance(a, b); },
+                settings.max_rotation_error);
+
+        track.position_offset = static_cast<uint32_t>(position_times_.size());
+        track.position_count = static_cast<uint32_t>(position_keys.size());
+        for (size_t key : position_keys) {
+            position_times_.push_back(times[key]);
+            positions_.insert(positions_.end(), &quantized_positions[3 * key], &quantized_positions[3 * key] + 3);
+        }
+        track.rotation_offset = static_cast<uint32_t>(rotation_times_.size());
+        track.rotation_count = static_cast<uint32_t>(rotation_keys.size());
+        for (size_t key : rotation_keys) {
+            rotation_times_.push_back(times[key]);
+            rotations_.insert(rotations_.end(), &quantized_rotations[3 * key], &quantized_rotations[3 * key] + 3);
+        }
+    }
+
+    std::vector<Track> tracks_;
+    // Key data of all tracks, each track owns a contiguous range.
+    std::vector<float> position_times_; // Relative to start_time_
+    std::vector<uint16_t> positions_;   // 3 components per key
+    std::vector<float> rotation_times_; // Relative to start_time_
+    std::vector<uint16_t> rotations_;   // Smallest three, 3 words per key
+    double start_time_ = 0.0;
+    double duration_ = 0.0;
+};
+
+#endif //FIRST_TRY_ANIMATION_COMPRESSION_H
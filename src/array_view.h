@@ -0,0 +1,54 @@
+#ifndef FIRST_TRY_ARRAY_VIEW_H
+#define FIRST_TRY_ARRAY_VIEW_H
+
+#include <cassert>
+#include <cstddef>
+
+// Non-owning view of contiguous elements, what std::span is in C++20. Hot path functions take views instead of
+// containers so that callers can pass vectors, arena memory or plain arrays without copying.
+template<typename T>
+class ArrayView {
+public:
+    ArrayView() : data_(nullptr), size_(0) {}
+
+    ArrayView(T* data, size_t size) : data_(data), size_(size) {}
+
+    // Any container with contiguous data() and size(), e.g. std::vector.
+    template<typename Container>
+    ArrayView(Container& values) : data_(values.data()), size_(values.size()) {}
+
+    // View of const elements from a view of mutable ones.
+    template<typename U>
+    ArrayView(const ArrayView<U>& other) : data_(other.data()), size_(other.size()) {}
+
+    T* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    T& operator[](size_t index) const {
+        assert(index < size_);
+        return data_[index];
+    }
+
+    T* begin() const {
+        return data_;
+    }
+
+    T* end() const {
+        return data_ + size_;
+    }
+
+private:
+    T* data_;
+    size_t size_;
+};
+
+#endif //FIRST_TRY_ARRAY_VIEW_H
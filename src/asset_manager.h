@@ -0,0 +1,274 @@
+#ifndef FIRST_TRY_ASSET_MANAGER_H
+#define FIRST_TRY_ASSET_MANAGER_H
+
+#include "material.h"
+#include "model.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+
+enum class AssetState {
+    Loading,   // Parsing and converting on a worker
+    Uploading, // Waiting for or in the middle of GL uploads
+    Ready,
+    Failed
+};
+
+template<typename T>
+struct AssetSlot {
+    explicit AssetSlot(const std::string& path) : path(path), state(AssetState::Loading) {}
+
+    std::string path;
+    std::atomic<AssetState> state;
+    std::unique_ptr<T> asset; // Published by the release store of Ready
+};
+
+// Shared reference to an asset loaded in the background. get() is null until the asset is ready, the asset lives
+// as long as any handle to it.
+template<typename T>
+class AssetHandle {
+public:
+    AssetHandle() {}
+
+    bool valid() const {
+        return slot_ != nullptr;
+    }
+
+    AssetState state() const {
+        return slot_->state.load(std::memory_order_acquire);
+    }
+
+    bool ready() const {
+        return slot_ && state() == AssetState::Ready;
+    }
+
+    bool failed() const {
+        return slot_ && state() == AssetState::Failed;
+    }
+
+    T* get() const {
+        return ready() ? slot_->asset.get() : nullptr;
+    }
+
+    T* operator->() const {
+        return get();
+    }
+
+    const std::string& path() const {
+        return slot_->path;
+    }
+
+    void reset() {
+        slot_.reset();
+    }
+
+private:
+    friend class AssetManager;
+
+    explicit AssetHandle(const std::shared_ptr<AssetSlot<T>>& slot) : slot_(slot) {}
+
+    std::shared_ptr<AssetSlot<T>> slot_;
+};
+
+struct AssetStats {
+    size_t requested = 0;
+    size_t ready = 0;
+    size_t failed = 0;
+    size_t upload_batches = 0;
+    double max_upload_batch_ms = 0.0;
+};
+
+// Loads models, textures and motion captures on the thread pool. File parsing, Assimp import, mesh conversion and
+// simplification and image decoding run on workers, a model additionally spreads its meshes over the pool. Buffers
+// and textures are created by processUploads() on the thread that owns the GL context, a bounded batch per call,
+// so loading can go on behind rendered frames.
+class AssetManager {
+public:
+    explicit AssetManager(double upload_budget_ms = 4.0, ThreadPool& pool = ThreadPool::instance()) :
+            pool_(pool), upload_budget_ms_(upload_budget_ms) {}
+
+    AssetManager(const AssetManager&) = delete;
+    AssetManager& operator=(const AssetManager&) = delete;
+
+    // Waits for loads running on workers. Queued uploads are dropped, their assets never become ready.
+    ~AssetManager() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_.wait(lock, [this]() { return loading_ == 0; });
+    }
+
+    // The model has no motion capture, see AnimatedModel::setMotionCaptureData. Meshes are uploaded one per step.
+    AssetHandle<AnimatedModel> loadModel(const std::string& path, const ModelSettings& settings = ModelSettings()) {
+        std::shared_ptr<AssetSlot<AnimatedModel>> slot = createSlot<AnimatedModel>(path);
+        startLoad([this, slot, settings]() {
+            slot->asset.reset(new AnimatedModel(slot->path, nullptr, settings, GpuUpload::Deferred));
+            if (!slot->asset->valid()) {
+                fail(*slot);
+                return;
+            }
+            AnimatedModel* model = slot->asset.get();
+            queueUpload(slot, [model]() { return model->uploadMeshes(1); });
+        });
+        return AssetHandle<AnimatedModel>(slot);
+    }
+
+    AssetHandle<Texture> loadTexture(const std::string& path) {
+        std::shared_ptr<AssetSlot<Texture>> slot = createSlot<Texture>(path);
+        startLoad([this, slot]() {
+            std::shared_ptr<ImageData> image(new ImageData(decodeImage(slot->path)));
+            if (!image->pixels) {
+                fail(*slot);
+                return;
+            }
+            queueUpload(slot, [slot, image]() {
+                slot->asset.reset(new Texture(*image, slot->path));
+                return true;
+            });
+        });
+        return AssetHandle<Texture>(slot);
+    }
+
+    // Needs no GL, ready as soon as it is parsed, or indexed.
+    AssetHandle<MotionCaptureData> loadMotionCapture(const std::string& path,
+                                                     MotionCaptureLoading loading = MotionCaptureLoading::Full) {
+        std::shared_ptr<AssetSlot<MotionCaptureData>> slot = createSlot<MotionCaptureData>(path);
+        startLoad([this, slot, loading]() {
+            if (!std::ifstream(slot->path)) {
+                fail(*slot);
+                return;
+            }
+            slot->asset.reset(new MotionCaptureData(slot->path, loading));
+            if (!slot->asset->valid()) {
+                fail(*slot);
+                return;
+            }
+            slot->state.store(AssetState::Ready, std::memory_order_release);
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++stats_.ready;
+        });
+        return AssetHandle<MotionCaptureData>(slot);
+    }
+
+    // Runs queued uploads until the budget is used up, at least one step per call. Has to be called on the thread
+    // that owns the GL context. Returns true once nothing is left to load or upload.
+    bool processUploads() {
+        return runUploads(upload_budget_ms_);
+    }
+
+    // Blocks until every requested asset is ready or failed, uploading as loads finish.
+    void finishAll() {
+        while (!runUploads(std::numeric_limits<double>::infinity())) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            condition_.wait(lock, [this]() { return !uploads_.empty() || loading_ == 0; });
+        }
+    }
+
+    AssetStats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    template<typename T>
+    std::shared_ptr<AssetSlot<T>> createSlot(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.requested;
+        return std::make_shared<AssetSlot<T>>(path);
+    }
+
+    void startLoad(std::function<void()> load) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++loading_;
+        }
+        pool_.enqueue([this, load]() {
+            load();
+            std::lock_guard<std::mutex> lock(mutex_);
+            --loading_;
+            condition_.notify_all();
+        });
+    }
+
+    // Queues the steps creating the GL objects of a loaded asset. The step returns true once it is done.
+    template<typename T>
+    void queueUpload(const std::shared_ptr<AssetSlot<T>>& slot, std::function<bool()> step) {
+        slot->state.store(AssetState::Uploading, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(mutex_);
+        uploads_.push_back([slot, step]() {
+            if (!step()) {
+                return false;
+            }
+            slot->state.store(AssetState::Ready, std::memory_order_release);
+            return true;
+        });
+        condition_.notify_all();
+    }
+
+    template<typename T>
+    void fail(AssetSlot<T>& slot) {
+        std::cout << "ERROR::ASSET::LOAD_FAILED " << slot.path << std::endl;
+        slot.asset.reset();
+        slot.state.store(AssetState::Failed, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.failed;
+    }
+
+    bool runUploads(double budget_ms) {
+        Clock::time_point start = Clock::now();
+        bool uploaded = false;
+        while (true) {
+            std::function<bool()> step;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (uploads_.empty()) {
+                    break;
+                }
+                step = std::move(uploads_.front());
+                uploads_.pop_front();
+            }
+            bool done = step();
+            uploaded = true;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (done) {
+                    ++stats_.ready;
+                } else {
+                    uploads_.push_front(std::move(step));
+                }
+            }
+            if (std::chrono::duration<double, std::milli>(Clock::now() - start).count() >= budget_ms) {
+                break;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (uploaded) {
+            ++stats_.upload_batches;
+            stats_.max_upload_batch_ms = std::max(
+                    stats_.max_upload_batch_ms,
+                    std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+        }
+        return uploads_.empty() && loading_ == 0;
+    }
+
+    ThreadPool& pool_;
+    double upload_budget_ms_;
+    mutable std::mutex mutex_;
+    std::condition_variable condition_; // Signalled when a load finishes or an upload is queued
+    std::deque<std::function<bool()>> uploads_;
+    size_t loading_ = 0;
+    AssetStats stats_;
+};
+
+#endif //FIRST_TRY_ASSET_MANAGER_H
@@ -0,0 +1,53 @@
+#ifndef FIRST_TRY_BINARY_IO_H
+#define FIRST_TRY_BINARY_IO_H
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Raw native endian serialization for cache files that never leave the machine that wrote them.
+
+template<typename T>
+void writeValue(std::ostream& stream, const T& value) {
+    stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+T readValue(std::istream& stream) {
+    T value = T(); // Stays zero if the stream fails, so sizes read from a bad stream are empty
+    stream.read(reinterpret_cast<char*>(&value), sizeof(T));
+    return value;
+}
+
+template<typename T>
+void writeVector(std::ostream& stream, const std::vector<T>& values) {
+    writeValue<uint64_t>(stream, values.size());
+    if (!values.empty()) {
+        stream.write(reinterpret_cast<const char*>(&values[0]), values.size() * sizeof(T));
+    }
+}
+
+template<typename T>
+void readVector(std::istream& stream, std::vector<T>& values) {
+    values.resize(readValue<uint64_t>(stream));
+    if (!values.empty()) {
+        stream.read(reinterpret_cast<char*>(&values[0]), values.size() * sizeof(T));
+    }
+}
+
+void writeString(std::ostream& stream, const std::string& value) {
+    writeValue<uint32_t>(stream, static_cast<uint32_t>(value.size()));
+    stream.write(value.data(), value.size());
+}
+
+std::string readString(std::istream& stream) {
+    std::string value(readValue<uint32_t>(stream), '\0');
+    if (!value.empty()) {
+        stream.read(&value[0], value.size());
+    }
+    return value;
+}
+
+#endif //FIRST_TRY_BINARY_IO_H
@@ -0,0 +1,77 @@
+#ifndef FIRST_TRY_BVH_H
+#define FIRST_TRY_BVH_H
+
+#include <glm/glm.hpp>
+
+#define GLM_ENABLE_EXPERIMENTAL
+
+#include <glm/gtx/quaternion.hpp>
+#include <glm/gtx/transform.hpp>
+
+#include <istream>
+#include <string>
+#include <vector>
+
+// Bones of a BVH hierarchy in file order, which is the order of their channels in a motion frame.
+struct BvhHierarchy {
+    std::vector<std::string> bones;
+    std::vector<glm::vec3> offsets; // In file units
+};
+
+// Reads from HIERARCHY up to and including MOTION. Returns false if the input is not a BVH hierarchy.
+bool readBvhHierarchy(std::istream& input, BvhHierarchy& hierarchy) {
+    std::string token;
+    if (!(input >> token) || token != "HIERARCHY") {
+        return false;
+    }
+    while (input >> token && token != "MOTION") {
+        if (token != "ROOT" && token != "JOINT") {
+            continue;
+        }
+        std::string bone_name;
+        input >> bone_name >> token >> token;
+        if (token != "OFFSET") {
+            return false;
+        }
+        glm::vec3 offset;
+        input >> offset.x >> offset.y >> offset.z;
+        int channels;
+        input >> token >> channels;
+        if (token != "CHANNELS") {
+            return false;
+        }
+        for (int i = 0; i < channels; ++i) {
+            input >> token;
+        }
+        hierarchy.bones.push_back(bone_name);
+        hierarchy.offsets.push_back(offset);
+    }
+    return token == "MOTION" && !hierarchy.bones.empty();
+}
+
+// Channels of a motion frame: position and rotation of the root, a rotation for every other bone.
+size_t bvhChannelCount(size_t num_bones) {
+    return 3 + 3 * num_bones;
+}
+
+// Converts the channels of one motion frame to the root position, scaled to model units, and a rotation per bone,
+// in the axes of the model.
+void decodeBvhFrame(const float* channels, size_t num_bones, float scale, glm::vec3& root_position,
+                    glm::quat* rotations) {
+    root_position = glm::vec3(channels[0], channels[1], channels[2]) * scale;
+    float z_rot = channels[3], y_rot = channels[4], x_rot = channels[5];
+    rotations[0] = glm::quat_cast(glm::rotate(glm::radians(z_rot), glm::vec3(0.0f, -1.0f, 0.0f))
+                                  * glm::rotate(glm::radians(y_rot), glm::vec3(0.0f, 0.0f, 1.0f))
+                                  * glm::rotate(glm::radians(x_rot), glm::vec3(1.0f, 0.0f, 0.0f)));
+    for (size_t bone = 1; bone < num_bones; ++bone) {
+        const float* bone_channels = channels + 3 + 3 * bone;
+        z_rot = bone_channels[0];
+        x_rot = bone_channels[1];
+        y_rot = bone_channels[2];
+        rotations[bone] = glm::quat_cast(glm::rotate(glm::radians(z_rot), glm::vec3(0.0f, 0.0f, 1.0f))
+                                         * glm::rotate(glm::radians(x_rot), glm::vec3(1.0f, 0.0f, 0.0f))
+                                         * glm::rotate(glm::radians(y_rot), glm::vec3(0.0f, 1.0f, 0.0f)));
+    }
+}
+
+#endif //FIRST_TRY_BVH_H
@@ -0,0 +1,313 @@
+#ifndef FIRST_TRY_BVH_INDEX_H
+#define FIRST_TRY_BVH_INDEX_H
+
+#include <glm/glm.hpp>
+
+#include "binary_io.h"
+#include "bvh.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// File offset of every motion frame of a BVH file. Offsets are stored relative to the first frame of their block,
+// 4 bytes per frame and 8 per block.
+class BvhFrameIndex {
+public:
+    static const size_t FRAMES_PER_BLOCK = 4096;
+
+    size_t size() const {
+        return frame_offsets_.size();
+    }
+
+    uint64_t offset(size_t frame) const {
+        return block_offsets_[frame / FRAMES_PER_BLOCK] + frame_offsets_[frame];
+    }
+
+    // False if the frame is too far from the start of its block, a line of more than 1 MiB on average.
+    bool push(uint64_t offset) {
+        if (frame_offsets_.size() % FRAMES_PER_BLOCK == 0) {
+            block_offsets_.push_back(offset);
+        }
+        uint64_t relative = offset - block_offsets_.back();
+        if (relative > UINT32_MAX) {
+            return false;
+        }
+        frame_offsets_.push_back(static_cast<uint32_t>(relative));
+        return true;
+    }
+
+    size_t bytes() const {
+        return block_offsets_.size() * sizeof(uint64_t) + frame_offsets_.size() * sizeof(uint32_t);
+    }
+
+    void write(std::ostream& stream) const {
+        writeVector(stream, block_offsets_);
+        writeVector(stream, frame_offsets_);
+    }
+
+    void read(std::istream& stream) {
+        readVector(stream, block_offsets_);
+        readVector(stream, frame_offsets_);
+    }
+
+private:
+    std::vector<uint64_t> block_offsets_;
+    std::vector<uint32_t> frame_offsets_;
+};
+
+struct IndexedBvhStats {
+    size_t index_bytes = 0;
+    double index_ms = 0.0;    // Building or loading the index
+    bool index_loaded = false; // From the sidecar file
+    size_t decoded_frames = 0;
+    size_t window_misses = 0;
+};
+
+// Decoded motion frame of an IndexedBvhFile.
+struct BvhFrame {
+    glm::vec3 root_position;
+    const glm::quat* rotations; // One per bone
+};
+
+// Text BVH file read on demand. The file is memory mapped and indexed by one scan for newlines, the index is kept
+// next to it in <path>.index for the next time. Frames are only decoded when asked for, into a window of recent
+// frames, so memory stays bounded however long the capture is.
+class IndexedBvhFile {
+public:
+    IndexedBvhFile(const std::string& path, float scale, size_t window_frames = 256) :
+            path_(path), scale_(scale), window_frames_(window_frames) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat file_stat;
+        if (fd < 0 || fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            std::cout << "ERROR::BVH::OPEN_FAILED " << path << std::endl;
+            return;
+        }
+        size_ = static_cast<size_t>(file_stat.st_size);
+        modified_ = static_cast<int64_t>(file_stat.st_mtime);
+        void* mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            std::cout << "ERROR::BVH::MAP_FAILED " << path << std::endl;
+            return;
+        }
+        data_ = static_cast<const char*>(mapping);
+        // Read mostly front to back, while playing.
+        madvise(mapping, size_, MADV_SEQUENTIAL);
+
+        if (!readHeader()) {
+            std::cout << "ERROR::BVH::INVALID_HEADER " << path << std::endl;
+            return;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        stats_.index_loaded = loadIndex();
+        if (!stats_.index_loaded) {
+            if (!buildIndex()) {
+                std::cout << "ERROR::BVH::INVALID_MOTION " << path << std::endl;
+                return;
+            }
+            saveIndex();
+        }
+        stats_.index_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        stats_.index_bytes = index_.bytes();
+
+        size_t num_bones = hierarchy_.bones.size();
+        channels_.resize(bvhChannelCount(num_bones));
+        window_rotations_.resize(window_frames_ * num_bones);
+        window_roots_.resize(window_frames_);
+        window_tags_.assign(window_frames_, SIZE_MAX);
+        valid_ = true;
+    }
+
+    IndexedBvhFile(const IndexedBvhFile&) = delete;
+    IndexedBvhFile& operator=(const IndexedBvhFile&) = delete;
+
+    ~IndexedBvhFile() {
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    bool valid() const {
+        return valid_;
+    }
+
+    const BvhHierarchy& hierarchy() const {
+        return hierarchy_;
+    }
+
+    size_t numFrames() const {
+        return index_.size();
+    }
+
+    double frameTime() const {
+        return frame_time_;
+    }
+
+    const IndexedBvhStats& stats() const {
+        return stats_;
+    }
+
+    // A frame outside the window is decoded together with the next one, which interpolation asks for with it.
+    // Only a miss at or just past the end of the frames decoded last, playback running front to back, reads the
+    // half window ahead. Samplers far apart in the capture, like a crowd with time offsets, then cost two frames
+    // each instead of evicting each other's read ahead. The rotations stay valid until another frame is decoded
+    // into the slot of the frame, number % window size.
+    BvhFrame frame(size_t number) {
+        size_t slot = number % window_frames_;
+        if (window_tags_[slot] != number) {
+            ++stats_.window_misses;
+            bool sequential = number >= run_end_ && number - run_end_ <= SEQUENTIAL_GAP;
+            size_t count = std::min(sequential ? std::max<size_t>(window_frames_ / 2, 2) : 2, window_frames_);
+            size_t end = std::min(number + count, numFrames());
+            for (size_t next = number; next < end; ++next) {
+                if (window_tags_[next % window_frames_] != next) {
+                    decode(next);
+                }
+            }
+            run_end_ = end;
+        }
+        return {window_roots_[slot], &window_rotations_[slot * hierarchy_.bones.size()]};
+    }
+
+private:
+    static const uint32_t MAGIC = 0x49485642; // "BVHI"
+    static const uint32_t VERSION = 1;
+    // Frames playback may step over between two samples and still read ahead, at low frame rates.
+    static const size_t SEQUENTIAL_GAP = 4;
+
+    // Header up to the Frame Time line, the motion starts on the line after it.
+    bool readHeader() {
+        const char* motion = static_cast<const char*>(memmem(data_, size_, "MOTION", 6));
+        const char* frame_time = motion ? static_cast<const char*>(
+                memmem(motion, size_ - (motion - data_), "Frame Time:", 11)) : nullptr;
+        if (!frame_time) {
+            return false;
+        }
+        const char* line_end = static_cast<const char*>(std::memchr(frame_time, '\n', size_ - (frame_time - data_)));
+        motion_start_ = line_end ? line_end + 1 - data_ : size_;
+        std::istringstream header(std::string(data_, motion_start_));
+        std::string token;
+        if (!readBvhHierarchy(header, hierarchy_) || !(header >> token >> token) ||
+            !(header >> token >> token >> frame_time_)) {
+            return false;
+        }
+        return frame_time_ > 0.0;
+    }
+
+    // One pass over the motion, a frame starts every line that is not blank.
+    bool buildIndex() {
+        size_t position = motion_start_;
+        while (position < size_) {
+            const char* line = data_ + position;
+            const char* newline = static_cast<const char*>(std::memchr(line, '\n', size_ - position));
+            size_t line_end = newline ? newline - data_ : size_;
+            const char* text = line;
+            while (text < data_ + line_end && (*text == ' ' || *text == '\t' || *text == '\r')) {
+                ++text;
+            }
+            if (text < data_ + line_end && !index_.push(position)) {
+                return false;
+            }
+            position = line_end + 1;
+        }
+        return index_.size() > 0;
+    }
+
+    std::string indexPath() const {
+        return path_ + ".index";
+    }
+
+    // Only an index of this very file, by size and modification time, is taken.
+    bool loadIndex() {
+        std::ifstream file(indexPath(), std::ios::binary);
+        if (!file || readValue<uint32_t>(file) != MAGIC || readValue<uint32_t>(file) != VERSION ||
+            readValue<uint64_t>(file) != size_ || readValue<int64_t>(file) != modified_) {
+            return false;
+        }
+        index_.read(file);
+        if (!file || index_.size() == 0) {
+            index_ = BvhFrameIndex();
+            return false;
+        }
+        return true;
+    }
+
+    void saveIndex() const {
+        std::string temporary_path = indexPath() + ".tmp";
+        {
+            std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+            if (!file) {
+                return;
+            }
+            writeValue(file, uint32_t(MAGIC));
+            writeValue(file, uint32_t(VERSION));
+            writeValue<uint64_t>(file, size_);
+            writeValue<int64_t>(file, modified_);
+            index_.write(file);
+            if (!file) {
+                std::remove(temporary_path.c_str());
+                return;
+            }
+        }
+        // Readers never see a partly written index.
+        std::rename(temporary_path.c_str(), indexPath().c_str());
+    }
+
+    void decode(size_t frame) {
+        size_t begin = index_.offset(frame);
+        size_t end = frame + 1 < numFrames() ? index_.offset(frame + 1) : size_;
+        // Copied to be terminated, strtof must not run past the mapping.
+        line_.assign(data_ + begin, data_ + end);
+        line_.push_back('\0');
+        const char* cursor = line_.data();
+        for (float& channel : channels_) {
+            char* next;
+            channel = std::strtof(cursor, &next);
+            cursor = next;
+        }
+        size_t slot = frame % window_frames_;
+        decodeBvhFrame(channels_.data(), hierarchy_.bones.size(), scale_, window_roots_[slot],
+                       &window_rotations_[slot * hierarchy_.bones.size()]);
+        window_tags_[slot] = frame;
+        ++stats_.decoded_frames;
+    }
+
+    std::string path_;
+    float scale_;
+    size_t window_frames_;
+    bool valid_ = false;
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    int64_t modified_ = 0;
+    size_t motion_start_ = 0;
+    BvhHierarchy hierarchy_;
+    double frame_time_ = 0.0;
+    BvhFrameIndex index_;
+
+    // Frame n is decoded into slot n % window_frames_.
+    std::vector<glm::quat> window_rotations_;
+    std::vector<glm::vec3> window_roots_;
+    std::vector<size_t> window_tags_; // Frame in each slot, SIZE_MAX if none
+    size_t run_end_ = 0;              // One past the frames decoded by the last miss
+    std::vector<char> line_;
+    std::vector<float> channels_;
+    IndexedBvhStats stats_;
+};
+
+#endif //FIRST_TRY_BVH_INDEX_H
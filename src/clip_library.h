@@ -0,0 +1,386 @@
+#ifndef FIRST_TRY_CLIP_LIBRARY_H
+#define FIRST_TRY_CLIP_LIBRARY_H
+
+#include "animation_clip.h"
+#include "animation_compression.h"
+#include "frame_memory.h"
+#include "thread_pool.h"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct ClipLibraryStats {
+    size_t registered_clips = 0;
+    size_t resident_bytes = 0;
+    size_t peak_resident_bytes = 0;
+    size_t chunk_hits = 0;
+    size_t chunk_loads = 0;       // Loads that blocked sampling
+    size_t chunk_prefetches = 0;  // Loads finished in the background
+    size_t chunk_evictions = 0;
+    double total_load_ms = 0.0;
+    double max_load_ms = 0.0;
+
+    double averageLoadMs() const {
+        size_t loads = chunk_loads + chunk_prefetches;
+        return loads == 0 ? 0.0 : total_load_ms / loads;
+    }
+};
+
+// Clips registered by name and kept on disk in chunks of a fixed duration. Chunks are read on first use and the
+// least recently used ones are evicted once the resident chunks go over the memory budget, so even very long
+// clips are never fully resident. The chunk after the one being played is prefetched on the thread pool.
+// The budget is exceeded only by chunks sampled in the current frame.
+// Every library has a cache file of its own in the cache directory, $TMPDIR or /tmp by default, removed once
+// neither the library nor a prefetch needs it anymore. Chunks that cannot be written to it are kept in memory.
+class ClipLibrary {
+public:
+    ClipLibrary(size_t memory_budget, double chunk_duration, const CompressionSettings* compression = nullptr,
+                const std::string& cache_directory = std::string()) :
+            memory_budget_(memory_budget), chunk_duration_(chunk_duration), prefetched_(new PrefetchQueue) {
+        if (compression) {
+            compress_ = true;
+            compression_ = *compression;
+        }
+        std::string directory = cache_directory.empty() ? temporaryDirectory() : cache_directory;
+        std::vector<char> path_template(directory.begin(), directory.end());
+        const std::string name = "/first_try_clips_XXXXXX";
+        path_template.insert(path_template.end(), name.begin(), name.end());
+        path_template.push_back('\0');
+        int fd = mkstemp(path_template.data());
+        if (fd >= 0) {
+            close(fd);
+            cache_.reset(new CacheFile(path_template.data()));
+            cache_file_.open(cache_->path, std::ios::binary | std::ios::out | std::ios::trunc);
+        }
+        if (!cache_file_.is_open()) {
+            std::cout << "ERROR::CLIP_LIBRARY::CANNOT_OPEN_CACHE in " << directory << ", keeping clips in memory"
+                      << std::endl;
+        }
+    }
+
+    // Writes the clip to the cache in chunks. Nothing stays resident until the clip is sampled.
+    int registerClip(const AnimationClip& clip) {
+        ClipInfo info;
+        info.name = clip.name();
+        info.start_time = clip.startTime();
+        info.duration = clip.duration();
+        size_t num_chunks = std::max<size_t>(1, static_cast<size_t>(std::ceil(info.duration / chunk_duration_)));
+        for (size_t i = 0; i < num_chunks; ++i) {
+            double begin = info.start_time + i * chunk_duration_;
+            AnimationClip chunk = clip.slice(begin, std::min(begin + chunk_duration_, info.start_time + info.duration));
+            if (compress_) {
+                compression_stats_.merge(chunk.compress(compression_));
+            }
+            std::ostringstream serialized;
+            chunk.write(serialized);
+            std::shared_ptr<const std::string> bytes(new std::string(serialized.str()));
+            ChunkInfo stored = {0, bytes->size(), nullptr};
+            if (cache_file_.is_open()) {
+                std::streamoff offset = cache_file_.tellp();
+                cache_file_.write(bytes->data(), bytes->size());
+                cache_file_.flush();
+                if (offset >= 0 && cache_file_) {
+                    stored.offset = static_cast<uint64_t>(offset);
+                    bytes.reset();
+                } else {
+                    std::cout << "ERROR::CLIP_LIBRARY::CANNOT_WRITE_CACHE " << cache_->path
+                              << ", keeping clips in memory" << std::endl;
+                    cache_file_.close();
+                }
+            }
+            stored.bytes = bytes;
+            info.chunks.push_back(stored);
+        }
+        clips_.push_back(info);
+        ++stats_.registered_clips;
+        return static_cast<int>(clips_.size() - 1);
+    }
+
+    size_t size() const {
+        return clips_.size();
+    }
+
+    const std::string& name(int clip) const {
+        return clips_[clip].name;
+    }
+
+    double duration(int clip) const {
+        return clips_[clip].duration;
+    }
+
+    int find(const std::string& name) const {
+        for (size_t i = 0; i < clips_.size(); ++i) {
+            if (clips_[i].name == name) {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    double loopTime(int clip, double time) const {
+        const ClipInfo& info = clips_[clip];
+        return info.duration > 0.0 ? std::fmod(time, info.duration) + info.start_time : info.start_time;
+    }
+
+    // Chunks acquired in a frame are never evicted before the next one, so their pointers stay valid until then.
+    void beginFrame() {
+        collectPrefetched();
+        evict();
+        ++frame_;
+    }
+
+    // Chunk of the clip that covers the clip time, loading it if needed.
+    const AnimationClip* acquire(int clip, double clip_time) {
+        const ClipInfo& info = clips_[clip];
+        size_t chunk_index = chunkIndex(info, clip_time);
+        uint64_t key = chunkKey(clip, chunk_index);
+
+        auto it = resident_.find(key);
+        if (it == resident_.end()) {
+            collectPrefetched();
+            it = resident_.find(key);
+        }
+        if (it != resident_.end()) {
+            ++stats_.chunk_hits;
+            lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+        } else {
+            ScopedAllocationAllowance streaming;
+            auto start = std::chrono::steady_clock::now();
+            std::unique_ptr<AnimationClip> chunk(loadChunk(cache_, info.chunks[chunk_index], info.name));
+            recordLoad(start, stats_.chunk_loads);
+            it = insertResident(key, std::move(chunk));
+            evict();
+        }
+        it->second.last_used_frame = frame_;
+
+        // Playback is past the middle of the chunk, fetch the following one.
+        double chunk_start = info.start_time + chunk_index * chunk_duration_;
+        if (info.chunks.size() > 1 && clip_time - chunk_start > chunk_duration_ * 0.5) {
+            prefetch(clip, (chunk_index + 1) % info.chunks.size());
+        }
+        return it->second.chunk.get();
+    }
+
+    const ClipLibraryStats& stats() const {
+        return stats_;
+    }
+
+    // Accumulated over all registered clips, empty when compression is off.
+    const CompressionStats& compressionStats() const {
+        return compression_stats_;
+    }
+
+    size_t memoryBudget() const {
+        return memory_budget_;
+    }
+
+    void setMemoryBudget(size_t memory_budget) {
+        memory_budget_ = memory_budget;
+        evict();
+    }
+
+private:
+    struct ChunkInfo {
+        uint64_t offset;
+        uint64_t size;
+        std::shared_ptr<const std::string> bytes; // Set if the chunk is kept in memory instead of the cache
+    };
+
+    // Removes the file with the last reference, prefetch tasks keep it alive past the library.
+    struct CacheFile {
+        explicit CacheFile(const std::string& path) : path(path) {}
+
+        ~CacheFile() {
+            std::remove(path.c_str());
+        }
+
+        std::string path;
+    };
+
+    struct ClipInfo {
+        std::string name;
+        double start_time;
+        double duration;
+        std::vector<ChunkInfo> chunks;
+    };
+
+    struct ResidentChunk {
+        std::unique_ptr<AnimationClip> chunk;
+        size_t bytes;
+        uint64_t last_used_frame;
+        std::list<uint64_t>::iterator lru_position;
+    };
+
+    // Filled by prefetch tasks, which may outlive the library.
+    struct PrefetchQueue {
+        std::mutex mutex;
+        std::vector<std::pair<uint64_t, AnimationClip*>> loaded;
+        double load_ms = 0.0;
+        double max_load_ms = 0.0;
+
+        ~PrefetchQueue() {
+            for (const auto& entry : loaded) {
+                delete entry.second;
+            }
+        }
+    };
+
+    static uint64_t chunkKey(int clip, size_t chunk) {
+        return (static_cast<uint64_t>(clip) << 32) | chunk;
+    }
+
+    size_t chunkIndex(const ClipInfo& info, double clip_time) const {
+        double offset = std::max(0.0, clip_time - info.start_time);
+        return std::min(static_cast<size_t>(offset / chunk_duration_), info.chunks.size() - 1);
+    }
+
+    static std::string temporaryDirectory() {
+        const char* directory = std::getenv("TMPDIR");
+        return directory && *directory ? directory : "/tmp";
+    }
+
+    // A chunk that cannot be read back is reported and loaded as an empty clip, which leaves the bones posed
+    // by the layers below.
+    static AnimationClip* loadChunk(const std::shared_ptr<CacheFile>& cache, const ChunkInfo& chunk,
+                                    const std::string& clip_name) {
+        if (chunk.bytes) {
+            std::istringstream stream(*chunk.bytes);
+            return new AnimationClip(AnimationClip::read(stream));
+        }
+        std::ifstream file(cache->path, std::ios::binary);
+        file.seekg(chunk.offset);
+        if (file) {
+            AnimationClip* loaded = new AnimationClip(AnimationClip::read(file));
+            if (file) {
+                return loaded;
+            }
+            delete loaded;
+        }
+        std::cout << "ERROR::CLIP_LIBRARY::CANNOT_READ_CHUNK " << clip_name << " from " << cache->path << std::endl;
+        return new AnimationClip(clip_name);
+    }
+
+    void recordLoad(std::chrono::steady_clock::time_point start, size_t& counter) {
+        double load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        ++counter;
+        stats_.total_load_ms += load_ms;
+        stats_.max_load_ms = std::max(stats_.max_load_ms, load_ms);
+    }
+
+    std::unordered_map<uint64_t, ResidentChunk>::iterator insertResident(uint64_t key,
+                                                                         std::unique_ptr<AnimationClip> chunk) {
+        lru_.push_front(key);
+        size_t bytes = chunk->sizeInBytes();
+        ResidentChunk resident = {std::move(chunk), bytes, frame_, lru_.begin()};
+        auto it = resident_.insert(std::make_pair(key, std::move(resident))).first;
+        stats_.resident_bytes += bytes;
+        stats_.peak_resident_bytes = std::max(stats_.peak_resident_bytes, stats_.resident_bytes);
+        return it;
+    }
+
+    void prefetch(int clip, size_t chunk_index) {
+        uint64_t key = chunkKey(clip, chunk_index);
+        ChunkInfo chunk = clips_[clip].chunks[chunk_index];
+        // The serialized size is close to the resident one. A chunk that does not fit would only evict the
+        // current one, so it is loaded when needed instead.
+        if (resident_.count(key) || pending_.count(key) || chunk.size > memory_budget_) {
+            return;
+        }
+        evict(memory_budget_ - chunk.size);
+        if (stats_.resident_bytes + chunk.size > memory_budget_) {
+            return;
+        }
+        ScopedAllocationAllowance streaming;
+        pending_.insert(key);
+        std::shared_ptr<PrefetchQueue> queue = prefetched_;
+        std::shared_ptr<CacheFile> cache = cache_;
+        std::string clip_name = clips_[clip].name;
+        ThreadPool::instance().enqueue([queue, cache, chunk, clip_name, key]() {
+            auto start = std::chrono::steady_clock::now();
+            AnimationClip* loaded = loadChunk(cache, chunk, clip_name);
+            double load_ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start).count();
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->loaded.push_back(std::make_pair(key, loaded));
+            queue->load_ms += load_ms;
+            queue->max_load_ms = std::max(queue->max_load_ms, load_ms);
+        });
+    }
+
+    void collectPrefetched() {
+        ScopedAllocationAllowance streaming;
+        std::vector<std::pair<uint64_t, AnimationClip*>> loaded;
+        {
+            std::lock_guard<std::mutex> lock(prefetched_->mutex);
+            loaded.swap(prefetched_->loaded);
+            stats_.total_load_ms += prefetched_->load_ms;
+            stats_.max_load_ms = std::max(stats_.max_load_ms, prefetched_->max_load_ms);
+            prefetched_->load_ms = 0.0;
+        }
+        for (const auto& entry : loaded) {
+            std::unique_ptr<AnimationClip> chunk(entry.second);
+            pending_.erase(entry.first);
+            ++stats_.chunk_prefetches;
+            // A blocking load may have been faster.
+            if (!resident_.count(entry.first)) {
+                insertResident(entry.first, std::move(chunk));
+            }
+        }
+        if (!loaded.empty()) {
+            evict();
+        }
+    }
+
+    void evict() {
+        evict(memory_budget_);
+    }
+
+    // Least recently used first, skipping chunks in use this frame.
+    void evict(size_t target_bytes) {
+        auto position = lru_.end();
+        while (stats_.resident_bytes > target_bytes && position != lru_.begin()) {
+            --position;
+            auto it = resident_.find(*position);
+            if (it->second.last_used_frame == frame_) {
+                continue;
+            }
+            stats_.resident_bytes -= it->second.bytes;
+            ++stats_.chunk_evictions;
+            resident_.erase(it);
+            position = lru_.erase(position);
+        }
+    }
+
+    std::shared_ptr<CacheFile> cache_; // Null if the cache could not be created
+    std::ofstream cache_file_;
+    size_t memory_budget_;
+    double chunk_duration_;
+    bool compress_ = false;
+    CompressionSettings compression_;
+    CompressionStats compression_stats_;
+
+    std::vector<ClipInfo> clips_;
+    std::unordered_map<uint64_t, ResidentChunk> resident_;
+    std::list<uint64_t> lru_; // Most recently used first
+    std::unordered_set<uint64_t> pending_;
+    std::shared_ptr<PrefetchQueue> prefetched_;
+    uint64_t frame_ = 0;
+    ClipLibraryStats stats_;
+};
+
+#endif //FIRST_TRY_CLIP_LIBRARY_H
@@ -0,0 +1,265 @@
+#ifndef FIRST_TRY_CLUSTERED_LIGHTING_H
+#define FIRST_TRY_CLUSTERED_LIGHTING_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "array_view.h"
+#include "frame_memory.h"
+#include "shader.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Light falls off to nothing at the radius, it affects only the clusters the sphere touches.
+struct PointLight {
+    glm::vec3 position;
+    float radius;
+    glm::vec3 color;
+};
+
+struct ClusterStats {
+    size_t lights = 0;
+    size_t visible_lights = 0;
+    size_t light_references = 0; // Light indices over all clusters
+    size_t max_cluster_lights = 0;
+};
+
+// Lights binned for one frame, in the frame arena. Built by ClusteredLights::update, which needs no GL, and handed
+// to upload() and setUniforms() on the thread that owns the context.
+struct LightClusterFrame {
+    ArrayView<const glm::vec4> light_data;   // Two texels per light: position and radius, color
+    ArrayView<const uint32_t> cluster_offsets; // Lights of cluster i are at [offsets[i], offsets[i + 1])
+    ArrayView<const uint32_t> light_indices;
+    float near_plane = 0.1f;
+    float slice_scale = 1.0f;
+    float tile_width = 1.0f;
+    float tile_height = 1.0f;
+};
+
+// Clustered forward lighting. The view frustum is split into screen tiles and exponential depth slices, every frame
+// update() bins the lights into these clusters on the CPU, upload() copies them to texture buffers, and the lit
+// fragment shaders loop over the lights of their cluster only. Buffers are kept between frames, a steady light
+// count allocates nothing.
+class ClusteredLights {
+public:
+    // Texture units of the buffers, the ones below are taken by material maps.
+    static const int FIRST_TEXTURE_UNIT = 2;
+
+    explicit ClusteredLights(int tiles_x = 16, int tiles_y = 9, int slices = 24) :
+            tiles_x_(tiles_x), tiles_y_(tiles_y), slices_(slices) {
+        glGenBuffers(3, buffers_);
+        glGenTextures(3, textures_);
+        const GLenum formats[3] = {GL_RGBA32F, GL_R32UI, GL_R32UI};
+        for (int i = 0; i < 3; ++i) {
+            glBindBuffer(GL_TEXTURE_BUFFER, buffers_[i]);
+            glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+            glBindTexture(GL_TEXTURE_BUFFER, textures_[i]);
+            glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers_[i]);
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+
+    ClusteredLights(const ClusteredLights&) = delete;
+    ClusteredLights& operator=(const ClusteredLights&) = delete;
+
+    ~ClusteredLights() {
+        glDeleteTextures(3, textures_);
+        glDeleteBuffers(3, buffers_);
+    }
+
+    // Free to change between frames, positions are in world space.
+    std::vector<PointLight>& lights() {
+        return lights_;
+    }
+
+    const ClusterStats& stats() const {
+        return stats_;
+    }
+
+    int numClusters() const {
+        return tiles_x_ * tiles_y_ * slices_;
+    }
+
+    // Bins the lights for the camera into the arena. The projection has to be a symmetric perspective one with
+    // the given near and far planes. Touches no GL, the lights may change again once it returns.
+    LightClusterFrame update(const glm::mat4& view, const glm::mat4& projection, float near_plane, float far_plane,
+                             int screen_width, int screen_height, FrameArena& arena) {
+        near_ = near_plane;
+        far_ = far_plane;
+        slice_scale_ = slices_ / std::log(far_plane / near_plane);
+        tile_width_ = static_cast<float>((screen_width + tiles_x_ - 1) / tiles_x_);
+        tile_height_ = static_cast<float>((screen_height + tiles_y_ - 1) / tiles_y_);
+        screen_width_ = static_cast<float>(screen_width);
+        screen_height_ = static_cast<float>(screen_height);
+        projection_scale_ = glm::vec2(projection[0][0], projection[1][1]);
+
+        ArrayView<glm::vec4> light_data = arena.allocate<glm::vec4>(lights_.size() * 2);
+        view_lights_.resize(lights_.size());
+        for (size_t i = 0; i < lights_.size(); ++i) {
+            const PointLight& light = lights_[i];
+            light_data[2 * i] = glm::vec4(light.position, light.radius);
+            light_data[2 * i + 1] = glm::vec4(light.color, 0.0f);
+            view_lights_[i] = glm::vec4(glm::vec3(view * glm::vec4(light.position, 1.0f)), light.radius);
+        }
+
+        // Counting sort: count the lights per cluster, turn the counts into offsets, then fill.
+        ArrayView<uint32_t> cluster_offsets = arena.allocate<uint32_t>(numClusters() + 1);
+        stats_ = ClusterStats();
+        stats_.lights = lights_.size();
+        for (size_t i = 0; i < view_lights_.size(); ++i) {
+            bool visible = false;
+            forEachCluster(view_lights_[i], [&cluster_offsets, &visible](int cluster) {
+                ++cluster_offsets[cluster + 1];
+                visible = true;
+            });
+            stats_.visible_lights += visible;
+        }
+        for (int cluster = 0; cluster < numClusters(); ++cluster) {
+            stats_.max_cluster_lights = std::max<size_t>(stats_.max_cluster_lights, cluster_offsets[cluster + 1]);
+            cluster_offsets[cluster + 1] += cluster_offsets[cluster];
+        }
+        stats_.light_references = cluster_offsets[numClusters()];
+        ArrayView<uint32_t> light_indices = arena.allocate<uint32_t>(stats_.light_references);
+        fill_cursors_.assign(cluster_offsets.begin(), cluster_offsets.end() - 1);
+        for (size_t i = 0; i < view_lights_.size(); ++i) {
+            uint32_t light = static_cast<uint32_t>(i);
+            forEachCluster(view_lights_[i], [this, &light_indices, light](int cluster) {
+                light_indices[fill_cursors_[cluster]++] = light;
+            });
+        }
+
+        LightClusterFrame frame;
+        frame.light_data = light_data;
+        frame.cluster_offsets = cluster_offsets;
+        frame.light_indices = light_indices;
+        frame.near_plane = near_;
+        frame.slice_scale = slice_scale_;
+        frame.tile_width = tile_width_;
+        frame.tile_height = tile_height_;
+        return frame;
+    }
+
+    // Copies a binned frame to the cluster buffers.
+    void upload(const LightClusterFrame& frame) {
+        upload(0, frame.light_data.data(), frame.light_data.size() * sizeof(glm::vec4));
+        upload(1, frame.cluster_offsets.data(), frame.cluster_offsets.size() * sizeof(uint32_t));
+        upload(2, frame.light_indices.data(), frame.light_indices.size() * sizeof(uint32_t));
+    }
+
+    // Binds the buffers to their texture units, once per frame for every lit shader.
+    void bind() const {
+        for (int i = 0; i < 3; ++i) {
+            glActiveTexture(GL_TEXTURE0 + FIRST_TEXTURE_UNIT + i);
+            glBindTexture(GL_TEXTURE_BUFFER, textures_[i]);
+        }
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    // Sets the cluster uniforms of a lit shader for the uploaded frame, the shader has to be in use.
+    void setUniforms(const ShaderProgram& shader, const LightClusterFrame& frame) const {
+        shader.setInt("lightData", FIRST_TEXTURE_UNIT);
+        shader.setInt("clusterOffsets", FIRST_TEXTURE_UNIT + 1);
+        shader.setInt("clusterLights", FIRST_TEXTURE_UNIT + 2);
+        const int grid[3] = {tiles_x_, tiles_y_, slices_};
+        shader.setInt("clusterGrid", ArrayView<const int>(grid, 3));
+        const float tile_size[2] = {frame.tile_width, frame.tile_height};
+        shader.setFloatVector("clusterTileSize", ArrayView<const float>(tile_size, 2));
+        const float depth[2] = {frame.near_plane, frame.slice_scale};
+        shader.setFloatVector("clusterDepth", ArrayView<const float>(depth, 2));
+    }
+
+private:
+    // Calls visit(cluster) for every cluster the light sphere may touch. Per depth slice the sphere is narrowed to
+    // its cross section within the slice and bounded on screen by projecting the corners of its view space box.
+    template<typename Visit>
+    void forEachCluster(const glm::vec4& light, const Visit& visit) const {
+        float radius = light.w;
+        float depth = -light.z;
+        float min_depth = std::max(depth - radius, near_);
+        float max_depth = std::min(depth + radius, far_);
+        if (min_depth >= max_depth) {
+            return;
+        }
+        int first_slice = sliceOf(min_depth);
+        int last_slice = sliceOf(max_depth);
+        for (int slice = first_slice; slice <= last_slice; ++slice) {
+            float slice_near = std::max(min_depth, sliceDepth(slice));
+            float slice_far = std::min(max_depth, sliceDepth(slice + 1));
+            // Distance from the light center to the closest depth of the slice.
+            float offset = depth < slice_near ? slice_near - depth : (depth > slice_far ? depth - slice_far : 0.0f);
+            float slice_radius = std::sqrt(std::max(radius * radius - offset * offset, 0.0f));
+
+            glm::vec2 ndc_min(FLT_MAX);
+            glm::vec2 ndc_max(-FLT_MAX);
+            for (int corner = 0; corner < 8; ++corner) {
+                glm::vec2 point(light.x + (corner & 1 ? slice_radius : -slice_radius),
+                                light.y + (corner & 2 ? slice_radius : -slice_radius));
+                glm::vec2 ndc = point * projection_scale_ / (corner & 4 ? slice_far : slice_near);
+                ndc_min = glm::min(ndc_min, ndc);
+                ndc_max = glm::max(ndc_max, ndc);
+            }
+            if (ndc_min.x > 1.0f || ndc_min.y > 1.0f || ndc_max.x < -1.0f || ndc_max.y < -1.0f) {
+                continue;
+            }
+            int first_x = tileOf(ndc_min.x, screen_width_, tile_width_, tiles_x_);
+            int last_x = tileOf(ndc_max.x, screen_width_, tile_width_, tiles_x_);
+            int first_y = tileOf(ndc_min.y, screen_height_, tile_height_, tiles_y_);
+            int last_y = tileOf(ndc_max.y, screen_height_, tile_height_, tiles_y_);
+            for (int y = first_y; y <= last_y; ++y) {
+                for (int x = first_x; x <= last_x; ++x) {
+                    visit(x + tiles_x_ * (y + tiles_y_ * slice));
+                }
+            }
+        }
+    }
+
+    int sliceOf(float depth) const {
+        int slice = static_cast<int>(std::log(depth / near_) * slice_scale_);
+        return std::min(std::max(slice, 0), slices_ - 1);
+    }
+
+    float sliceDepth(int slice) const {
+        return near_ * std::exp(slice / slice_scale_);
+    }
+
+    static int tileOf(float ndc, float screen_size, float tile_size, int num_tiles) {
+        int tile = static_cast<int>(std::floor((ndc * 0.5f + 0.5f) * screen_size / tile_size));
+        return std::min(std::max(tile, 0), num_tiles - 1);
+    }
+
+    void upload(int buffer, const void* data, size_t bytes) {
+        glBindBuffer(GL_TEXTURE_BUFFER, buffers_[buffer]);
+        // Orphaned, the previous frame may still be reading the old storage.
+        glBufferData(GL_TEXTURE_BUFFER, std::max<size_t>(bytes, 16), NULL, GL_STREAM_DRAW);
+        if (bytes) {
+            glBufferSubData(GL_TEXTURE_BUFFER, 0, bytes, data);
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    int tiles_x_;
+    int tiles_y_;
+    int slices_;
+    float near_ = 0.1f;
+    float far_ = 100.0f;
+    float slice_scale_ = 1.0f;
+    float tile_width_ = 1.0f;
+    float tile_height_ = 1.0f;
+    float screen_width_ = 1.0f;
+    float screen_height_ = 1.0f;
+    glm::vec2 projection_scale_ = glm::vec2(1.0f);
+
+    std::vector<PointLight> lights_;
+    std::vector<glm::vec4> view_lights_; // View space position and radius
+    std::vector<uint32_t> fill_cursors_;
+    unsigned int buffers_[3];
+    unsigned int textures_[3];
+    ClusterStats stats_;
+};
+
+#endif //FIRST_TRY_CLUSTERED_LIGHTING_H
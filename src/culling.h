@@ -0,0 +1,207 @@
+#ifndef FIRST_TRY_CULLING_H
+#define FIRST_TRY_CULLING_H
+
+#include <glm/glm.hpp>
+
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE4_1__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+struct AABB {
+    glm::vec3 min = glm::vec3(FLT_MAX);
+    glm::vec3 max = glm::vec3(-FLT_MAX);
+
+    bool empty() const {
+        return min.x > max.x;
+    }
+
+    void extend(const glm::vec3& point) {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    void extend(const AABB& other) {
+        min = glm::min(min, other.min);
+        max = glm::max(max, other.max);
+    }
+};
+
+// Box around the transformed box, from its transformed center and the extents projected on the new axes.
+AABB transformAABB(const AABB& box, const glm::mat4& transform) {
+    if (box.empty()) {
+        return box;
+    }
+    glm::vec3 center = (box.min + box.max) * 0.5f;
+    glm::vec3 extent = (box.max - box.min) * 0.5f;
+    glm::vec3 new_center(transform * glm::vec4(center, 1.0f));
+    glm::vec3 new_extent = glm::abs(glm::vec3(transform[0])) * extent.x +
+                           glm::abs(glm::vec3(transform[1])) * extent.y +
+                           glm::abs(glm::vec3(transform[2])) * extent.z;
+    AABB result;
+    result.min = new_center - new_extent;
+    result.max = new_center + new_extent;
+    return result;
+}
+
+// Six planes facing inwards, a point p is inside when dot(plane.xyz, p) + plane.w >= 0 for all of them.
+struct Frustum {
+    glm::vec4 planes[6];
+
+    // Planes of the clip space cube, pulled back through the view projection matrix.
+    static Frustum fromMatrix(const glm::mat4& view_projection) {
+        const glm::mat4& m = view_projection;
+        glm::vec4 rows[4];
+        for (int i = 0; i < 4; ++i) {
+            rows[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+        }
+        Frustum frustum;
+        frustum.planes[0] = rows[3] + rows[0]; // Left
+        frustum.planes[1] = rows[3] - rows[0]; // Right
+        frustum.planes[2] = rows[3] + rows[1]; // Bottom
+        frustum.planes[3] = rows[3] - rows[1]; // Top
+        frustum.planes[4] = rows[3] + rows[2]; // Near
+        frustum.planes[5] = rows[3] - rows[2]; // Far
+        return frustum;
+    }
+
+    // Conservative, boxes crossing the corner of two planes may pass.
+    bool intersects(const AABB& box) const {
+        glm::vec3 center = (box.min + box.max) * 0.5f;
+        glm::vec3 extent = (box.max - box.min) * 0.5f;
+        for (const auto& plane : planes) {
+            glm::vec3 normal(plane);
+            if (glm::dot(normal, center) + glm::dot(glm::abs(normal), extent) + plane.w < 0.0f) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Bounding boxes stored as centers and half extents in structure of arrays layout, so that the frustum test
+// runs on 8 (AVX2) or 4 (SSE4.1) boxes at a time.
+class BoundsCuller {
+public:
+    void clear() {
+        center_x_.clear();
+        center_y_.clear();
+        center_z_.clear();
+        extent_x_.clear();
+        extent_y_.clear();
+        extent_z_.clear();
+    }
+
+    size_t size() const {
+        return center_x_.size();
+    }
+
+    // Returns the index of the box. Empty boxes are never visible.
+    size_t add(const AABB& box) {
+        center_x_.push_back(0.0f);
+        center_y_.push_back(0.0f);
+        center_z_.push_back(0.0f);
+        extent_x_.push_back(0.0f);
+        extent_y_.push_back(0.0f);
+        extent_z_.push_back(0.0f);
+        set(size() - 1, box);
+        return size() - 1;
+    }
+
+    void set(size_t index, const AABB& box) {
+        if (box.empty()) {
+            // A negative radius puts it outside of every plane.
+            center_x_[index] = center_y_[index] = center_z_[index] = 0.0f;
+            extent_x_[index] = extent_y_[index] = extent_z_[index] = -1e30f;
+            return;
+        }
+        glm::vec3 center = (box.min + box.max) * 0.5f;
+        glm::vec3 extent = (box.max - box.min) * 0.5f;
+        center_x_[index] = center.x;
+        center_y_[index] = center.y;
+        center_z_[index] = center.z;
+        extent_x_[index] = extent.x;
+        extent_y_[index] = extent.y;
+        extent_z_[index] = extent.z;
+    }
+
+    // Writes 1 for boxes that intersect the frustum and 0 for the rest.
+    void cull(const Frustum& frustum, uint8_t* visible) const {
+        size_t count = size();
+        size_t i = 0;
+#if defined(__AVX2__)
+        for (; i + 8 <= count; i += 8) {
+            __m256 cx = _mm256_loadu_ps(&center_x_[i]);
+            __m256 cy = _mm256_loadu_ps(&center_y_[i]);
+            __m256 cz = _mm256_loadu_ps(&center_z_[i]);
+            __m256 ex = _mm256_loadu_ps(&extent_x_[i]);
+            __m256 ey = _mm256_loadu_ps(&extent_y_[i]);
+            __m256 ez = _mm256_loadu_ps(&extent_z_[i]);
+            __m256 outside = _mm256_setzero_ps();
+            for (const auto& plane : frustum.planes) {
+                __m256 distance = _mm256_add_ps(
+                        _mm256_add_ps(_mm256_mul_ps(cx, _mm256_set1_ps(plane.x)),
+                                      _mm256_mul_ps(cy, _mm256_set1_ps(plane.y))),
+                        _mm256_add_ps(_mm256_mul_ps(cz, _mm256_set1_ps(plane.z)), _mm256_set1_ps(plane.w)));
+                __m256 radius = _mm256_add_ps(
+                        _mm256_add_ps(_mm256_mul_ps(ex, _mm256_set1_ps(std::fabs(plane.x))),
+                                      _mm256_mul_ps(ey, _mm256_set1_ps(std::fabs(plane.y)))),
+                        _mm256_mul_ps(ez, _mm256_set1_ps(std::fabs(plane.z))));
+                outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(distance, radius),
+                                                              _mm256_setzero_ps(), _CMP_LT_OQ));
+            }
+            int mask = _mm256_movemask_ps(outside);
+            for (int j = 0; j < 8; ++j) {
+                visible[i + j] = (mask >> j) & 1 ? 0 : 1;
+            }
+        }
+#elif defined(__SSE4_1__)
+        for (; i + 4 <= count; i += 4) {
+            __m128 cx = _mm_loadu_ps(&center_x_[i]);
+            __m128 cy = _mm_loadu_ps(&center_y_[i]);
+            __m128 cz = _mm_loadu_ps(&center_z_[i]);
+            __m128 ex = _mm_loadu_ps(&extent_x_[i]);
+            __m128 ey = _mm_loadu_ps(&extent_y_[i]);
+            __m128 ez = _mm_loadu_ps(&extent_z_[i]);
+            __m128 outside = _mm_setzero_ps();
+            for (const auto& plane : frustum.planes) {
+                __m128 distance = _mm_add_ps(
+                        _mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(plane.x)), _mm_mul_ps(cy, _mm_set1_ps(plane.y))),
+                        _mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w)));
+                __m128 radius = _mm_add_ps(
+                        _mm_add_ps(_mm_mul_ps(ex, _mm_set1_ps(std::fabs(plane.x))),
+                                   _mm_mul_ps(ey, _mm_set1_ps(std::fabs(plane.y)))),
+                        _mm_mul_ps(ez, _mm_set1_ps(std::fabs(plane.z))));
+                outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+            }
+            int mask = _mm_movemask_ps(outside);
+            for (int j = 0; j < 4; ++j) {
+                visible[i + j] = (mask >> j) & 1 ? 0 : 1;
+            }
+        }
+#endif
+        for (; i < count; ++i) {
+            bool inside = true;
+            for (const auto& plane : frustum.planes) {
+                float distance = center_x_[i] * plane.x + center_y_[i] * plane.y + center_z_[i] * plane.z + plane.w;
+                float radius = extent_x_[i] * std::fabs(plane.x) + extent_y_[i] * std::fabs(plane.y) +
+                               extent_z_[i] * std::fabs(plane.z);
+                if (distance + radius < 0.0f) {
+                    inside = false;
+                    break;
+                }
+            }
+            visible[i] = inside ? 1 : 0;
+        }
+    }
+
+private:
+    std::vector<float> center_x_, center_y_, center_z_;
+    std::vector<float> extent_x_, extent_y_, extent_z_;
+};
+
+#endif //FIRST_TRY_CULLING_H
@@ -0,0 +1,85 @@
+#ifndef FIRST_TRY_DRAW_LIST_H
+#define FIRST_TRY_DRAW_LIST_H
+
+#include "array_view.h"
+#include "frame_memory.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+
+// Items per block of a draw list, each block is generated and sorted by one worker.
+const size_t DRAW_LIST_BLOCK_SIZE = 256;
+
+struct DrawListRun {
+    size_t begin;
+    size_t end;
+};
+
+// Builds a draw list on the thread pool. Items [0, count) are split into blocks, generate(begin, end, out) writes
+// the commands of one block to out and returns how many it wrote, at most one per item. Every block is sorted on
+// the worker that generated it, then the blocks are merged pairwise until one list is left, the merges of a round
+// running in parallel. Commands are sorted by their 64 bit key member and live in the frame arena.
+template<typename Command, typename Generate>
+ArrayView<const Command> buildDrawList(size_t count, FrameArena& arena, const Generate& generate,
+                                       ThreadPool& pool = ThreadPool::instance()) {
+    size_t num_blocks = (count + DRAW_LIST_BLOCK_SIZE - 1) / DRAW_LIST_BLOCK_SIZE;
+    if (num_blocks == 0) {
+        return ArrayView<const Command>();
+    }
+    // The arena is not thread safe, everything the workers write to is allocated up front.
+    ArrayView<Command> blocks = arena.allocate<Command>(count);
+    ArrayView<DrawListRun> runs = arena.allocate<DrawListRun>(num_blocks);
+    auto by_key = [](const Command& a, const Command& b) { return a.key < b.key; };
+    pool.parallelFor(num_blocks, 1, [&](size_t first_block, size_t last_block) {
+        for (size_t block = first_block; block < last_block; ++block) {
+            size_t begin = block * DRAW_LIST_BLOCK_SIZE;
+            size_t end = std::min(begin + DRAW_LIST_BLOCK_SIZE, count);
+            size_t written = generate(begin, end, &blocks[begin]);
+            std::sort(&blocks[begin], &blocks[begin] + written, by_key);
+            runs[block] = {begin, begin + written};
+        }
+    });
+    if (num_blocks == 1) {
+        return ArrayView<const Command>(&blocks[0], runs[0].end);
+    }
+
+    size_t total = 0;
+    for (const DrawListRun& run : runs) {
+        total += run.end - run.begin;
+    }
+    ArrayView<Command> merged[2] = {arena.allocate<Command>(total), arena.allocate<Command>(total)};
+    Command* source = blocks.data();
+    size_t round = 0;
+    while (runs.size() > 1) {
+        Command* target = merged[round++ % 2].data();
+        size_t num_pairs = (runs.size() + 1) / 2;
+        ArrayView<DrawListRun> merged_runs = arena.allocate<DrawListRun>(num_pairs);
+        size_t offset = 0;
+        for (size_t pair = 0; pair < num_pairs; ++pair) {
+            size_t size = runs[2 * pair].end - runs[2 * pair].begin;
+            if (2 * pair + 1 < runs.size()) {
+                size += runs[2 * pair + 1].end - runs[2 * pair + 1].begin;
+            }
+            merged_runs[pair] = {offset, offset + size};
+            offset += size;
+        }
+        pool.parallelFor(num_pairs, 1, [&](size_t first_pair, size_t last_pair) {
+            for (size_t pair = first_pair; pair < last_pair; ++pair) {
+                const DrawListRun& a = runs[2 * pair];
+                Command* out = target + merged_runs[pair].begin;
+                if (2 * pair + 1 < runs.size()) {
+                    const DrawListRun& b = runs[2 * pair + 1];
+                    std::merge(source + a.begin, source + a.end, source + b.begin, source + b.end, out, by_key);
+                } else {
+                    std::copy(source + a.begin, source + a.end, out);
+                }
+            }
+        });
+        source = target;
+        runs = merged_runs;
+    }
+    return ArrayView<const Command>(source, total);
+}
+
+#endif //FIRST_TRY_DRAW_LIST_H
@@ -0,0 +1,189 @@
+#ifndef FIRST_TRY_FRAME_MEMORY_H
+#define FIRST_TRY_FRAME_MEMORY_H
+
+#include "array_view.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Heap allocations are counted per thread in debug builds, so the frame loop can check that steady state frames
+// never reach the allocator. Allocator churn shows up as frame time jitter.
+#ifndef NDEBUG
+#define TRACK_ALLOCATIONS
+#endif
+
+#ifdef TRACK_ALLOCATIONS
+// GCC pairs the inlined malloc and free with new and delete expressions and warns about a mismatch.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+namespace allocation_tracking {
+    thread_local size_t counted_allocations = 0;
+    thread_local int allowance_depth = 0;
+}
+
+void* operator new(size_t size) {
+    if (allocation_tracking::allowance_depth == 0) {
+        ++allocation_tracking::counted_allocations;
+    }
+    void* memory = std::malloc(size ? size : 1);
+    if (!memory) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+    std::free(memory);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+// Heap allocations made by this thread so far, outside of allowance scopes. Always 0 without TRACK_ALLOCATIONS.
+size_t heapAllocationCount() {
+#ifdef TRACK_ALLOCATIONS
+    return allocation_tracking::counted_allocations;
+#else
+    return 0;
+#endif
+}
+
+// Allocations inside the scope are expected and not counted, e.g. streaming in assets.
+class ScopedAllocationAllowance {
+public:
+    ScopedAllocationAllowance() {
+#ifdef TRACK_ALLOCATIONS
+        ++allocation_tracking::allowance_depth;
+#endif
+    }
+
+    ~ScopedAllocationAllowance() {
+#ifdef TRACK_ALLOCATIONS
+        --allocation_tracking::allowance_depth;
+#endif
+    }
+
+    ScopedAllocationAllowance(const ScopedAllocationAllowance&) = delete;
+    ScopedAllocationAllowance& operator=(const ScopedAllocationAllowance&) = delete;
+};
+
+// Asserts that frames after the warm up make no heap allocations on the calling thread.
+class FrameAllocationCheck {
+public:
+    explicit FrameAllocationCheck(int warm_up_frames = 10) : warm_up_frames_(warm_up_frames) {}
+
+    void beginFrame() {
+        frame_start_count_ = heapAllocationCount();
+    }
+
+    // Returns the number of allocations in the frame.
+    size_t endFrame() {
+        size_t allocations = heapAllocationCount() - frame_start_count_;
+        if (frames_++ >= warm_up_frames_) {
+            assert(allocations == 0 && "Heap allocation in a steady state frame");
+        }
+        return allocations;
+    }
+
+private:
+    int warm_up_frames_;
+    int frames_ = 0;
+    size_t frame_start_count_ = 0;
+};
+
+// Linear allocator for data that only lives until the end of the frame. Allocating is a pointer bump and reset()
+// frees everything at once. A frame that runs out of space spills into extra blocks, and the next reset() grows
+// the arena to fit, so only the first frames at a new high water mark reach the heap.
+class FrameArena {
+public:
+    explicit FrameArena(size_t capacity = 1 << 20) {
+        grow(capacity);
+    }
+
+    // Value initialized elements. Nothing is destroyed on reset, so only trivially destructible types are allowed.
+    template<typename T>
+    ArrayView<T> allocate(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "Frame arena memory is never destroyed");
+        T* elements = static_cast<T*>(allocateBytes(count * sizeof(T), alignof(T)));
+        for (size_t i = 0; i < count; ++i) {
+            new(elements + i) T();
+        }
+        return ArrayView<T>(elements, count);
+    }
+
+    void* allocateBytes(size_t size, size_t alignment) {
+        size_t offset = (used_ + alignment - 1) & ~(alignment - 1);
+        if (offset + size > capacity_) {
+            // Kept until the next reset.
+            overflow_bytes_ += size + alignment;
+            peak_ = std::max(peak_, used_ + overflow_bytes_);
+            overflow_.emplace_back(new char[size + alignment]);
+            uintptr_t address = reinterpret_cast<uintptr_t>(overflow_.back().get());
+            return reinterpret_cast<void*>((address + alignment - 1) & ~(uintptr_t) (alignment - 1));
+        }
+        used_ = offset + size;
+        peak_ = std::max(peak_, used_ + overflow_bytes_);
+        return block_.get() + block_offset_ + offset;
+    }
+
+    void reset() {
+        if (!overflow_.empty()) {
+            overflow_.clear();
+            grow(capacity_ + overflow_bytes_);
+            overflow_bytes_ = 0;
+        }
+        used_ = 0;
+    }
+
+    size_t used() const {
+        return used_ + overflow_bytes_;
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    // Most memory used by a single frame.
+    size_t peak() const {
+        return peak_;
+    }
+
+private:
+    void grow(size_t capacity) {
+        // Aligned for any fundamental type, allocateBytes aligns relative to the block start.
+        block_.reset(new char[capacity + alignof(std::max_align_t)]);
+        uintptr_t address = reinterpret_cast<uintptr_t>(block_.get());
+        block_offset_ = (alignof(std::max_align_t) - address % alignof(std::max_align_t)) % alignof(std::max_align_t);
+        capacity_ = capacity;
+    }
+
+    std::unique_ptr<char[]> block_;
+    size_t block_offset_ = 0;
+    size_t capacity_ = 0;
+    size_t used_ = 0;
+    size_t peak_ = 0;
+    std::vector<std::unique_ptr<char[]>> overflow_;
+    size_t overflow_bytes_ = 0;
+};
+
+#endif //FIRST_TRY_FRAME_MEMORY_H
@@ -0,0 +1,91 @@
+#ifndef FIRST_TRY_FRAME_PIPELINE_H
+#define FIRST_TRY_FRAME_PIPELINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+
+// Ring of frame packets between one producing and one consuming thread, e.g. the simulation and the render
+// thread. With three packets the producer fills frame N + 1 while the consumer works on frame N and frame N - 1
+// is still free to be overwritten. Packets are handed over through two atomic counters. A side only takes the
+// mutex to sleep when the other one is behind, and the other side only takes it to wake a sleeper.
+template<typename Packet, size_t N = 3>
+class FramePipeline {
+public:
+    FramePipeline() {}
+
+    FramePipeline(const FramePipeline&) = delete;
+    FramePipeline& operator=(const FramePipeline&) = delete;
+
+    // Producer: the next packet to fill, once the consumer is done with it. Null after close().
+    Packet* beginWrite() {
+        size_t written = written_.load(std::memory_order_relaxed);
+        waitUntil([this, written]() { return written - read_.load() < N || closed_.load(); });
+        return closed_.load() ? nullptr : &packets_[written % N];
+    }
+
+    // Producer: hands the packet of beginWrite() to the consumer.
+    void endWrite() {
+        written_.store(written_.load(std::memory_order_relaxed) + 1);
+        wake();
+    }
+
+    // Consumer: the oldest filled packet. Null once the pipeline is closed and every packet was read.
+    Packet* beginRead() {
+        size_t read = read_.load(std::memory_order_relaxed);
+        waitUntil([this, read]() { return written_.load() != read || closed_.load(); });
+        return written_.load() != read ? &packets_[read % N] : nullptr;
+    }
+
+    // Consumer: gives the packet of beginRead() back to the producer.
+    void endRead() {
+        read_.store(read_.load(std::memory_order_relaxed) + 1);
+        wake();
+    }
+
+    // Wakes both sides, packets written already are still read.
+    void close() {
+        closed_.store(true);
+        std::lock_guard<std::mutex> lock(mutex_);
+        condition_.notify_all();
+    }
+
+private:
+    // Yields for a while before going to sleep, the other side is usually only a little behind.
+    static const int SPIN_COUNT = 64;
+
+    template<typename Ready>
+    void waitUntil(const Ready& ready) {
+        for (int spin = 0; spin < SPIN_COUNT; ++spin) {
+            if (ready()) {
+                return;
+            }
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        // Sequentially consistent with the counter stores, so wake() either sees the sleeper or the sleeper
+        // sees the new count before it sleeps.
+        ++sleepers_;
+        condition_.wait(lock, ready);
+        --sleepers_;
+    }
+
+    void wake() {
+        if (sleepers_.load() > 0) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            condition_.notify_all();
+        }
+    }
+
+    Packet packets_[N];
+    std::atomic<size_t> written_{0}; // Packets handed to the consumer
+    std::atomic<size_t> read_{0};    // Packets given back
+    std::atomic<bool> closed_{false};
+    std::atomic<int> sleepers_{0};
+    std::mutex mutex_;
+    std::condition_variable condition_;
+};
+
+#endif //FIRST_TRY_FRAME_PIPELINE_H
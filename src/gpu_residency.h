@@ -0,0 +1,176 @@
+#ifndef FIRST_TRY_GPU_RESIDENCY_H
+#define FIRST_TRY_GPU_RESIDENCY_H
+
+#include "frame_memory.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+class ResidencyManager;
+
+// GL buffers or textures whose memory is accounted by the ResidencyManager. Resources that can give memory back
+// implement evictResource() and restoreResource(), restoring has to reproduce exactly what was evicted from data
+// kept on the CPU or on disk.
+class GpuResource {
+public:
+    GpuResource() {}
+
+    GpuResource(const GpuResource&) = delete;
+    GpuResource& operator=(const GpuResource&) = delete;
+
+    virtual ~GpuResource() {}
+
+    size_t residentBytes() const {
+        return resident_bytes_;
+    }
+
+    bool evicted() const {
+        return evicted_;
+    }
+
+protected:
+    // Frees what can be freed and returns false if there is nothing. Calls setResidentBytes() with what is left.
+    virtual bool evictResource() {
+        return false;
+    }
+
+    virtual void restoreResource() {}
+
+    // Inline below the manager.
+    void setResidentBytes(size_t bytes);
+
+private:
+    friend class ResidencyManager;
+
+    size_t resident_bytes_ = 0;
+    uint64_t last_used_frame_ = 0;
+    bool evicted_ = false;
+    bool tracked_ = false;
+    // Least recently used list, most recent first.
+    GpuResource* newer_ = nullptr;
+    GpuResource* older_ = nullptr;
+};
+
+struct ResidencyStats {
+    size_t budget_bytes = 0; // 0 is unlimited
+    size_t resident_bytes = 0;
+    size_t peak_resident_bytes = 0;
+    size_t evictions = 0;
+    size_t restores = 0;
+};
+
+// Keeps the GPU memory of tracked resources under a budget. Every use touches the resource, which moves it to the
+// front of an intrusive LRU list and restores it if it was evicted. At the end of the frame the least recently
+// used resources that were not used in it are evicted until the total fits the budget, so a working set larger
+// than the budget is never thrashed within a frame. GL thread only.
+class ResidencyManager {
+public:
+    static ResidencyManager& instance() {
+        static ResidencyManager manager;
+        return manager;
+    }
+
+    void setBudget(size_t bytes) {
+        stats_.budget_bytes = bytes;
+    }
+
+    const ResidencyStats& stats() const {
+        return stats_;
+    }
+
+    void add(GpuResource* resource) {
+        assert(!resource->tracked_);
+        resource->tracked_ = true;
+        resource->last_used_frame_ = frame_;
+        linkFront(resource);
+        addBytes(resource->resident_bytes_);
+    }
+
+    void remove(GpuResource* resource) {
+        if (!resource->tracked_) {
+            return;
+        }
+        unlink(resource);
+        stats_.resident_bytes -= resource->resident_bytes_;
+        resource->tracked_ = false;
+    }
+
+    // Marks the resource as used in this frame, restoring it first if it was evicted.
+    void touch(GpuResource* resource) {
+        if (resource->evicted_) {
+            // Reloading under memory pressure is the one allocation a steady state frame may make.
+            ScopedAllocationAllowance allowance;
+            resource->restoreResource();
+            resource->evicted_ = false;
+            ++stats_.restores;
+        }
+        resource->last_used_frame_ = frame_;
+        if (head_ != resource) {
+            unlink(resource);
+            linkFront(resource);
+        }
+    }
+
+    // Evicts until the budget is met, oldest first, then starts the next frame. Call once per frame after drawing.
+    void endFrame() {
+        GpuResource* resource = tail_;
+        while (stats_.budget_bytes && stats_.resident_bytes > stats_.budget_bytes && resource &&
+               resource->last_used_frame_ != frame_) {
+            GpuResource* newer = resource->newer_;
+            if (!resource->evicted_) {
+                ScopedAllocationAllowance allowance;
+                if (resource->evictResource()) {
+                    resource->evicted_ = true;
+                    ++stats_.evictions;
+                }
+            }
+            resource = newer;
+        }
+        ++frame_;
+    }
+
+private:
+    friend class GpuResource;
+
+    ResidencyManager() {}
+
+    void addBytes(size_t bytes) {
+        stats_.resident_bytes += bytes;
+        stats_.peak_resident_bytes = std::max(stats_.peak_resident_bytes, stats_.resident_bytes);
+    }
+
+    void linkFront(GpuResource* resource) {
+        resource->newer_ = nullptr;
+        resource->older_ = head_;
+        if (head_) {
+            head_->newer_ = resource;
+        } else {
+            tail_ = resource;
+        }
+        head_ = resource;
+    }
+
+    void unlink(GpuResource* resource) {
+        (resource->newer_ ? resource->newer_->older_ : head_) = resource->older_;
+        (resource->older_ ? resource->older_->newer_ : tail_) = resource->newer_;
+        resource->newer_ = resource->older_ = nullptr;
+    }
+
+    GpuResource* head_ = nullptr; // Most recently used
+    GpuResource* tail_ = nullptr;
+    uint64_t frame_ = 0;
+    ResidencyStats stats_;
+};
+
+inline void GpuResource::setResidentBytes(size_t bytes) {
+    if (tracked_) {
+        ResidencyManager& manager = ResidencyManager::instance();
+        manager.stats_.resident_bytes -= resident_bytes_;
+        manager.addBytes(bytes);
+    }
+    resident_bytes_ = bytes;
+}
+
+#endif //FIRST_TRY_GPU_RESIDENCY_H
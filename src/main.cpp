@@ -2,6 +2,10 @@
 #include "camera.h"
 #include "model.h"
 #include "mesh.h"
+#include "scene.h"
+#include "asset_manager.h"
+#include "clustered_lighting.h"
+#include "frame_pipeline.h"
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -19,6 +23,11 @@
 #include <cmath>
 #include <memory>
 #include <unistd.h>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <random>
+#include <thread>
 
 const int screenWidth = 800;
 const int screenHeight = 600;
@@ -33,14 +42,63 @@ bool firstMouse = true;
 float deltaTime = 0.0f;	// time between current frame and last frame
 float lastFrame = 0.0f;
 
+// Set by the resize callback on the main thread, applied by whichever thread renders.
+int framebufferWidth = screenWidth;
+int framebufferHeight = screenHeight;
+
+// What the render side needs of one simulated frame. Everything it points to lives in the arena.
+struct FramePacket {
+    FrameArena arena;
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::vec3 view_position;
+    int framebuffer_width;
+    int framebuffer_height;
+    LightClusterFrame lights;
+    ArrayView<const DrawCommand> draws;
+};
+
 // Window functions
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 void processInput(GLFWwindow *window);
 GLFWwindow* InitializeAndCreateWindow(int width, int height);
+bool hasArgument(int argc, char** argv, const char* argument);
+const char* argumentValue(int argc, char** argv, const char* argument);
+
+int main(int argc, char** argv) {
+    // Skinning on the CPU is faster than vertex shading on software rasterizers like llvmpipe.
+    bool cpu_skinning = hasArgument(argc, argv, "--cpu-skinning");
+    bool compress_animation = hasArgument(argc, argv, "--compress-animation");
+    bool motion_capture = hasArgument(argc, argv, "--motion-capture");
+    bool bake_motion_capture = hasArgument(argc, argv, "--bake-motion-capture");
+    // Maps the capture and decodes frames as they are played instead of all of them up front.
+    bool index_motion_capture = hasArgument(argc, argv, "--index-motion-capture");
+    // A text BVH or a binary capture written by mocap_convert.
+    const char* motion_capture_file = argumentValue(argc, argv, "--motion-capture-file");
+    // Live capture from a socket, "unix:<path>" or "<host>:<port>", e.g. from mocap_replay_server.
+    const char* motion_stream_address = argumentValue(argc, argv, "--motion-stream");
+    // Skins characters once per frame with transform feedback, every pass draws them without skinning.
+    bool skin_once = !cpu_skinning && hasArgument(argc, argv, "--skin-once");
+    // Lays down depth first and shades each pixel once, for overdraw on fragment bound rasterizers.
+    bool depth_prepass = hasArgument(argc, argv, "--depth-prepass");
+    // Skips drawing characters hidden behind the ones in front, tested against a software depth buffer.
+    bool occlusion_culling = hasArgument(argc, argv, "--occlusion-culling");
+    // Submits to GL on a thread of its own, which draws frame N while this one simulates frame N + 1.
+    bool render_thread = hasArgument(argc, argv, "--render-thread");
+    // Copies of the character on a grid, to stress the scene.
+    const char* crowd_argument = argumentValue(argc, argv, "--crowd");
+    int crowd_size = crowd_argument ? std::max(1, std::atoi(crowd_argument)) : 1;
+    // Colored point lights scattered over the crowd, besides the lamp.
+    const char* lights_argument = argumentValue(argc, argv, "--lights");
+    int extra_lights = lights_argument ? std::max(0, std::atoi(lights_argument)) : 0;
+    // GPU memory budget in MiB, least recently drawn buffers and textures are evicted past it.
+    const char* vram_budget_argument = argumentValue(argc, argv, "--vram-budget");
+    if (vram_budget_argument) {
+        ResidencyManager::instance().setBudget(static_cast<size_t>(std::max(0, std::atoi(vram_budget_argument))) << 20);
+    }
 
-int main() {
     GLFWwindow *window = InitializeAndCreateWindow(screenWidth, screenHeight);
     if (window == NULL) {
         glfwTerminate();
@@ -49,6 +107,8 @@ int main() {
     // Set resize callback
     // glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    // Larger than the window on HiDPI screens.
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
     glfwSetCursorPosCallback(window, mouse_callback);
     glfwSetScrollCallback(window, scroll_callback);
     glEnable(GL_DEPTH_TEST);
@@ -58,67 +118,280 @@ int main() {
     // Light
     glm::vec3 lightPos(1.2f, 1.0f, 1.0f);
 
-    // Shaders
-    ShaderProgram shaderProgram("resources/shaders/skeleton_shader.vert",
-                                "resources/shaders/diffuse_texture_shader.frag");
-    shaderProgram.use();
-    shaderProgram.setFloatVector("lightColor", {1.0f, 1.0f, 1.0f});
-    shaderProgram.setVec3("lightPos", lightPos);
-
-    ShaderProgram lampShader("resources/shaders/lamp.vert", "resources/shaders/lamp.frag");
+    // Shaders link in the background while the model loads, or come straight from the binary cache.
+    enableParallelShaderCompile();
+    ProgramBinaryCache program_cache("shader_cache");
+    ShaderProgram shaderProgram(cpu_skinning || skin_once ? "resources/shaders/cube_shader.vert"
+                                                          : "resources/shaders/skeleton_shader.vert",
+                                "resources/shaders/diffuse_texture_shader.frag", &program_cache);
+    ShaderProgram skinFeedbackShader("resources/shaders/skin_feedback.vert",
+                                     {"skinnedPosition", "skinnedNormal", "skinnedTexCoords"});
+    ShaderProgram lampShader("resources/shaders/lamp.vert", "resources/shaders/lamp.frag", &program_cache);
+    ShaderProgram depthShader("resources/shaders/depth_static.vert", "resources/shaders/depth.frag", &program_cache);
+    ShaderProgram depthSkeletonShader("resources/shaders/depth_skeleton.vert", "resources/shaders/depth.frag",
+                                      &program_cache);
 
     // Choose a model to load
     // AnimatedModel ourModel("resources/models/stickTut15.dae");
 	// std::unique_ptr<AnimatedModel> ourModel(new AnimatedModel("resources/models/stickTut15.dae"));
-    MotionCaptureData motion_capture_data("resources/models/17_03.bvh");
-    std::unique_ptr<AnimatedModel> ourModel(new AnimatedModel("resources/models/eng_attempt2.6.dae", &motion_capture_data));
+    // The capture and the model load in parallel on the thread pool, meshes are uploaded here as they come in.
+    float loadStartTime = glfwGetTime();
+    AssetManager assets;
+    AssetHandle<MotionCaptureData> motion_capture_asset = assets.loadMotionCapture(
+            motion_capture_file ? motion_capture_file : "resources/models/17_03.bvh",
+            index_motion_capture ? MotionCaptureLoading::Indexed : MotionCaptureLoading::Full);
+    ModelSettings model_settings;
+    model_settings.skinning_mode = cpu_skinning ? SkinningMode::CPU : SkinningMode::GPU;
+    model_settings.compress_clips = compress_animation;
+    AssetHandle<AnimatedModel> model_asset = assets.loadModel("resources/models/eng_attempt2.6.dae", model_settings);
+    assets.finishAll();
+    if (!motion_capture_asset.ready() || !model_asset.ready()) {
+        glfwTerminate();
+        return -1;
+    }
+    std::cout << "Assets loaded in " << glfwGetTime() - loadStartTime << " s, "
+              << assets.stats().max_upload_batch_ms << " ms longest upload batch\n";
+    MotionCaptureData& motion_capture_data = *motion_capture_asset.get();
+    AnimatedModel* ourModel = model_asset.get();
+    ourModel->setMotionCaptureData(&motion_capture_data);
 
     // AnimatedModel ourModel("resources/models/BlackDragon/Dragon 2.5_dae.dae");
     ourModel->debugPrintout();
+    for (size_t lod = 0; lod < ourModel->numLods(); ++lod) {
+        std::cout << "LOD " << lod << ": " << ourModel->numTriangles(lod) << " triangles, "
+                  << ourModel->numSkeletonBones(lod) << " bones\n";
+    }
+    if (compress_animation) {
+        CompressionStats stats = ourModel->clipCompressionStats();
+        std::cout << "Animation compressed " << stats.raw_bytes << " -> " << stats.compressed_bytes << " bytes ("
+                  << stats.ratio() << "x), max error " << stats.max_position_error << " / "
+                  << stats.max_rotation_error << " rad\n";
+        stats = motion_capture_data.compress(CompressionSettings());
+        std::cout << "Motion capture compressed " << stats.raw_bytes << " -> " << stats.compressed_bytes
+                  << " bytes (" << stats.ratio() << "x), max error " << stats.max_position_error << " / "
+                  << stats.max_rotation_error << " rad\n";
+    }
 
-    glm::mat4 model;
+    shaderProgram.use();
+    shaderProgram.setVec3("ambientColor", glm::vec3(0.1f));
+    lampShader.finish();
+    depthShader.finish();
+    depthSkeletonShader.finish();
+    const ProgramCacheStats& program_stats = program_cache.stats();
+    std::cout << "Program cache: " << program_stats.hits << " hits, " << program_stats.misses << " misses, "
+              << program_stats.rejected << " rejected, " << program_stats.stores << " stored\n";
+
+    std::unique_ptr<MotionStream> motion_stream;
+    if (motion_stream_address) {
+        motion_stream.reset(new MotionStream(motion_stream_address));
+        if (!motion_stream->valid()) {
+            motion_stream.reset();
+        }
+    }
+    // What every character plays, the first clip of the model unless a capture is asked for.
+    AnimationState character_animation;
+    if (motion_stream) {
+        ourModel->playMotionStream(character_animation.playback, motion_stream.get());
+    } else if (bake_motion_capture) {
+        ourModel->play(character_animation.playback, ourModel->bakeMotionCapture(motion_capture_data), 0.0);
+    } else if (motion_capture) {
+        ourModel->playMotionCapture(character_animation.playback, 0.0);
+    } else if (ourModel->numClips() != 0) {
+        ourModel->play(character_animation.playback, 0, 0.0);
+    }
 
-    float startTime = glfwGetTime();
-    while (!glfwWindowShouldClose(window)) {
-        float currentFrame = glfwGetTime() - startTime;
-        deltaTime = currentFrame - lastFrame;
-        lastFrame = currentFrame;
+    Scene scene;
+    if (skin_once) {
+        scene.setSkinningShader(&skinFeedbackShader);
+    }
+    if (depth_prepass) {
+        scene.setDepthShaders(&depthShader, &depthSkeletonShader);
+    }
+    OcclusionBuffer occlusion_buffer;
+    if (occlusion_culling) {
+        scene.setOcclusionBuffer(&occlusion_buffer);
+    }
+    glm::mat4 model = glm::translate(glm::mat4(1.0f), lightPos);
+    model = glm::scale(model, glm::vec3(0.2f));
+    AABB cube_bounds;
+    cube_bounds.extend(glm::vec3(-0.25f));
+    cube_bounds.extend(glm::vec3(0.25f));
+    OccluderMesh cube_occluder = boxOccluder(cube_bounds);
+    scene.createEntity(scene.addMesh(cube.get(), cube_bounds, &lampShader, &cube_occluder), model);
+    uint32_t character = scene.addModel(ourModel, &shaderProgram);
+    int crowd_row = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(crowd_size))));
+    for (int i = 0; i < crowd_size; ++i) {
+        glm::vec3 position(1.5f * (i % crowd_row), 0.0f, -1.5f * (i / crowd_row));
+        AnimationState animation = character_animation;
+        animation.time_offset = 0.37 * i;
+        scene.createEntity(character, glm::scale(glm::translate(glm::mat4(1.0f), position), glm::vec3(0.1f)),
+                           animation);
+    }
 
-        processInput(window);
+    // The lamp reaches the whole crowd, as the single light did before.
+    ClusteredLights light_clusters;
+    light_clusters.lights().push_back({lightPos, 30.0f, glm::vec3(1.0f)});
+    std::mt19937 light_random(17);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    for (int i = 0; i < extra_lights; ++i) {
+        glm::vec3 position(-1.0f + (1.5f * crowd_row + 1.0f) * unit(light_random), 0.1f + 1.5f * unit(light_random),
+                           1.0f - (1.5f * crowd_row + 1.0f) * unit(light_random));
+        glm::vec3 color(unit(light_random), unit(light_random), unit(light_random));
+        light_clusters.lights().push_back({position, 0.75f + 1.25f * unit(light_random), color / std::max(
+                std::max(color.x, color.y), std::max(color.z, 0.01f))});
+    }
 
+    // Only GL and the packet, so it can run on the render thread while the next frame is simulated.
+    int viewport_width = 0;
+    int viewport_height = 0;
+    auto render = [&](const FramePacket& packet) {
+        if (packet.framebuffer_width != viewport_width || packet.framebuffer_height != viewport_height) {
+            viewport_width = packet.framebuffer_width;
+            viewport_height = packet.framebuffer_height;
+            glViewport(0, 0, viewport_width, viewport_height);
+        }
         glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+        light_clusters.upload(packet.lights);
+        light_clusters.bind();
 
-        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float) screenWidth / (float) screenHeight,
-                                                0.1f, 100.0f);
-        // camera/view transformation
-        glm::mat4 view = camera.GetViewMatrix();
-
-        model = glm::mat4(1.0f);
-        model = glm::translate(model, lightPos);
-        model = glm::scale(model, glm::vec3(0.2f));
         lampShader.use();
-        lampShader.setMat4("view", view);
-        lampShader.setMat4("projection", projection);
-        lampShader.setMat4("model", model);
-        cube->draw(lampShader);
+        lampShader.setMat4("view", packet.view);
+        lampShader.setMat4("projection", packet.projection);
 
         shaderProgram.use();
-        shaderProgram.setMat4("projection", projection);
-        shaderProgram.setMat4("view", view);
-        shaderProgram.setVec3("viewPos", camera.Position);
+        shaderProgram.setMat4("projection", packet.projection);
+        shaderProgram.setMat4("view", packet.view);
+        shaderProgram.setVec3("viewPos", packet.view_position);
+        light_clusters.setUniforms(shaderProgram, packet.lights);
+
+        if (depth_prepass) {
+            depthShader.use();
+            depthShader.setMat4("view", packet.view);
+            depthShader.setMat4("projection", packet.projection);
+            depthSkeletonShader.use();
+            depthSkeletonShader.setMat4("view", packet.view);
+            depthSkeletonShader.setMat4("projection", packet.projection);
+        }
+
+        scene.skin(packet.draws);
+        scene.draw(packet.draws);
+        ResidencyManager::instance().endFrame();
+    };
+
+    // The context moves to the render thread until the loop is over.
+    FramePipeline<FramePacket> pipeline;
+    std::thread renderer;
+    if (render_thread) {
+        glfwMakeContextCurrent(NULL);
+        renderer = std::thread([&]() {
+            glfwMakeContextCurrent(window);
+            FrameAllocationCheck render_allocation_check;
+            while (FramePacket* packet = pipeline.beginRead()) {
+                render_allocation_check.beginFrame();
+                render(*packet);
+                glfwSwapBuffers(window);
+                pipeline.endRead();
+                render_allocation_check.endFrame();
+            }
+            glfwMakeContextCurrent(NULL);
+        });
+    }
+
+    size_t frames = 0;
+    size_t posed_entities = 0;
+    FrameAllocationCheck allocation_check;
+    float startTime = glfwGetTime();
+    while (!glfwWindowShouldClose(window)) {
+        allocation_check.beginFrame();
+        float currentFrame = glfwGetTime() - startTime;
+        deltaTime = currentFrame - lastFrame;
+        lastFrame = currentFrame;
 
-        model = glm::scale(glm::mat4(1.0f), glm::vec3(0.1f));
-        shaderProgram.setMat4("model", model);
-        shaderProgram.setMat3("normalModel", glm::mat3(model));
-        ourModel->draw(shaderProgram, currentFrame);
+        processInput(window);
 
-        glfwSwapBuffers(window);
+        // Free once the render side is done with the frame that used it last.
+        FramePacket& packet = *pipeline.beginWrite();
+        packet.arena.reset();
+        packet.projection = glm::perspective(glm::radians(camera.Zoom),
+                                             (float) framebufferWidth / (float) framebufferHeight, 0.1f, 100.0f);
+        // camera/view transformation
+        packet.view = camera.GetViewMatrix();
+        packet.view_position = camera.Position;
+        packet.framebuffer_width = framebufferWidth;
+        packet.framebuffer_height = framebufferHeight;
+        // Tiles are found from gl_FragCoord, so they are sized to the viewport.
+        packet.lights = light_clusters.update(packet.view, packet.projection, 0.1f, 100.0f, packet.framebuffer_width,
+                                              packet.framebuffer_height, packet.arena);
+
+        if (motion_stream) {
+            motion_stream->update();
+        }
+        scene.cull(Frustum::fromMatrix(packet.projection * packet.view), packet.arena);
+        scene.selectLods(packet.view, packet.projection);
+        scene.update(currentFrame, packet.arena);
+        scene.cullOccluded(packet.view, packet.projection, packet.arena);
+        packet.draws = scene.prepareDraws(packet.arena);
+        frames += 1;
+        posed_entities += scene.poseCount();
+        pipeline.endWrite();
+
+        if (!render_thread) {
+            render(*pipeline.beginRead());
+            glfwSwapBuffers(window);
+            pipeline.endRead();
+        }
         glfwPollEvents();
+        allocation_check.endFrame();
+    }
+    if (render_thread) {
+        pipeline.close();
+        renderer.join();
+        glfwMakeContextCurrent(window);
     }
+    const ClipLibraryStats& clip_stats = ourModel->clipStats();
+    std::cout << "Clip streaming: " << clip_stats.chunk_hits << " hits, " << clip_stats.chunk_loads << " blocking loads, "
+              << clip_stats.chunk_prefetches << " prefetches, " << clip_stats.chunk_evictions << " evictions, "
+              << clip_stats.averageLoadMs() << " ms average / " << clip_stats.max_load_ms << " ms max load, "
+              << clip_stats.peak_resident_bytes << " bytes peak resident\n";
+    const ResidencyStats& residency_stats = ResidencyManager::instance().stats();
+    std::cout << "GPU memory: " << residency_stats.resident_bytes << " bytes resident, "
+              << residency_stats.peak_resident_bytes << " peak, " << residency_stats.evictions << " evictions, "
+              << residency_stats.restores << " restores\n";
+    const ClusterStats& cluster_stats = light_clusters.stats();
+    std::cout << "Lights: " << cluster_stats.visible_lights << " of " << cluster_stats.lights << " visible, "
+              << cluster_stats.light_references << " cluster references, " << cluster_stats.max_cluster_lights
+              << " max per cluster\n";
+    if (occlusion_culling) {
+        const OcclusionStats& occlusion_stats = scene.occlusionStats();
+        double frame_count = std::max<size_t>(occlusion_stats.frames, 1);
+        std::cout << "Occlusion culling: " << 100.0 * occlusion_stats.culledFraction() << "% of tested culled, "
+                  << occlusion_stats.occluders / frame_count << " occluders / "
+                  << occlusion_stats.occluder_triangles / frame_count << " triangles, "
+                  << occlusion_stats.render_ms / frame_count << " ms render, "
+                  << occlusion_stats.test_ms / frame_count << " ms test per frame\n";
+    }
+    if (motion_capture_data.indexedFile()) {
+        const IndexedBvhStats& bvh_stats = motion_capture_data.indexedFile()->stats();
+        std::cout << "Indexed capture: " << bvh_stats.index_bytes << " bytes index "
+                  << (bvh_stats.index_loaded ? "loaded" : "built") << " in " << bvh_stats.index_ms << " ms, "
+                  << bvh_stats.decoded_frames << " frames decoded in " << bvh_stats.window_misses << " batches, "
+                  << (frames ? static_cast<double>(bvh_stats.decoded_frames) / frames : 0.0) << " per frame for "
+                  << crowd_size << " characters\n";
+    }
+    if (motion_stream) {
+        MotionStreamStats stream_stats = motion_stream->stats();
+        std::cout << "Motion stream: " << stream_stats.frames_received << " frames received, "
+                  << stream_stats.frames_lost << " lost, " << stream_stats.frames_late << " late, "
+                  << stream_stats.frames_overflowed << " overflowed, " << stream_stats.underruns << " underruns, "
+                  << stream_stats.averageLatencyMs() << " ms average / " << stream_stats.max_latency_ms
+                  << " ms max latency, " << stream_stats.averageNetworkMs() << " ms average network\n";
+    }
+    std::cout << "Posed " << (frames ? static_cast<double>(posed_entities) / frames : 0.0) << " of " << crowd_size
+              << " characters per frame\n";
     cube.reset();
-    ourModel.reset();
+    model_asset.reset();
 
     glfwTerminate();
     return 0;
@@ -126,7 +399,12 @@ int main() {
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
-    glViewport(0, 0, width, height);
+    // Minimized, keep the last size.
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+    framebufferWidth = width;
+    framebufferHeight = height;
 }
 
 void processInput(GLFWwindow *window)
@@ -187,4 +465,23 @@ GLFWwindow* InitializeAndCreateWindow(int width, int height) {
 
     glViewport(0, 0, width, height);
     return window;
+}
+
+// Returns the argument following the given one, or NULL if there is none.
+const char* argumentValue(int argc, char** argv, const char* argument) {
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::strcmp(argv[i], argument) == 0) {
+            return argv[i + 1];
+        }
+    }
+    return NULL;
+}
+
+bool hasArgument(int argc, char** argv, const char* argument) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], argument) == 0) {
+            return true;
+        }
+    }
+    return false;
 }
\ No newline at end of file
@@ -8,11 +8,64 @@
 #include <glad/glad.h>
 #include <stb_image.h>
 #include "shader.h"
+#include "gpu_residency.h"
 #include <glm/glm.hpp>
 
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
 #include <string>
 
-unsigned int loadTexture(const std::string& path) {
+// Decoded pixels of an image file, owned until destroyed. Decoding needs no GL context and runs on loader threads.
+struct ImageData {
+    ImageData() {}
+
+    ImageData(ImageData&& other) :
+            pixels(other.pixels), width(other.width), height(other.height), channels(other.channels) {
+        other.pixels = nullptr;
+    }
+
+    ImageData& operator=(ImageData&& other) {
+        std::swap(pixels, other.pixels);
+        width = other.width;
+        height = other.height;
+        channels = other.channels;
+        return *this;
+    }
+
+    ImageData(const ImageData&) = delete;
+    ImageData& operator=(const ImageData&) = delete;
+
+    ~ImageData() {
+        stbi_image_free(pixels);
+    }
+
+    unsigned char* pixels = nullptr; // Null if the file could not be decoded
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+};
+
+ImageData decodeImage(const std::string& path) {
+    ImageData image;
+    image.pixels = stbi_load(path.c_str(), &image.width, &image.height, &image.channels, 0);
+    if (!image.pixels) {
+        std::cout << "Failed to load texture " << path << std::endl;
+    }
+    return image;
+}
+
+GLenum textureFormat(int channels) {
+    if (channels == 1)
+        return GL_RED;
+    else if (channels == 3)
+        return GL_RGB;
+    return GL_RGBA;
+}
+
+// Creates a texture from decoded pixels, an empty one if decoding failed.
+unsigned int uploadTexture(const ImageData& image) {
     unsigned int texture_id;
     glGenTextures(1, &texture_id);
     glBindTexture(GL_TEXTURE_2D, texture_id);
@@ -21,30 +74,22 @@ unsigned int loadTexture(const std::string& path) {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    // load and generate the texture
-    int width, height, nrChannels;
-    unsigned char *data = stbi_load(path.c_str(), &width, &height, &nrChannels, 0);
-    if (data)
+    if (image.pixels)
     {
-        GLenum format;
-        if (nrChannels == 1)
-            format = GL_RED;
-        else if (nrChannels == 3)
-            format = GL_RGB;
-        else if (nrChannels == 4)
-            format = GL_RGBA;
-
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+        GLenum format = textureFormat(image.channels);
+        // Rows of 1 and 3 channel images are not 4 byte aligned.
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, format, image.width, image.height, 0, format, GL_UNSIGNED_BYTE, image.pixels);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
         glGenerateMipmap(GL_TEXTURE_2D);
     }
-    else
-    {
-        std::cout << "Failed to load texture " << path << std::endl;
-    }
-    stbi_image_free(data);
     return texture_id;
 }
 
+unsigned int loadTexture(const std::string& path) {
+    return uploadTexture(decodeImage(path));
+}
+
 unsigned int createSingleColorTexture(const glm::vec3& color) {
     unsigned int texture_id;
     glGenTextures(1, &texture_id);
@@ -57,9 +102,87 @@ unsigned int createSingleColorTexture(const glm::vec3& color) {
     return texture_id;
 }
 
+// Texture with its memory accounted by the ResidencyManager. A texture decoded from a file drops to a small mip
+// when evicted, which samples the same, and is decoded again the next time it is bound.
+class Texture : public GpuResource {
+public:
+    Texture(const ImageData& image, const std::string& source_path) : source_path_(source_path) {
+        create(image);
+        ResidencyManager::instance().add(this);
+    }
+
+    explicit Texture(const glm::vec3& color) : id_(createSingleColorTexture(color)) {
+        setResidentBytes(sizeof(float) * 3);
+        ResidencyManager::instance().add(this);
+    }
+
+    ~Texture() {
+        ResidencyManager::instance().remove(this);
+        glDeleteTextures(1, &id_);
+    }
+
+    unsigned int id() const {
+        return id_;
+    }
+
+    // Binds to the active texture unit.
+    void bind() {
+        ResidencyManager::instance().touch(this);
+        glBindTexture(GL_TEXTURE_2D, id_);
+    }
+
+protected:
+    // Keeps the mip EVICTED_MIP levels down, 1/64 of the memory.
+    bool evictResource() override {
+        const int EVICTED_MIP = 3;
+        if (source_path_.empty() || (width_ >> EVICTED_MIP) == 0 || (height_ >> EVICTED_MIP) == 0) {
+            return false;
+        }
+        ImageData mip;
+        mip.width = width_ >> EVICTED_MIP;
+        mip.height = height_ >> EVICTED_MIP;
+        mip.channels = channels_;
+        // stb_image frees with free().
+        mip.pixels = static_cast<unsigned char*>(std::malloc(static_cast<size_t>(mip.width) * mip.height * channels_));
+        glBindTexture(GL_TEXTURE_2D, id_);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glGetTexImage(GL_TEXTURE_2D, EVICTED_MIP, textureFormat(channels_), GL_UNSIGNED_BYTE, mip.pixels);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glDeleteTextures(1, &id_);
+        create(mip);
+        return true;
+    }
+
+    void restoreResource() override {
+        ImageData image = decodeImage(source_path_);
+        if (image.pixels) {
+            glDeleteTextures(1, &id_);
+            create(image);
+        }
+    }
+
+private:
+    void create(const ImageData& image) {
+        id_ = uploadTexture(image);
+        width_ = image.width;
+        height_ = image.height;
+        channels_ = image.channels;
+        // Mip chain adds a third.
+        setResidentBytes(static_cast<size_t>(width_) * height_ * channels_ * 4 / 3);
+    }
+
+    std::string source_path_; // Empty if it can't be reloaded
+    unsigned int id_ = 0;
+    int width_ = 0;
+    int height_ = 0;
+    int channels_ = 0;
+};
+
 class Material {
 public:
-    virtual void load(ShaderProgram shaderProgram) = 0;
+    virtual ~Material() {}
+
+    virtual void load(const ShaderProgram& shaderProgram) = 0;
 };
 
 class ColorMaterial: public Material {
@@ -67,7 +190,7 @@ public:
     ColorMaterial(glm::vec3 diffuse_color, glm::vec3 specular_color, float shininess)
             : diffuse_color_(diffuse_color), specular_color_(specular_color), shininess_(shininess) {}
 
-    void load(ShaderProgram shaderProgram) override {
+    void load(const ShaderProgram& shaderProgram) override {
         shaderProgram.setVec3("material.diffuse", diffuse_color_);
         shaderProgram.setVec3("material.specular", specular_color_);
         shaderProgram.setFloat("material.shininess", shininess_);
@@ -82,25 +205,28 @@ private:
 class DiffuseMapMaterial: public Material {
 public:
     DiffuseMapMaterial(const std::string& diffuse_texture_path, glm::vec3 specular_color, float shininess)
-            :specular_color_(specular_color), shininess_(shininess) {
-        diffuse_texture_ = loadTexture(diffuse_texture_path);
-    }
+            :diffuse_texture_(new Texture(decodeImage(diffuse_texture_path), diffuse_texture_path)),
+             specular_color_(specular_color), shininess_(shininess) {}
+
+    // The image is decoded already, the path is where it is decoded from again after an eviction.
+    DiffuseMapMaterial(const ImageData& diffuse_image, const std::string& diffuse_texture_path,
+                       glm::vec3 specular_color, float shininess)
+            :diffuse_texture_(new Texture(diffuse_image, diffuse_texture_path)),
+             specular_color_(specular_color), shininess_(shininess) {}
 
     DiffuseMapMaterial(const glm::vec3& diffuse_color, glm::vec3 specular_color, float shininess)
-            :specular_color_(specular_color), shininess_(shininess) {
-        diffuse_texture_ = createSingleColorTexture(diffuse_color);
-    }
+            :diffuse_texture_(new Texture(diffuse_color)), specular_color_(specular_color), shininess_(shininess) {}
 
-    void load(ShaderProgram shaderProgram) override {
+    void load(const ShaderProgram& shaderProgram) override {
         glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, diffuse_texture_);
+        diffuse_texture_->bind();
         shaderProgram.setInt("material.diffuse", 0);
         shaderProgram.setVec3("material.specular", specular_color_);
         shaderProgram.setFloat("material.shininess", shininess_);
     }
 
 private:
-    unsigned int diffuse_texture_;
+    std::unique_ptr<Texture> diffuse_texture_;
     glm::vec3 specular_color_;
     float shininess_;
 };
@@ -108,24 +234,23 @@ private:
 class DiffuseSpecularMapMaterial: public Material {
 public:
     DiffuseSpecularMapMaterial(std::string diffuse_texture_path, std::string specular_texture_path, float shininess)
-            :shininess_(shininess) {
-        diffuse_texture_ = loadTexture(diffuse_texture_path);
-        specular_texture_ = loadTexture(specular_texture_path);
-    }
+            :diffuse_texture_(new Texture(decodeImage(diffuse_texture_path), diffuse_texture_path)),
+             specular_texture_(new Texture(decodeImage(specular_texture_path), specular_texture_path)),
+             shininess_(shininess) {}
 
-    void load(ShaderProgram shaderProgram) override {
+    void load(const ShaderProgram& shaderProgram) override {
         glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, diffuse_texture_);
+        diffuse_texture_->bind();
         glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, specular_texture_);
+        specular_texture_->bind();
         shaderProgram.setInt("material.diffuse", 0);
         shaderProgram.setInt("material.specular", 1);
         shaderProgram.setFloat("material.shininess", shininess_);
     }
 
 private:
-    unsigned int diffuse_texture_;
-    unsigned int specular_texture_;
+    std::unique_ptr<Texture> diffuse_texture_;
+    std::unique_ptr<Texture> specular_texture_;
     float shininess_;
 };
 
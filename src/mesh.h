@@ -12,7 +12,9 @@
 
 #include "shader.h"
 #include "material.h"
+#include "gpu_residency.h"
 
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <memory>
@@ -22,10 +24,34 @@ using std::string;
 
 class VertexAttributes {
 public:
+    virtual ~VertexAttributes() {}
+
     virtual void initAttributes() = 0;
     virtual void unloadAttributes() = 0;
+    virtual size_t numVertices() const = 0;
+    // Size of the buffers initAttributes() creates.
+    virtual size_t bufferBytes() const = 0;
+    // Frees the CPU copy of data that is in the buffers. readBack() copies it back before the buffers are unloaded.
+    // Attributes that need their data on the CPU keep it.
+    virtual void releaseData() {}
+    virtual void readBack() {}
+};
+
+// Whether meshes keep their vertex and index data in memory once it is uploaded.
+enum class CpuRetention {
+    Release,
+    Keep
 };
 
+// Copies a buffer back into a vector of the size it was created with.
+template<typename T>
+void readBufferData(unsigned int buffer, std::vector<T>& data, size_t size) {
+    data.resize(size);
+    glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+    glGetBufferSubData(GL_COPY_READ_BUFFER, 0, size * sizeof(T), data.data());
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+}
+
 struct Vertex {
     // position
     glm::vec3 position;
@@ -35,97 +61,274 @@ struct Vertex {
     glm::vec2 tex_coords;
 };
 
+class VertexBoneAttribute {
+    const static int MAX_BONES = 4;
+public:
+    glm::ivec4 bones;
+    glm::vec4 weights;
+
+    void AddBone(int bone_id, float weight) {
+        int min_weight_bone = 0;
+        for (int i = 1; i < MAX_BONES; ++i) {
+            if (weights[i] < weights[min_weight_bone]) {
+                min_weight_bone = i;
+            }
+        }
+        if (weight > weights[min_weight_bone]) {
+            bones[min_weight_bone] = bone_id;
+            weights[min_weight_bone] = weight;
+        }
+    }
+
+    void NormalizeWeights() {
+        float total_weight = 0;
+        for (int i = 0; i < MAX_BONES; ++i) {
+            total_weight += weights[i];
+        }
+        if (total_weight != 0) {
+            for (int i = 0; i < MAX_BONES; ++i) {
+                weights[i] /= total_weight;
+            }
+        }
+    }
+};
+
+// Vertex data besides the position, which is kept in a stream of its own.
+struct VertexSurface {
+    glm::vec3 normal;
+    glm::vec2 tex_coords;
+};
+
+// Positions and the rest of the vertex go to separate buffers, so passes that only need positions, like the depth
+// prepass, fetch 12 of the 32 bytes per vertex.
 class PositionalAttributes: public VertexAttributes {
 public:
     PositionalAttributes(const vector<Vertex> &vertices):
-            vertices_(vertices) {}
-
-    PositionalAttributes(vector<Vertex> &&vertices):
-            vertices_(std::move(vertices)) {}
+            positions_(vertices.size()), surfaces_(vertices.size()), num_vertices_(vertices.size()) {
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            positions_[i] = vertices[i].position;
+            surfaces_[i] = {vertices[i].normal, vertices[i].tex_coords};
+        }
+    }
 
     void initAttributes() override {
-        glGenBuffers(1, &VBO);
-        // load data into vertex buffers
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        // A great thing about structs is that their memory layout is sequential for all its items.
-        // The effect is that we can simply pass a pointer to the struct and it translates perfectly to a glm::vec3/2 array which
-        // again translates to 3/2 floats which translates to a byte array.
-        glBufferData(GL_ARRAY_BUFFER, vertices_.size() * sizeof(Vertex), &vertices_[0], GL_STATIC_DRAW);
-
-        // set the vertex attribute pointers
+        glGenBuffers(1, &position_VBO);
+        glGenBuffers(1, &surface_VBO);
+
         // vertex Positions
+        glBindBuffer(GL_ARRAY_BUFFER, position_VBO);
+        glBufferData(GL_ARRAY_BUFFER, positions_.size() * sizeof(glm::vec3), &positions_[0], GL_STATIC_DRAW);
         glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+
+        glBindBuffer(GL_ARRAY_BUFFER, surface_VBO);
+        glBufferData(GL_ARRAY_BUFFER, surfaces_.size() * sizeof(VertexSurface), &surfaces_[0], GL_STATIC_DRAW);
         // vertex normals
         glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(VertexSurface), (void*)offsetof(VertexSurface, normal));
         // vertex texture coords
         glEnableVertexAttribArray(2);
-        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, tex_coords));
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(VertexSurface),
+                              (void*)offsetof(VertexSurface, tex_coords));
     }
 
     void unloadAttributes() override {
-        glDeleteBuffers(1, &VBO);
+        glDeleteBuffers(1, &position_VBO);
+        glDeleteBuffers(1, &surface_VBO);
+    }
+
+    size_t numVertices() const override {
+        return num_vertices_;
+    }
+
+    size_t bufferBytes() const override {
+        return num_vertices_ * (sizeof(glm::vec3) + sizeof(VertexSurface));
+    }
+
+    void releaseData() override {
+        std::vector<glm::vec3>().swap(positions_);
+        std::vector<VertexSurface>().swap(surfaces_);
+    }
+
+    void readBack() override {
+        readBufferData(position_VBO, positions_, num_vertices_);
+        readBufferData(surface_VBO, surfaces_, num_vertices_);
     }
 
 private:
-    std::vector<Vertex> vertices_;
-    unsigned int VBO;
+    std::vector<glm::vec3> positions_;
+    std::vector<VertexSurface> surfaces_;
+    size_t num_vertices_;
+    unsigned int position_VBO;
+    unsigned int surface_VBO;
 };
 
 // Maybe add template argument for Vertex later
 class Mesh {
-    void initMesh() {
-        // create buffers/arrays
-        glGenVertexArrays(1, &VAO);
-        glGenBuffers(1, &EBO);
+    // Vertex and index buffers of one level of detail. Evicting deletes the buffers, a level that released its
+    // CPU copies reads them back first.
+    struct Level : public GpuResource {
+        unsigned int VAO, EBO;
+        std::vector<std::unique_ptr<VertexAttributes>> attributes;
+        std::vector<unsigned int> indices; // Empty while uploaded unless retained
+        size_t num_indices;
+        CpuRetention retention;
+
+        ~Level() {
+            ResidencyManager::instance().remove(this);
+            if (!evicted()) {
+                unload();
+            }
+        }
 
-        glBindVertexArray(VAO);
+        void init() {
+            // create buffers/arrays
+            glGenVertexArrays(1, &VAO);
+            glGenBuffers(1, &EBO);
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices_.size() * sizeof(unsigned int), &indices_[0], GL_STATIC_DRAW);
+            glBindVertexArray(VAO);
 
-        for (const auto& attribute: attributes_) {
-            attribute->initAttributes();
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0],
+                         GL_STATIC_DRAW);
+
+            size_t bytes = indices.size() * sizeof(unsigned int);
+            for (const auto& attribute: attributes) {
+                attribute->initAttributes();
+                bytes += attribute->bufferBytes();
+            }
+
+            glBindVertexArray(0);
+            setResidentBytes(bytes);
+
+            if (retention == CpuRetention::Release) {
+                std::vector<unsigned int>().swap(indices);
+                for (const auto& attribute : attributes) {
+                    attribute->releaseData();
+                }
+            }
         }
 
-        glBindVertexArray(0);
-    }
+        void unload() {
+            for (const auto& attribute : attributes) {
+                attribute->unloadAttributes();
+            }
+            glDeleteVertexArrays(1, &VAO);
+            glDeleteBuffers(1, &EBO);
+        }
+
+    protected:
+        bool evictResource() override {
+            if (retention == CpuRetention::Release) {
+                readBufferData(EBO, indices, num_indices);
+                for (const auto& attribute : attributes) {
+                    attribute->readBack();
+                }
+            }
+            unload();
+            setResidentBytes(0);
+            return true;
+        }
+
+        void restoreResource() override {
+            init();
+        }
+    };
 
 public:
-    Mesh(const std::vector<VertexAttributes*>& attributes, const std::vector<unsigned int>& indices, Material* material):
-        indices_(indices), material_(material) {
-        attributes_.reserve(attributes.size());
+    Mesh(const std::vector<VertexAttributes*>& attributes, const std::vector<unsigned int>& indices, Material* material,
+         CpuRetention retention = CpuRetention::Release):
+        material_(material), retention_(retention) {
+        addLod(attributes, indices);
+    }
+
+    // Adds a coarser level, drawn with the same material. Levels are numbered in the order they are added.
+    void addLod(const std::vector<VertexAttributes*>& attributes, const std::vector<unsigned int>& indices) {
+        levels_.emplace_back(new Level());
+        Level& level = *levels_.back();
+        level.indices = indices;
+        level.num_indices = indices.size();
+        level.retention = retention_;
+        level.attributes.reserve(attributes.size());
         for (auto attribute: attributes) {
-            attributes_.emplace_back(attribute);
+            level.attributes.emplace_back(attribute);
         }
-        initMesh();
+        level.init();
+        ResidencyManager::instance().add(&level);
+    }
+
+    // Restores the buffers of a level if they were evicted, needed before writing to them.
+    void makeResident(size_t lod) {
+        ResidencyManager::instance().touch(levels_[std::min(lod, levels_.size() - 1)].get());
+    }
+
+    size_t numLods() const {
+        return levels_.size();
     }
 
-    // render the mesh
-    void draw(ShaderProgram shader)
+    size_t numIndices(size_t lod = 0) const {
+        return levels_[std::min(lod, levels_.size() - 1)]->num_indices;
+    }
+
+    size_t numVertices(size_t lod = 0) const {
+        return levels_[std::min(lod, levels_.size() - 1)]->attributes[0]->numVertices();
+    }
+
+    // Index buffer of a level, to draw vertices produced from the level with its triangles. Changes when the level
+    // is evicted and restored.
+    unsigned int indexBuffer(size_t lod = 0) const {
+        return levels_[std::min(lod, levels_.size() - 1)]->EBO;
+    }
+
+    // Every vertex of a level once as a point, for transform feedback passes.
+    void drawPoints(size_t lod = 0) {
+        Level& level = *levels_[std::min(lod, levels_.size() - 1)];
+        ResidencyManager::instance().touch(&level);
+        glBindVertexArray(level.VAO);
+        glDrawArrays(GL_POINTS, 0, level.attributes[0]->numVertices());
+        glBindVertexArray(0);
+    }
+
+    // render the mesh, levels past the last one draw the last one
+    void draw(const ShaderProgram& shader, size_t lod = 0)
     {
+        Level& level = *levels_[std::min(lod, levels_.size() - 1)];
+        ResidencyManager::instance().touch(&level);
         material_->load(shader);
         // draw mesh
-        glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, indices_.size(), GL_UNSIGNED_INT, 0);
+        glBindVertexArray(level.VAO);
+        glDrawElements(GL_TRIANGLES, level.num_indices, GL_UNSIGNED_INT, 0);
         glBindVertexArray(0);
     }
 
-    ~Mesh() {
+    // Depth only, without the material, for the depth prepass.
+    void drawDepth(size_t lod = 0) {
+        Level& level = *levels_[std::min(lod, levels_.size() - 1)];
+        ResidencyManager::instance().touch(&level);
+        glBindVertexArray(level.VAO);
+        glDrawElements(GL_TRIANGLES, level.num_indices, GL_UNSIGNED_INT, 0);
+        glBindVertexArray(0);
+    }
 
-        for (const auto& attribute : attributes_) {
-            attribute->unloadAttributes();
-        }
-        glDeleteVertexArrays(1, &VAO);
-        glDeleteBuffers(1, &EBO);
+    void drawDepth(size_t lod, unsigned int vertex_array) {
+        glBindVertexArray(vertex_array);
+        glDrawElements(GL_TRIANGLES, levels_[std::min(lod, levels_.size() - 1)]->num_indices, GL_UNSIGNED_INT, 0);
+        glBindVertexArray(0);
+    }
+
+    // Draws the triangles of a level from the vertices of another vertex array, which has indexBuffer(lod) bound.
+    void draw(const ShaderProgram& shader, size_t lod, unsigned int vertex_array) {
+        const Level& level = *levels_[std::min(lod, levels_.size() - 1)];
+        material_->load(shader);
+        glBindVertexArray(vertex_array);
+        glDrawElements(GL_TRIANGLES, level.num_indices, GL_UNSIGNED_INT, 0);
+        glBindVertexArray(0);
     }
 
 private:
-    unsigned int VAO, EBO;
-    std::vector<std::unique_ptr<VertexAttributes>> attributes_;
-    std::vector<unsigned int> indices_;
+    std::vector<std::unique_ptr<Level>> levels_;
     std::unique_ptr<Material> material_;
+    CpuRetention retention_;
 };
 
 Mesh* createCube(float size) {
@@ -0,0 +1,440 @@
+#ifndef FIRST_TRY_MESH_LOD_H
+#define FIRST_TRY_MESH_LOD_H
+
+#include <glm/glm.hpp>
+
+#include "mesh.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <queue>
+#include <utility>
+#include <vector>
+
+// Simplified version of a skinned mesh. Its vertices are a subset of the full mesh, with bone weights blended
+// from the vertices collapsed into them.
+struct SkinnedMeshLod {
+    std::vector<Vertex> vertices;
+    std::vector<VertexBoneAttribute> bones;
+    std::vector<unsigned int> indices;
+};
+
+// Symmetric 4x4 matrix of Garland and Heckbert, error(p) is the weighted sum of squared distances from p to the
+// planes added to it.
+struct Quadric {
+    double a00 = 0, a01 = 0, a02 = 0, a03 = 0, a11 = 0, a12 = 0, a13 = 0, a22 = 0, a23 = 0, a33 = 0;
+
+    // Plane through the point with the given unit normal.
+    void addPlane(const glm::vec3& normal, const glm::vec3& point, double weight) {
+        double a = normal.x, b = normal.y, c = normal.z;
+        double d = -(a * point.x + b * point.y + c * point.z);
+        a00 += weight * a * a; a01 += weight * a * b; a02 += weight * a * c; a03 += weight * a * d;
+        a11 += weight * b * b; a12 += weight * b * c; a13 += weight * b * d;
+        a22 += weight * c * c; a23 += weight * c * d;
+        a33 += weight * d * d;
+    }
+
+    Quadric& operator+=(const Quadric& other) {
+        a00 += other.a00; a01 += other.a01; a02 += other.a02; a03 += other.a03;
+        a11 += other.a11; a12 += other.a12; a13 += other.a13;
+        a22 += other.a22; a23 += other.a23;
+        a33 += other.a33;
+        return *this;
+    }
+
+    double error(const glm::vec3& p) const {
+        double x = p.x, y = p.y, z = p.z;
+        return a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z + 2 * a03 * x +
+               a11 * y * y + 2 * a12 * y * z + 2 * a13 * y +
+               a22 * z * z + 2 * a23 * z + a33;
+    }
+};
+
+// Edge collapse simplifier. Vertices sharing a position (UV seams, hard normals) are welded and collapse
+// together, a vertex always collapses onto one of its neighbours so no new vertices are made. Open borders are
+// held in place by planes perpendicular to them. Collapses that flip a triangle or pinch the surface are skipped.
+class MeshSimplifier {
+public:
+    MeshSimplifier(const std::vector<Vertex>& vertices, const std::vector<VertexBoneAttribute>& bones,
+                   const std::vector<unsigned int>& indices) :
+            vertices_(vertices), bones_(bones), corners_(indices) {
+        weldPositions();
+        size_t num_triangles = corners_.size() / 3;
+        triangle_alive_.assign(num_triangles, 1);
+        vertex_triangles_.resize(positions_.size());
+        quadrics_.resize(positions_.size());
+        for (size_t t = 0; t < num_triangles; ++t) {
+            uint32_t a = corner(t, 0), b = corner(t, 1), c = corner(t, 2);
+            if (a == b || b == c || a == c) {
+                triangle_alive_[t] = 0;
+                continue;
+            }
+            ++live_triangles_;
+            glm::vec3 normal = glm::cross(positions_[b] - positions_[a], positions_[c] - positions_[a]);
+            float double_area = glm::length(normal);
+            if (double_area > 0.0f) {
+                // Weighted by area, so that slivers don't pin their vertices.
+                Quadric quadric;
+                quadric.addPlane(normal / double_area, positions_[a], 0.5 * double_area);
+                quadrics_[a] += quadric;
+                quadrics_[b] += quadric;
+                quadrics_[c] += quadric;
+            }
+            vertex_triangles_[a].push_back(static_cast<uint32_t>(t));
+            vertex_triangles_[b].push_back(static_cast<uint32_t>(t));
+            vertex_triangles_[c].push_back(static_cast<uint32_t>(t));
+        }
+        addBorderPlanes();
+
+        influences_.resize(positions_.size());
+        for (size_t i = 0; i < vertices_.size(); ++i) {
+            std::vector<std::pair<int, float>>& influences = influences_[welded_[i]];
+            if (!influences.empty()) {
+                continue;
+            }
+            for (int j = 0; j < 4; ++j) {
+                if (bones_[i].weights[j] > 0.0f) {
+                    influences.push_back({bones_[i].bones[j], bones_[i].weights[j]});
+                }
+            }
+        }
+
+        collapsed_.assign(positions_.size(), 0);
+        version_.assign(positions_.size(), 0);
+        for (uint32_t vertex = 0; vertex < positions_.size(); ++vertex) {
+            pushCandidates(vertex);
+        }
+    }
+
+    size_t numTriangles() const {
+        return live_triangles_;
+    }
+
+    // Collapses the cheapest edges until at most target_triangles are left or nothing can be collapsed. Returns
+    // the number of triangles left.
+    size_t simplify(size_t target_triangles) {
+        while (live_triangles_ > target_triangles && !candidates_.empty()) {
+            Candidate candidate = candidates_.top();
+            candidates_.pop();
+            if (collapsed_[candidate.from] || collapsed_[candidate.to] ||
+                version_[candidate.from] != candidate.from_version || version_[candidate.to] != candidate.to_version) {
+                continue;
+            }
+            if (!canCollapse(candidate.from, candidate.to)) {
+                continue;
+            }
+            collapse(candidate.from, candidate.to);
+        }
+        return live_triangles_;
+    }
+
+    // The current state as a compact mesh. Each vertex gets the 4 strongest bones of everything collapsed into
+    // it, renormalized.
+    SkinnedMeshLod extract() const {
+        SkinnedMeshLod lod;
+        std::vector<unsigned int> remap(vertices_.size(), static_cast<unsigned int>(UNUSED));
+        for (size_t t = 0; t < triangle_alive_.size(); ++t) {
+            if (!triangle_alive_[t]) {
+                continue;
+            }
+            for (int k = 0; k < 3; ++k) {
+                unsigned int vertex = corners_[3 * t + k];
+                if (remap[vertex] == UNUSED) {
+                    remap[vertex] = static_cast<unsigned int>(lod.vertices.size());
+                    lod.vertices.push_back(vertices_[vertex]);
+                    lod.bones.push_back(blendedBones(welded_[vertex]));
+                }
+                lod.indices.push_back(remap[vertex]);
+            }
+        }
+        return lod;
+    }
+
+private:
+    static const unsigned int UNUSED = 0xffffffff;
+
+    struct Candidate {
+        double cost;
+        uint32_t from, to;
+        uint32_t from_version, to_version;
+
+        bool operator<(const Candidate& other) const {
+            // Cheapest on top of the max heap.
+            return cost > other.cost;
+        }
+    };
+
+    uint32_t corner(size_t triangle, int k) const {
+        return welded_[corners_[3 * triangle + k]];
+    }
+
+    // Groups vertices with bit identical positions.
+    void weldPositions() {
+        std::vector<uint32_t> order(vertices_.size());
+        for (uint32_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        auto less = [this](uint32_t a, uint32_t b) {
+            const glm::vec3& p = vertices_[a].position;
+            const glm::vec3& q = vertices_[b].position;
+            return p.x != q.x ? p.x < q.x : p.y != q.y ? p.y < q.y : p.z < q.z;
+        };
+        std::sort(order.begin(), order.end(), less);
+        welded_.resize(vertices_.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            if (i == 0 || less(order[i - 1], order[i])) {
+                positions_.push_back(vertices_[order[i]].position);
+                welded_vertices_.emplace_back();
+            }
+            welded_[order[i]] = static_cast<uint32_t>(positions_.size() - 1);
+            welded_vertices_.back().push_back(order[i]);
+        }
+    }
+
+    // Edges with a single triangle get a plane through them, perpendicular to the triangle.
+    void addBorderPlanes() {
+        std::vector<std::pair<uint64_t, uint32_t>> edges;
+        for (size_t t = 0; t < triangle_alive_.size(); ++t) {
+            if (!triangle_alive_[t]) {
+                continue;
+            }
+            for (int k = 0; k < 3; ++k) {
+                uint64_t a = corner(t, k), b = corner(t, (k + 1) % 3);
+                edges.push_back({std::min(a, b) << 32 | std::max(a, b), static_cast<uint32_t>(t)});
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+        for (size_t i = 0; i < edges.size(); ++i) {
+            bool shared = (i > 0 && edges[i - 1].first == edges[i].first) ||
+                          (i + 1 < edges.size() && edges[i + 1].first == edges[i].first);
+            if (shared) {
+                continue;
+            }
+            uint32_t a = static_cast<uint32_t>(edges[i].first >> 32);
+            uint32_t b = static_cast<uint32_t>(edges[i].first & 0xffffffff);
+            size_t t = edges[i].second;
+            glm::vec3 edge = positions_[b] - positions_[a];
+            glm::vec3 face_normal = glm::cross(positions_[corner(t, 1)] - positions_[corner(t, 0)],
+                                               positions_[corner(t, 2)] - positions_[corner(t, 0)]);
+            glm::vec3 normal = glm::cross(edge, face_normal);
+            float length = glm::length(normal);
+            if (length == 0.0f) {
+                continue;
+            }
+            Quadric quadric;
+            quadric.addPlane(normal / length, positions_[a], BORDER_WEIGHT * glm::dot(edge, edge));
+            quadrics_[a] += quadric;
+            quadrics_[b] += quadric;
+        }
+    }
+
+    // Queues the cheaper direction of every edge of the vertex.
+    void pushCandidates(uint32_t vertex) {
+        for (uint32_t t : vertex_triangles_[vertex]) {
+            if (!triangle_alive_[t]) {
+                continue;
+            }
+            for (int k = 0; k < 3; ++k) {
+                uint32_t other = corner(t, k);
+                if (other == vertex) {
+                    continue;
+                }
+                Quadric quadric = quadrics_[vertex];
+                quadric += quadrics_[other];
+                double to_other = quadric.error(positions_[other]);
+                double to_vertex = quadric.error(positions_[vertex]);
+                if (to_other <= to_vertex) {
+                    candidates_.push({to_other, vertex, other, version_[vertex], version_[other]});
+                } else {
+                    candidates_.push({to_vertex, other, vertex, version_[other], version_[vertex]});
+                }
+            }
+        }
+    }
+
+    void collectNeighbours(uint32_t vertex, std::vector<uint32_t>& neighbours) const {
+        neighbours.clear();
+        for (uint32_t t : vertex_triangles_[vertex]) {
+            if (!triangle_alive_[t]) {
+                continue;
+            }
+            for (int k = 0; k < 3; ++k) {
+                if (corner(t, k) != vertex) {
+                    neighbours.push_back(corner(t, k));
+                }
+            }
+        }
+        std::sort(neighbours.begin(), neighbours.end());
+        neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+    }
+
+    bool canCollapse(uint32_t from, uint32_t to) {
+        // Link condition: more than the two vertices opposite of the edge in common would pinch the surface.
+        collectNeighbours(from, from_neighbours_);
+        collectNeighbours(to, to_neighbours_);
+        size_t common = 0;
+        for (size_t i = 0, j = 0; i < from_neighbours_.size() && j < to_neighbours_.size();) {
+            if (from_neighbours_[i] < to_neighbours_[j]) {
+                ++i;
+            } else if (from_neighbours_[i] > to_neighbours_[j]) {
+                ++j;
+            } else {
+                ++common;
+                ++i;
+                ++j;
+            }
+        }
+        if (common > 2 || !std::binary_search(from_neighbours_.begin(), from_neighbours_.end(), to)) {
+            return false;
+        }
+
+        // The triangles that stay must not flip.
+        for (uint32_t t : vertex_triangles_[from]) {
+            if (!triangle_alive_[t]) {
+                continue;
+            }
+            uint32_t a = corner(t, 0), b = corner(t, 1), c = corner(t, 2);
+            if (a == to || b == to || c == to) {
+                continue;
+            }
+            glm::vec3 before = glm::cross(positions_[b] - positions_[a], positions_[c] - positions_[a]);
+            glm::vec3 pa = a == from ? positions_[to] : positions_[a];
+            glm::vec3 pb = b == from ? positions_[to] : positions_[b];
+            glm::vec3 pc = c == from ? positions_[to] : positions_[c];
+            glm::vec3 after = glm::cross(pb - pa, pc - pa);
+            if (glm::dot(before, after) <= 0.0f) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void collapse(uint32_t from, uint32_t to) {
+        collapsed_[from] = 1;
+        quadrics_[to] += quadrics_[from];
+        for (const auto& influence : influences_[from]) {
+            addInfluence(influences_[to], influence.first, influence.second);
+        }
+
+        for (uint32_t t : vertex_triangles_[from]) {
+            if (!triangle_alive_[t]) {
+                continue;
+            }
+            bool has_to = corner(t, 0) == to || corner(t, 1) == to || corner(t, 2) == to;
+            if (has_to) {
+                triangle_alive_[t] = 0;
+                --live_triangles_;
+                continue;
+            }
+            for (int k = 0; k < 3; ++k) {
+                unsigned int& vertex = corners_[3 * t + k];
+                if (welded_[vertex] == from) {
+                    vertex = closestAttributes(vertex, to);
+                }
+            }
+            vertex_triangles_[to].push_back(t);
+        }
+        vertex_triangles_[from].clear();
+
+        ++version_[to];
+        pushCandidates(to);
+    }
+
+    // Vertex at the welded position whose texture coordinates and normal are closest to the given vertex.
+    unsigned int closestAttributes(unsigned int vertex, uint32_t position) const {
+        const Vertex& source = vertices_[vertex];
+        unsigned int best = welded_vertices_[position][0];
+        float best_distance = FLT_MAX;
+        for (unsigned int candidate : welded_vertices_[position]) {
+            const Vertex& target = vertices_[candidate];
+            glm::vec2 uv = target.tex_coords - source.tex_coords;
+            float distance = glm::dot(uv, uv) + 0.1f * (1.0f - glm::dot(target.normal, source.normal));
+            if (distance < best_distance) {
+                best_distance = distance;
+                best = candidate;
+            }
+        }
+        return best;
+    }
+
+    static void addInfluence(std::vector<std::pair<int, float>>& influences, int bone, float weight) {
+        for (auto& influence : influences) {
+            if (influence.first == bone) {
+                influence.second += weight;
+                return;
+            }
+        }
+        influences.push_back({bone, weight});
+    }
+
+    VertexBoneAttribute blendedBones(uint32_t position) const {
+        std::vector<std::pair<int, float>> influences = influences_[position];
+        std::sort(influences.begin(), influences.end(),
+                  [](const std::pair<int, float>& a, const std::pair<int, float>& b) { return a.second > b.second; });
+        VertexBoneAttribute bones;
+        bones.bones = glm::ivec4(0);
+        bones.weights = glm::vec4(0.0f);
+        for (size_t j = 0; j < influences.size() && j < 4; ++j) {
+            bones.bones[j] = influences[j].first;
+            bones.weights[j] = influences[j].second;
+        }
+        bones.NormalizeWeights();
+        return bones;
+    }
+
+    // Border planes are much stiffer than surface planes, silhouettes and mesh seams move last.
+    static constexpr double BORDER_WEIGHT = 10.0;
+
+    const std::vector<Vertex>& vertices_;
+    const std::vector<VertexBoneAttribute>& bones_;
+    std::vector<unsigned int> corners_;                // Index buffer, rewritten as vertices collapse
+    std::vector<uint8_t> triangle_alive_;
+    size_t live_triangles_ = 0;
+
+    // Per welded position
+    std::vector<uint32_t> welded_;                     // Welded position of each vertex
+    std::vector<std::vector<uint32_t>> welded_vertices_;
+    std::vector<glm::vec3> positions_;
+    std::vector<Quadric> quadrics_;
+    std::vector<std::vector<uint32_t>> vertex_triangles_;
+    std::vector<std::vector<std::pair<int, float>>> influences_; // Summed bone weights of collapsed vertices
+    std::vector<uint8_t> collapsed_;
+    std::vector<uint32_t> version_;                    // Bumped when the quadric changes, invalidates candidates
+
+    std::priority_queue<Candidate> candidates_;
+    std::vector<uint32_t> from_neighbours_, to_neighbours_;
+};
+
+constexpr double MeshSimplifier::BORDER_WEIGHT;
+
+// Levels 1 and up of a skinned mesh, each with about reduction times the triangles of the one before. Stops early
+// once a level can't get much smaller or would be tiny.
+std::vector<SkinnedMeshLod> buildLodChain(const std::vector<Vertex>& vertices,
+                                          const std::vector<VertexBoneAttribute>& bones,
+                                          const std::vector<unsigned int>& indices, int levels, float reduction) {
+    const size_t MIN_TRIANGLES = 32;
+    std::vector<SkinnedMeshLod> lods;
+    if (levels < 2 || indices.size() / 3 < 2 * MIN_TRIANGLES) {
+        return lods;
+    }
+    MeshSimplifier simplifier(vertices, bones, indices);
+    size_t triangles = simplifier.numTriangles();
+    for (int level = 1; level < levels; ++level) {
+        size_t target = static_cast<size_t>(triangles * reduction);
+        if (target < MIN_TRIANGLES) {
+            break;
+        }
+        size_t reached = simplifier.simplify(target);
+        // Less than half of the wanted reduction is not worth a level.
+        if (reached > triangles - (triangles - target) / 2) {
+            break;
+        }
+        lods.push_back(simplifier.extract());
+        triangles = reached;
+    }
+    return lods;
+}
+
+#endif //FIRST_TRY_MESH_LOD_H
@@ -0,0 +1,380 @@
+#ifndef FIRST_TRY_MOCAP_BINARY_H
+#define FIRST_TRY_MOCAP_BINARY_H
+
+#include <glm/glm.hpp>
+
+#include "animation_compression.h"
+#include "binary_io.h"
+#include "bvh.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Binary motion capture: the hierarchy once, then one column per channel group, the root position and the
+// rotation of every bone, each holding all frames back to back. Rotations are stored already converted from the
+// Euler angles of the BVH file, positions in file units. Quantized files keep positions as 16 bits per axis over
+// the range of the column and rotations in the smallest three encoding of the compressed clips.
+//
+//     header | bone offsets | bone names | column table | columns, each 64 byte aligned
+
+const uint32_t MOCAP_BINARY_MAGIC = 0x424F434D; // "MCOB"
+const uint32_t MOCAP_BINARY_VERSION = 1;
+const uint32_t MOCAP_BINARY_QUANTIZED = 1;
+const size_t MOCAP_BINARY_ALIGNMENT = 64;
+
+struct MocapBinaryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t num_bones;
+    uint64_t num_frames;
+    double frame_time;
+    uint64_t columns_offset; // Of the column table
+    uint64_t file_size;
+};
+
+// Column 0 is the root position, column 1 + n the rotation of bone n.
+struct MocapBinaryColumn {
+    uint64_t offset;
+    glm::vec3 position_min;   // Quantized positions only
+    glm::vec3 position_scale; // Range of the column divided by the number of quantization steps
+};
+
+size_t mocapBinaryAlign(size_t offset) {
+    return (offset + MOCAP_BINARY_ALIGNMENT - 1) / MOCAP_BINARY_ALIGNMENT * MOCAP_BINARY_ALIGNMENT;
+}
+
+size_t mocapPositionStride(bool quantized) {
+    return quantized ? 3 * sizeof(uint16_t) : sizeof(glm::vec3);
+}
+
+size_t mocapRotationStride(bool quantized) {
+    return quantized ? 3 * sizeof(uint16_t) : sizeof(glm::quat);
+}
+
+// Writes a file frame by frame. Rotations are kept for a block of frames and then written into their columns,
+// root positions for the whole capture, as quantizing them needs their range.
+class MocapBinaryWriter {
+public:
+    static const size_t BLOCK_FRAMES = 4096;
+
+    MocapBinaryWriter(const std::string& path, const BvhHierarchy& hierarchy, double frame_time, size_t num_frames,
+                      bool quantize) :
+            path_(path), num_bones_(hierarchy.bones.size()), num_frames_(num_frames), quantize_(quantize),
+            file_(temporaryPath(), std::ios::binary | std::ios::trunc) {
+        size_t offset = mocapBinaryAlign(sizeof(MocapBinaryHeader)) + num_bones_ * sizeof(glm::vec3);
+        for (const std::string& bone : hierarchy.bones) {
+            offset += sizeof(uint32_t) + bone.size();
+        }
+        offset = (offset + 7) / 8 * 8;
+        header_.magic = MOCAP_BINARY_MAGIC;
+        header_.version = MOCAP_BINARY_VERSION;
+        header_.flags = quantize ? MOCAP_BINARY_QUANTIZED : 0;
+        header_.num_bones = static_cast<uint32_t>(num_bones_);
+        header_.num_frames = num_frames;
+        header_.frame_time = frame_time;
+        header_.columns_offset = offset;
+        columns_.resize(1 + num_bones_);
+        offset += columns_.size() * sizeof(MocapBinaryColumn);
+        for (size_t column = 0; column < columns_.size(); ++column) {
+            offset = mocapBinaryAlign(offset);
+            columns_[column] = MocapBinaryColumn();
+            columns_[column].offset = offset;
+            offset += num_frames * (column == 0 ? mocapPositionStride(quantize) : mocapRotationStride(quantize));
+        }
+        header_.file_size = offset;
+
+        if (!file_) {
+            return;
+        }
+        file_.seekp(mocapBinaryAlign(sizeof(MocapBinaryHeader)));
+        for (const glm::vec3& bone_offset : hierarchy.offsets) {
+            writeValue(file_, bone_offset);
+        }
+        for (const std::string& bone : hierarchy.bones) {
+            writeString(file_, bone);
+        }
+        root_positions_.reserve(num_frames);
+        rotations_.resize(BLOCK_FRAMES * num_bones_);
+    }
+
+    MocapBinaryWriter(const MocapBinaryWriter&) = delete;
+    MocapBinaryWriter& operator=(const MocapBinaryWriter&) = delete;
+
+    ~MocapBinaryWriter() {
+        if (!finished_) {
+            file_.close();
+            std::remove(temporaryPath().c_str());
+        }
+    }
+
+    size_t fileSize() const {
+        return header_.file_size;
+    }
+
+    // Frames past the count given up front are ignored.
+    void addFrame(const glm::vec3& root_position, const glm::quat* rotations) {
+        if (root_positions_.size() == num_frames_) {
+            return;
+        }
+        size_t slot = root_positions_.size() % BLOCK_FRAMES;
+        root_positions_.push_back(root_position);
+        std::copy(rotations, rotations + num_bones_, &rotations_[slot * num_bones_]);
+        if (slot + 1 == BLOCK_FRAMES) {
+            flushRotations();
+        }
+    }
+
+    // False if not every frame was added or the file could not be written. The file only appears under its
+    // path once it is complete.
+    bool finish() {
+        if (root_positions_.size() != num_frames_ || !file_) {
+            return false;
+        }
+        flushRotations();
+        writePositions();
+        file_.seekp(0);
+        writeValue(file_, header_);
+        file_.seekp(header_.columns_offset);
+        for (const MocapBinaryColumn& column : columns_) {
+            writeValue(file_, column);
+        }
+        file_.close();
+        if (!file_ || std::rename(temporaryPath().c_str(), path_.c_str()) != 0) {
+            return false;
+        }
+        finished_ = true;
+        return true;
+    }
+
+private:
+    std::string temporaryPath() const {
+        return path_ + ".tmp";
+    }
+
+    // The frames added since the last flush, one contiguous run per column.
+    void flushRotations() {
+        size_t count = root_positions_.size() - flushed_frames_;
+        if (count == 0) {
+            return;
+        }
+        size_t stride = mocapRotationStride(quantize_);
+        run_.resize(count * stride);
+        for (size_t bone = 0; bone < num_bones_; ++bone) {
+            for (size_t frame = 0; frame < count; ++frame) {
+                glm::quat rotation = rotations_[frame * num_bones_ + bone];
+                if (quantize_) {
+                    packQuaternion(glm::normalize(rotation), reinterpret_cast<uint16_t*>(&run_[frame * stride]));
+                } else {
+                    std::memcpy(&run_[frame * stride], &rotation, stride);
+                }
+            }
+            file_.seekp(columns_[1 + bone].offset + flushed_frames_ * stride);
+            file_.write(run_.data(), run_.size());
+        }
+        flushed_frames_ = root_positions_.size();
+    }
+
+    void writePositions() {
+        MocapBinaryColumn& column = columns_[0];
+        file_.seekp(column.offset);
+        if (!quantize_) {
+            if (!root_positions_.empty()) {
+                file_.write(reinterpret_cast<const char*>(root_positions_.data()),
+                            root_positions_.size() * sizeof(glm::vec3));
+            }
+            return;
+        }
+        glm::vec3 position_min(0.0f), position_max(0.0f);
+        if (!root_positions_.empty()) {
+            position_min = position_max = root_positions_[0];
+        }
+        for (const glm::vec3& position : root_positions_) {
+            position_min = glm::min(position_min, position);
+            position_max = glm::max(position_max, position);
+        }
+        column.position_min = position_min;
+        column.position_scale = (position_max - position_min) / 65535.0f;
+        std::vector<uint16_t> quantized(3 * root_positions_.size());
+        for (size_t frame = 0; frame < root_positions_.size(); ++frame) {
+            for (int axis = 0; axis < 3; ++axis) {
+                float extent = position_max[axis] - position_min[axis];
+                float normalized = extent > 0.0f ? (root_positions_[frame][axis] - position_min[axis]) / extent : 0.0f;
+                quantized[3 * frame + axis] = static_cast<uint16_t>(std::lround(normalized * 65535.0f));
+            }
+        }
+        if (!quantized.empty()) {
+            file_.write(reinterpret_cast<const char*>(quantized.data()), quantized.size() * sizeof(uint16_t));
+        }
+    }
+
+    std::string path_;
+    size_t num_bones_;
+    size_t num_frames_;
+    bool quantize_;
+    bool finished_ = false;
+    std::ofstream file_;
+    MocapBinaryHeader header_;
+    std::vector<MocapBinaryColumn> columns_;
+    std::vector<glm::vec3> root_positions_;
+    std::vector<glm::quat> rotations_; // Block of frames, bones of a frame next to each other
+    size_t flushed_frames_ = 0;
+    std::vector<char> run_; // One column of a block, as written
+};
+
+// Binary motion capture mapped read only. Opening reads the header and the bone names, frames are read straight
+// from the mapping when sampled, so the capture may be sampled from any number of threads.
+class MappedMocapFile {
+public:
+    // Whether the file starts like a binary motion capture, whatever its name.
+    static bool matches(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        return file && readValue<uint32_t>(file) == MOCAP_BINARY_MAGIC && file;
+    }
+
+    explicit MappedMocapFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat file_stat;
+        if (fd < 0 || fstat(fd, &file_stat) != 0 ||
+            static_cast<size_t>(file_stat.st_size) < sizeof(MocapBinaryHeader)) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            std::cout << "ERROR::MOCAP_BINARY::OPEN_FAILED " << path << std::endl;
+            return;
+        }
+        size_ = static_cast<size_t>(file_stat.st_size);
+        void* mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            std::cout << "ERROR::MOCAP_BINARY::MAP_FAILED " << path << std::endl;
+            return;
+        }
+        data_ = static_cast<const char*>(mapping);
+        // Sampling walks every column at once, so read ahead instead of faulting in page by page.
+        madvise(mapping, size_, MADV_WILLNEED);
+        if (!readLayout()) {
+            std::cout << "ERROR::MOCAP_BINARY::INVALID_FILE " << path << std::endl;
+            return;
+        }
+        valid_ = true;
+    }
+
+    MappedMocapFile(const MappedMocapFile&) = delete;
+    MappedMocapFile& operator=(const MappedMocapFile&) = delete;
+
+    ~MappedMocapFile() {
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    bool valid() const {
+        return valid_;
+    }
+
+    const BvhHierarchy& hierarchy() const {
+        return hierarchy_;
+    }
+
+    size_t numFrames() const {
+        return header_.num_frames;
+    }
+
+    double frameTime() const {
+        return header_.frame_time;
+    }
+
+    bool quantized() const {
+        return (header_.flags & MOCAP_BINARY_QUANTIZED) != 0;
+    }
+
+    size_t bytes() const {
+        return size_;
+    }
+
+    // In file units, like the offsets of the hierarchy.
+    glm::vec3 rootPosition(size_t frame) const {
+        const char* values = data_ + columns_[0].offset;
+        if (!quantized()) {
+            return reinterpret_cast<const glm::vec3*>(values)[frame];
+        }
+        const uint16_t* packed = reinterpret_cast<const uint16_t*>(values) + 3 * frame;
+        return columns_[0].position_min + columns_[0].position_scale * glm::vec3(packed[0], packed[1], packed[2]);
+    }
+
+    glm::quat rotation(size_t bone, size_t frame) const {
+        const char* values = data_ + columns_[1 + bone].offset;
+        if (!quantized()) {
+            return reinterpret_cast<const glm::quat*>(values)[frame];
+        }
+        return unpackQuaternion(reinterpret_cast<const uint16_t*>(values) + 3 * frame);
+    }
+
+private:
+    // Checks that everything the header points to lies inside the file.
+    bool readLayout() {
+        std::memcpy(&header_, data_, sizeof(header_));
+        if (header_.magic != MOCAP_BINARY_MAGIC || header_.version != MOCAP_BINARY_VERSION ||
+            header_.file_size != size_ || header_.num_bones == 0 || header_.num_frames == 0 ||
+            !(header_.frame_time > 0.0)) {
+            return false;
+        }
+        size_t num_bones = header_.num_bones;
+        size_t offset = mocapBinaryAlign(sizeof(MocapBinaryHeader));
+        if (offset + num_bones * sizeof(glm::vec3) > size_) {
+            return false;
+        }
+        hierarchy_.offsets.resize(num_bones);
+        std::memcpy(&hierarchy_.offsets[0], data_ + offset, num_bones * sizeof(glm::vec3));
+        offset += num_bones * sizeof(glm::vec3);
+        for (size_t bone = 0; bone < num_bones; ++bone) {
+            uint32_t length;
+            if (offset + sizeof(length) > size_) {
+                return false;
+            }
+            std::memcpy(&length, data_ + offset, sizeof(length));
+            offset += sizeof(length);
+            if (offset + length > size_) {
+                return false;
+            }
+            hierarchy_.bones.emplace_back(data_ + offset, length);
+            offset += length;
+        }
+        // Offsets and counts come from the file, so the checks are written not to wrap.
+        if (header_.columns_offset < offset || header_.columns_offset % 8 != 0 || header_.columns_offset > size_ ||
+            (1 + num_bones) * sizeof(MocapBinaryColumn) > size_ - header_.columns_offset) {
+            return false;
+        }
+        columns_ = reinterpret_cast<const MocapBinaryColumn*>(data_ + header_.columns_offset);
+        for (size_t column = 0; column <= num_bones; ++column) {
+            size_t stride = column == 0 ? mocapPositionStride(quantized()) : mocapRotationStride(quantized());
+            if (columns_[column].offset % MOCAP_BINARY_ALIGNMENT != 0 || columns_[column].offset > size_ ||
+                header_.num_frames > (size_ - columns_[column].offset) / stride) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool valid_ = false;
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    MocapBinaryHeader header_;
+    BvhHierarchy hierarchy_;
+    const MocapBinaryColumn* columns_ = nullptr;
+};
+
+#endif //FIRST_TRY_MOCAP_BINARY_H
@@ -0,0 +1,50 @@
+// Converts a text BVH file to the binary motion capture format of mocap_binary.h, which the viewer maps instead
+// of parsing.
+//     mocap_convert <input bvh> <output> [--quantize]
+
+#include "bvh_index.h"
+#include "mocap_binary.h"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+int main(int argc, char** argv) {
+    std::string input, output;
+    bool quantize = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        if (argument == "--quantize") {
+            quantize = true;
+        } else if (input.empty()) {
+            input = argument;
+        } else {
+            output = argument;
+        }
+    }
+    if (input.empty() || output.empty()) {
+        std::cout << "Usage: mocap_convert <input bvh> <output> [--quantize]" << std::endl;
+        return 1;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    // Read front to back through the index, a window at a time, in file units.
+    IndexedBvhFile bvh(input, 1.0f, MocapBinaryWriter::BLOCK_FRAMES);
+    if (!bvh.valid()) {
+        return 1;
+    }
+    MocapBinaryWriter writer(output, bvh.hierarchy(), bvh.frameTime(), bvh.numFrames(), quantize);
+    for (size_t frame = 0; frame < bvh.numFrames(); ++frame) {
+        BvhFrame decoded = bvh.frame(frame);
+        writer.addFrame(decoded.root_position, decoded.rotations);
+    }
+    if (!writer.finish()) {
+        std::cout << "ERROR::MOCAP_CONVERT::WRITE_FAILED " << output << std::endl;
+        return 1;
+    }
+    double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Converted " << bvh.numFrames() << " frames of " << bvh.hierarchy().bones.size() << " bones, "
+              << bvh.stats().index_bytes << " byte index, " << writer.fileSize() << " bytes"
+              << (quantize ? " quantized" : "") << " in " << elapsed_ms << " ms" << std::endl;
+    return 0;
+}
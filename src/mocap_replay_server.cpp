@@ -0,0 +1,132 @@
+// Stand-in for a capture stage: serves a BVH file as a live motion stream (see motion_stream.h), looping it at
+// its frame rate to one client at a time.
+//     mocap_replay_server [address] [bvh file] [--jitter <ms>] [--drop <fraction>]
+// The jitter delays each frame by up to the given time, drop skips that fraction of the frames, to try the jitter
+// buffer of the client.
+
+#include "motion_stream.h"
+
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct BvhReplay {
+    std::string header; // HIERARCHY through the Frame Time line
+    std::vector<std::string> frames;
+};
+
+bool loadReplay(const std::string& path, BvhReplay& replay) {
+    std::ifstream file(path);
+    std::string line;
+    bool motion = false;
+    while (std::getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!motion) {
+            replay.header += line + "\n";
+            motion = line.compare(0, 11, "Frame Time:") == 0;
+        } else if (line.find_first_not_of(" \t") != std::string::npos) {
+            replay.frames.push_back(line);
+        }
+    }
+    std::istringstream header(replay.header);
+    BvhHierarchy hierarchy;
+    return motion && readBvhHierarchy(header, hierarchy) && !replay.frames.empty();
+}
+
+bool sendAll(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t result = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (result <= 0) {
+            return false;
+        }
+        sent += static_cast<size_t>(result);
+    }
+    return true;
+}
+
+double frameTimeOf(const std::string& header) {
+    size_t position = header.rfind("Frame Time:");
+    return std::atof(header.c_str() + position + 11);
+}
+
+// Plays the frames in a loop until the client goes away.
+void serve(int client, const BvhReplay& replay, double jitter_ms, double drop_fraction, std::mt19937& random) {
+    if (!sendAll(client, replay.header)) {
+        return;
+    }
+    double frame_time = frameTimeOf(replay.header);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int64_t start_micros = motionClockMicros();
+    std::string line;
+    for (uint64_t sequence = 0;; ++sequence) {
+        // Captured on time, delivered with the jitter.
+        double capture_time = sequence * frame_time;
+        std::chrono::duration<double> due(capture_time + jitter_ms * unit(random) / 1000.0);
+        std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(due));
+        if (unit(random) < drop_fraction) {
+            continue;
+        }
+        int64_t capture_micros = start_micros + static_cast<int64_t>(capture_time * 1e6);
+        line = std::to_string(sequence) + " " + std::to_string(capture_micros) + " " +
+               replay.frames[sequence % replay.frames.size()] + "\n";
+        if (!sendAll(client, line)) {
+            return;
+        }
+    }
+}
+
+}
+
+int main(int argc, char** argv) {
+    std::string address = "127.0.0.1:7001";
+    std::string path = "resources/models/17_03.bvh";
+    double jitter_ms = 0.0;
+    double drop_fraction = 0.0;
+    int positional = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        if (argument == "--jitter" && i + 1 < argc) {
+            jitter_ms = std::atof(argv[++i]);
+        } else if (argument == "--drop" && i + 1 < argc) {
+            drop_fraction = std::atof(argv[++i]);
+        } else if (positional++ == 0) {
+            address = argument;
+        } else {
+            path = argument;
+        }
+    }
+
+    BvhReplay replay;
+    if (!loadReplay(path, replay)) {
+        std::cout << "ERROR::REPLAY_SERVER::INVALID_BVH " << path << std::endl;
+        return 1;
+    }
+    int server = openMotionSocket(address, true);
+    if (server < 0) {
+        std::cout << "ERROR::REPLAY_SERVER::LISTEN_FAILED " << address << std::endl;
+        return 1;
+    }
+    std::cout << "Serving " << replay.frames.size() << " frames of " << path << " on " << address << std::endl;
+    std::mt19937 random(7);
+    while (true) {
+        int client = accept(server, nullptr, nullptr);
+        if (client < 0) {
+            continue;
+        }
+        int enable = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        std::cout << "Client connected" << std::endl;
+        serve(client, replay, jitter_ms, drop_fraction, random);
+        close(client);
+        std::cout << "Client disconnected" << std::endl;
+    }
+}
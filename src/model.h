@@ -14,13 +14,30 @@
 
 #include "shader.h"
 #include "mesh.h"
-
+#include "skinning.h"
+#include "animation.h"
+#include "bvh.h"
+#include "bvh_index.h"
+#include "mocap_binary.h"
+#include "motion_stream.h"
+#include "animation_compression.h"
+#include "animation_clip.h"
+#include "clip_library.h"
+#include "name_table.h"
+#include "frame_memory.h"
+#include "culling.h"
+#include "mesh_lod.h"
+#include "occlusion_culling.h"
+#include "thread_pool.h"
+
+#include <chrono>
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <algorithm>
 #include <cmath>
@@ -70,15 +87,82 @@ glm::quat aiToGlmQuat(const aiQuaternion& quaternion) {
     return {quaternion.w, quaternion.x, quaternion.y, quaternion.z};
 }
 
+enum class MotionCaptureLoading {
+    Full,   // Every frame is decoded up front
+    Indexed // Frames are decoded from the mapped file as they are sampled, for captures too long to hold
+};
+
 class MotionCaptureData {
 public:
-    MotionCaptureData(const std::string& filename) {
-        parseBVH(filename);
+    // A binary capture (see mocap_binary.h) is mapped whatever the loading. An indexed capture decodes frames
+    // while it is sampled, so it may only be sampled by one thread at a time.
+    MotionCaptureData(const std::string& filename, MotionCaptureLoading loading = MotionCaptureLoading::Full) {
+        if (MappedMocapFile::matches(filename)) {
+            openMapped(filename);
+        } else if (loading == MotionCaptureLoading::Indexed) {
+            openIndexed(filename);
+        } else {
+            parseBVH(filename);
+        }
+    }
+
+    // False if the file could not be read as a capture with at least one bone and one frame.
+    bool valid() const {
+        return !bone_list.empty() && num_frames_ > 0;
+    }
+
+    size_t numBones() const {
+        return bone_list.size();
+    }
+
+    const std::string& boneName(size_t bone) const {
+        return bone_list[bone];
+    }
+
+    // Returns -1 if the capture has no bone with this name.
+    int findBone(const std::string& bone_name) const {
+        return bone_hash_.find(bone_name);
     }
 
-    glm::vec3 get_position(const std::string& bone_name, double time) {
+    int findBone(NameId bone_name) const {
+        return bone_hash_.find(bone_name);
+    }
+
+    double frameTime() const {
+        return frame_time;
+    }
+
+    int numFrames() const {
+        return num_frames_;
+    }
+
+    glm::vec3 get_position(const std::string& bone_name, double time) const {
+        return samplePosition(findBone(bone_name), time);
+    }
+
+    glm::quat get_rotation(const std::string& bone_name, double time) const {
+        return sampleRotation(findBone(bone_name), time);
+    }
+
+    glm::vec3 samplePosition(size_t bone, double time) const {
+        if (compressed_) {
+            return compressed_->samplePosition(bone, compressed_->loopTime(time));
+        }
+        if (mapped_ && bone == 0) {
+            size_t frame, next_frame;
+            float mix_ratio = loopFrames(time, frame, next_frame);
+            glm::vec3 prev_position = mapped_->rootPosition(frame);
+            glm::vec3 next_position = mapped_->rootPosition(next_frame);
+            return (prev_position * (1 - mix_ratio) + next_position * mix_ratio) * static_cast<float>(SCALE);
+        }
+        if (indexed_ && bone == 0) {
+            size_t frame, next_frame;
+            float mix_ratio = loopFrames(time, frame, next_frame);
+            glm::vec3 prev_position = indexed_->frame(frame).root_position;
+            return prev_position * (1 - mix_ratio) + indexed_->frame(next_frame).root_position * mix_ratio;
+        }
         int frame = static_cast<int>(std::floor(time / frame_time));
-        const auto& positions_vector = positions[bone_name];
+        const auto& positions_vector = positions[bone];
         if (positions_vector.size() == 1) {
             return positions_vector[0];
         }
@@ -92,9 +176,23 @@ public:
         return prev_position * (1 - mix_ratio) + next_position * mix_ratio;
     }
 
-    glm::quat get_rotation(const std::string& bone_name, double time) {
+    glm::quat sampleRotation(size_t bone, double time) const {
+        if (compressed_) {
+            return compressed_->sampleRotation(bone, compressed_->loopTime(time));
+        }
+        if (mapped_) {
+            size_t frame, next_frame;
+            float mix_ratio = loopFrames(time, frame, next_frame);
+            return glm::slerp(mapped_->rotation(bone, frame), mapped_->rotation(bone, next_frame), mix_ratio);
+        }
+        if (indexed_) {
+            size_t frame, next_frame;
+            float mix_ratio = loopFrames(time, frame, next_frame);
+            glm::quat prev_rotation = indexed_->frame(frame).rotations[bone];
+            return glm::slerp(prev_rotation, indexed_->frame(next_frame).rotations[bone], mix_ratio);
+        }
         int frame = static_cast<int>(std::floor(time / frame_time));
-        const auto& rotations_vector = rotations[bone_name];
+        const auto& rotations_vector = rotations[bone];
         frame %= rotations_vector.size();
         if (frame == rotations_vector.size() - 1) {
             frame = 0;
@@ -105,119 +203,210 @@ public:
         return glm::slerp(prev_rotation, next_rotation, mix_ratio);
     }
 
-private:
-    void parseBVH(const std::string& filename) {
-        std::ifstream bvh_file(filename);
-        std::string help_string;
-        bvh_file >> help_string;
-        assert(help_string == "HIERARCHY");
-        while (help_string != "MOTION") {
-            bvh_file >> help_string;
-            if (help_string == "ROOT" || help_string == "JOINT") {
-                std::string bone_name;
-                bvh_file >> bone_name;
-                bone_list.push_back(bone_name);
-                bvh_file >> help_string;
-                bvh_file >> help_string;
-                assert(help_string == "OFFSET");
-                float x, y, z;
-                bvh_file >> x >> y >> z;
-                positions[bone_name].push_back({x * SCALE, y * SCALE, z * SCALE}); // blender coordinates
-                int channels;
-                bvh_file >> help_string >> channels;
-                assert(help_string == "CHANNELS");
-                for (int i = 0; i < channels; ++i) {
-                    bvh_file >> help_string;
-                }
+    // Capture of a single bone as one keyframe per frame.
+    std::vector<AnimationBoneKeyframe> getKeyframes(size_t bone) const {
+        if (mapped_) {
+            std::vector<AnimationBoneKeyframe> keyframes(num_frames_);
+            for (size_t frame = 0; frame < keyframes.size(); ++frame) {
+                keyframes[frame].position =
+                        bone == 0 ? mapped_->rootPosition(frame) * static_cast<float>(SCALE) : positions[bone][0];
+                keyframes[frame].rotation = mapped_->rotation(bone, frame);
+                keyframes[frame].time = frame * frame_time;
             }
+            return keyframes;
         }
-        bvh_file >> help_string >> num_frames_;
-        assert(help_string == "Frames:");
-        std::cout << "Frames: " << num_frames_ << "\n";
-        bvh_file >> help_string >> help_string >> frame_time;
-        assert(help_string == "Time:");
-        std::cout << "Frame time: " << frame_time << "\n";
-        for (int i = 0; i < num_frames_; ++i) {
-            for (int j = 0; j < bone_list.size(); ++j) {
-                if (j == 0) {
-                    float x, y, z;
-                    bvh_file >> x >> y >> z;
-                    glm::vec3 pos(x * SCALE, y * SCALE, z * SCALE);
-                    if (i == 0) {
-                        positions[bone_list[j]][0] = pos;
-                    } else {
-                        positions[bone_list[j]].push_back(pos);
-                    }
-                    float z_rot, y_rot, x_rot;
-                    bvh_file >> z_rot >> y_rot >> x_rot;
-                    // std::cout << z_rot << " " << y_rot << " " << x_rot << "\n";
-                    glm::mat4 rotation = glm::mat4(1.0f)
-                            * glm::rotate(glm::radians(z_rot), glm::vec3(0.0f, -1.0f, 0.0f))
-                                         * glm::rotate(glm::radians(y_rot), glm::vec3(0.0f, 0.0f, 1.0f))
-                                         * glm::rotate(glm::radians(x_rot), glm::vec3(1.0f, 0.0f, 0.0f));
-                    rotations[bone_list[j]].push_back(glm::quat_cast(rotation));
-                } else {
-                    float z_rot, x_rot, y_rot;
-                    bvh_file >> z_rot >> x_rot >> y_rot;
-                    glm::mat4 rotation =
-                            glm::rotate(glm::radians(z_rot), glm::vec3(0.0f, 0.0f, 1.0f))
-                                         * glm::rotate(glm::radians(x_rot), glm::vec3(1.0f, 0.0f, 0.0f))
-                                         * glm::rotate(glm::radians(y_rot), glm::vec3(0.0f, 1.0f, 0.0f));
-                    rotations[bone_list[j]].push_back(glm::quat_cast(rotation));
-                }
+        if (indexed_) {
+            std::vector<AnimationBoneKeyframe> keyframes(num_frames_);
+            for (size_t frame = 0; frame < keyframes.size(); ++frame) {
+                BvhFrame decoded = indexed_->frame(frame);
+                keyframes[frame].position = bone == 0 ? decoded.root_position : positions[bone][0];
+                keyframes[frame].rotation = decoded.rotations[bone];
+                keyframes[frame].time = frame * frame_time;
             }
+            return keyframes;
         }
+        const auto& positions_vector = positions[bone];
+        const auto& rotations_vector = rotations[bone];
+        std::vector<AnimationBoneKeyframe> keyframes(rotations_vector.size());
+        for (size_t frame = 0; frame < keyframes.size(); ++frame) {
+            keyframes[frame].position = positions_vector[std::min(frame, positions_vector.size() - 1)];
+            keyframes[frame].rotation = rotations_vector[frame];
+            keyframes[frame].time = frame * frame_time;
+        }
+        return keyframes;
+    }
 
-        bvh_file.close();
+    // Replaces the per frame data with a compressed clip. Sampling loops over the capture as before.
+    CompressionStats compress(const CompressionSettings& settings) {
+        std::vector<std::vector<AnimationBoneKeyframe>> tracks(bone_list.size());
+        if (indexed_) {
+            // Frame by frame, every frame is decoded once.
+            for (size_t i = 0; i < bone_list.size(); ++i) {
+                tracks[i].resize(num_frames_);
+            }
+            for (int frame = 0; frame < num_frames_; ++frame) {
+                BvhFrame decoded = indexed_->frame(frame);
+                for (size_t i = 0; i < bone_list.size(); ++i) {
+                    tracks[i][frame].position = i == 0 ? decoded.root_position : positions[i][0];
+                    tracks[i][frame].rotation = decoded.rotations[i];
+                    tracks[i][frame].time = frame * frame_time;
+                }
+            }
+        } else {
+            for (size_t i = 0; i < bone_list.size(); ++i) {
+                tracks[i] = getKeyframes(i);
+            }
+        }
+        CompressionStats stats;
+        compressed_.reset(new CompressedClip(CompressedClip::compress(tracks, settings, &stats)));
+        // The stats count whole keyframes, the capture keeps a rotation per bone and frame and moves only the root.
+        if (!bone_list.empty()) {
+            stats.raw_bytes = num_frames_ * bone_list.size() * sizeof(glm::quat) +
+                              (num_frames_ + bone_list.size() - 1) * sizeof(glm::vec3);
+        }
+        positions.clear();
+        rotations.clear();
+        indexed_.reset();
+        mapped_.reset();
+        return stats;
     }
 
-    double SCALE = 0.028;
-    std::vector<std::string> bone_list;
-    std::unordered_map<std::string, std::vector<glm::vec3>> positions;
-    std::unordered_map<std::string, std::vector<glm::quat>> rotations;
-    double frame_time;
-    int num_frames_;
-};
+    // Null unless the capture is indexed.
+    const IndexedBvhFile* indexedFile() const {
+        return indexed_.get();
+    }
 
-class VertexBoneAttribute {
-    const static int MAX_BONES = 4;
-public:
-    glm::ivec4 bones;
-    glm::vec4 weights;
+private:
+    void openIndexed(const std::string& filename) {
+        indexed_.reset(new IndexedBvhFile(filename, static_cast<float>(SCALE)));
+        if (!indexed_->valid()) {
+            indexed_.reset();
+            return;
+        }
+        const BvhHierarchy& hierarchy = indexed_->hierarchy();
+        bone_list = hierarchy.bones;
+        for (size_t j = 0; j < bone_list.size(); ++j) {
+            bone_ids_.push_back(NameTable::instance().intern(bone_list[j]));
+            positions.emplace_back(1, hierarchy.offsets[j] * static_cast<float>(SCALE));
+        }
+        rotations.resize(bone_list.size());
+        bone_hash_ = PerfectNameHash(bone_ids_);
+        num_frames_ = static_cast<int>(indexed_->numFrames());
+        frame_time = indexed_->frameTime();
+        std::cout << "Frames: " << num_frames_ << " indexed in " << indexed_->stats().index_ms << " ms\n";
+    }
 
-    void AddBone(int bone_id, float weight) {
-        int min_weight_bone = 0;
-        for (int i = 1; i < MAX_BONES; ++i) {
-            if (weights[i] < weights[min_weight_bone]) {
-                min_weight_bone = i;
-            }
+    void openMapped(const std::string& filename) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        mapped_.reset(new MappedMocapFile(filename));
+        if (!mapped_->valid()) {
+            mapped_.reset();
+            return;
         }
-        if (weight > weights[min_weight_bone]) {
-            bones[min_weight_bone] = bone_id;
-            weights[min_weight_bone] = weight;
+        const BvhHierarchy& hierarchy = mapped_->hierarchy();
+        bone_list = hierarchy.bones;
+        for (size_t j = 0; j < bone_list.size(); ++j) {
+            bone_ids_.push_back(NameTable::instance().intern(bone_list[j]));
+            positions.emplace_back(1, hierarchy.offsets[j] * static_cast<float>(SCALE));
         }
+        rotations.resize(bone_list.size());
+        bone_hash_ = PerfectNameHash(bone_ids_);
+        num_frames_ = static_cast<int>(mapped_->numFrames());
+        frame_time = mapped_->frameTime();
+        double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Frames: " << num_frames_ << " mapped" << (mapped_->quantized() ? " quantized" : "") << " in "
+                  << elapsed_ms << " ms\n";
     }
 
-    void NormalizeWeights() {
-        float total_weight = 0;
-        for (int i = 0; i < MAX_BONES; ++i) {
-            total_weight += weights[i];
+    // Frames around the time and the blend between them, looping like the fully decoded capture.
+    float loopFrames(double time, size_t& frame, size_t& next_frame) const {
+        int frame_number = static_cast<int>(std::floor(time / frame_time)) % num_frames_;
+        if (frame_number < 0 || frame_number == num_frames_ - 1) {
+            frame_number = 0;
+        }
+        frame = static_cast<size_t>(frame_number);
+        next_frame = num_frames_ > 1 ? frame + 1 : frame;
+        return static_cast<float>(fmod(time, frame_time) / frame_time);
+    }
+
+    void parseBVH(const std::string& filename) {
+        std::ifstream bvh_file(filename);
+        BvhHierarchy hierarchy;
+        if (!readBvhHierarchy(bvh_file, hierarchy)) {
+            std::cout << "ERROR::MOTION_CAPTURE::INVALID_HIERARCHY " << filename << std::endl;
+            return;
+        }
+        bone_list = hierarchy.bones;
+        for (size_t j = 0; j < bone_list.size(); ++j) {
+            bone_ids_.push_back(NameTable::instance().intern(bone_list[j]));
+            positions.emplace_back(1, hierarchy.offsets[j] * static_cast<float>(SCALE)); // blender coordinates
+            rotations.emplace_back();
+        }
+        bone_hash_ = PerfectNameHash(bone_ids_);
+        std::string help_string;
+        bvh_file >> help_string >> num_frames_;
+        if (!bvh_file || help_string != "Frames:" || num_frames_ <= 0) {
+            std::cout << "ERROR::MOTION_CAPTURE::INVALID_MOTION " << filename << std::endl;
+            num_frames_ = 0;
+            return;
+        }
+        std::cout << "Frames: " << num_frames_ << "\n";
+        bvh_file >> help_string >> help_string >> frame_time;
+        if (!bvh_file || help_string != "Time:" || !(frame_time > 0.0)) {
+            std::cout << "ERROR::MOTION_CAPTURE::INVALID_MOTION " << filename << std::endl;
+            num_frames_ = 0;
+            return;
         }
-        if (total_weight != 0) {
-            for (int i = 0; i < MAX_BONES; ++i) {
-                weights[i] /= total_weight;
+        std::cout << "Frame time: " << frame_time << "\n";
+        std::vector<float> channels(bvhChannelCount(bone_list.size()));
+        std::vector<glm::quat> frame_rotations(bone_list.size());
+        for (int i = 0; i < num_frames_; ++i) {
+            for (float& channel : channels) {
+                bvh_file >> channel;
+            }
+            if (!bvh_file) {
+                std::cout << "ERROR::MOTION_CAPTURE::TRUNCATED_MOTION " << filename << ", " << i << " of "
+                          << num_frames_ << " frames" << std::endl;
+                num_frames_ = 0;
+                return;
+            }
+            glm::vec3 root_position;
+            decodeBvhFrame(channels.data(), bone_list.size(), static_cast<float>(SCALE), root_position,
+                           frame_rotations.data());
+            if (i == 0) {
+                positions[0][0] = root_position;
+            } else {
+                positions[0].push_back(root_position);
+            }
+            for (size_t j = 0; j < bone_list.size(); ++j) {
+                rotations[j].push_back(frame_rotations[j]);
             }
         }
+
+        bvh_file.close();
     }
+
+    double SCALE = 0.028;
+    std::vector<std::string> bone_list;
+    // Indexed like bone_list.
+    std::vector<std::vector<glm::vec3>> positions;
+    std::vector<std::vector<glm::quat>> rotations;
+    std::vector<NameId> bone_ids_;
+    PerfectNameHash bone_hash_; // Name to index in bone_list
+    double frame_time = 0.0;
+    int num_frames_ = 0;
+    std::unique_ptr<CompressedClip> compressed_;
+    std::unique_ptr<IndexedBvhFile> indexed_; // Decodes into its window while sampled
+    std::unique_ptr<MappedMocapFile> mapped_;  // Read in place while sampled
 };
 
 class BonesAttributes : public VertexAttributes {
 public:
     BonesAttributes(const std::vector<VertexBoneAttribute>& vertex_bones) :
-            vertex_bones_(vertex_bones) {};
+            vertex_bones_(vertex_bones), num_vertices_(vertex_bones_.size()) {};
 
     BonesAttributes(std::vector<VertexBoneAttribute>&& vertex_bones) :
-            vertex_bones_(std::move(vertex_bones)) {};
+            vertex_bones_(std::move(vertex_bones)), num_vertices_(vertex_bones_.size()) {};
 
     void initAttributes() override {
         glGenBuffers(1, &VBO);
@@ -243,137 +432,315 @@ public:
         glDeleteBuffers(1, &VBO);
     }
 
+    size_t numVertices() const override {
+        return num_vertices_;
+    }
+
+    size_t bufferBytes() const override {
+        return num_vertices_ * sizeof(VertexBoneAttribute);
+    }
+
+    void releaseData() override {
+        std::vector<VertexBoneAttribute>().swap(vertex_bones_);
+    }
+
+    void readBack() override {
+        readBufferData(VBO, vertex_bones_, num_vertices_);
+    }
+
 private:
     std::vector<VertexBoneAttribute> vertex_bones_;
+    size_t num_vertices_;
     unsigned int VBO;
 };
 
-struct AnimationBoneKeyframe {
-    glm::vec3 position;
-    glm::quat rotation;
-
-    double time;
-};
-
 struct Bone {
     // Todo: support different offsets for different meshes.
     std::string name;
+    NameId name_id;
     glm::mat4 offset; // From world space to node space in initial position.
     glm::mat4 global_transform; // From node space to world space in current position in animation.
     glm::mat4 default_tranform; // Default node transform.
-    glm::mat4 rotation_fix; // For motion capture rotations
+    glm::quat rotation_fix; // From motion capture space to bone space
 
     void init() {
-        glm::vec3 shift(offset * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
-        glm::mat4 base = glm::mat4(glm::mat3(offset));
-//        std::cout << glm::to_string(offset) << "\n";
-//        std::cout << glm::to_string(base) << "\n";
-//        std::cout << glm::to_string(shift) << "\n";
-        shift = glm::mat3(glm::inverse(base)) * shift;
-        glm::mat4 straight_offset = glm::translate(shift);
-//        std::cout << glm::to_string(offset * glm::inverse(straight_offset)) << "\n";
-//        glm::mat4 rotation;
-        rotation_fix = offset * glm::inverse(straight_offset);
-        //rotation_fix * rotation * glm::inverse(rotation_fix)
-    }
-
-    void updateGlobalTransform(glm::mat4 parent_transform, double time) {
-        if (keyframes_.size() == 0) {
-            global_transform = parent_transform * default_tranform;
-            return;
-        }
-        double animation_start = keyframes_[0].time;
-        double animation_length = keyframes_.back().time - animation_start;
-        double animation_time = fmod(time, animation_length) + animation_start;
-        while (animation_time < keyframes_[current_keyframe_].time ||
-               animation_time >= keyframes_[current_keyframe_ + 1].time) {
-            current_keyframe_ += 1;
-            if (current_keyframe_ == keyframes_.size() - 1) {
-                current_keyframe_ = 0;
-            }
-        }
-        const AnimationBoneKeyframe& previous_keyframe = keyframes_[current_keyframe_];
-        const AnimationBoneKeyframe& next_keyframe = keyframes_[current_keyframe_ + 1];
-        float mix_ratio = static_cast<float>((animation_time - previous_keyframe.time) /
-                                             (next_keyframe.time - previous_keyframe.time));
+        // Offset without its translation and scale. Conjugating a captured rotation with it rotates around the
+        // bone axes instead.
+        glm::mat3 base(offset);
+        rotation_fix = glm::quat_cast(glm::mat3(glm::normalize(base[0]), glm::normalize(base[1]),
+                                                glm::normalize(base[2])));
+    }
 
-        glm::vec3 position = (1 - mix_ratio) * previous_keyframe.position + mix_ratio * next_keyframe.position;
-        glm::quat rotation = glm::slerp(previous_keyframe.rotation, next_keyframe.rotation, mix_ratio);
-        global_transform =
-                parent_transform * glm::translate(glm::mat4(1.0), position) * glm::mat4_cast(rotation);
+    void updateGlobalTransform(const glm::mat4& parent_transform, const BoneTransform& local_transform) {
+        global_transform = parent_transform * glm::translate(glm::mat4(1.0), local_transform.position) *
+                           glm::mat4_cast(local_transform.rotation);
     }
+};
 
-    void updateGlobalTranformFromMotionCapture(glm::mat4 parent_transform, double time, MotionCaptureData* data) {
-        glm::vec3 position = keyframes_[0].position;// data->get_position(name, time);
-        glm::mat4 rotation;
-        if (false) {//name != "hip" && name != "lThigh" && name != "lShin") {
-            rotation = glm::mat4_cast(keyframes_[0].rotation);
-        } else {
-            rotation =  rotation_fix * glm::mat4_cast(data->get_rotation(name, time)) * glm::inverse(rotation_fix);
+// Motion capture skeleton bound to the bones of a model. Built once, after which converting a capture sample to
+// a bone transform is an index lookup and two quaternion products.
+struct MotionCaptureRetarget {
+    std::vector<int> capture_bones;        // Capture bone per model bone, -1 if the bone is not captured
+    std::vector<glm::quat> rotation_fixes; // Bone::rotation_fix per model bone
+
+    glm::quat retarget(size_t bone, const glm::quat& capture_rotation) const {
+        const glm::quat& fix = rotation_fixes[bone];
+        return fix * capture_rotation * glm::conjugate(fix);
+    }
+};
+
+// Samples the capture, a MotionCaptureData or a MotionStream, into the pose. Bones keep their bind position,
+// uncaptured ones their whole bind pose. With a bone list only those bones are sampled.
+template<typename Capture>
+void retargetPose(const Capture& data, const MotionCaptureRetarget& retarget, double time,
+                  const std::vector<BoneTransform>& bind_pose, std::vector<BoneTransform>& pose,
+                  const std::vector<int>* bones = nullptr) {
+    pose.resize(bind_pose.size());
+    size_t num_bones = bones ? bones->size() : bind_pose.size();
+    for (size_t index = 0; index < num_bones; ++index) {
+        size_t bone = bones ? (*bones)[index] : index;
+        pose[bone] = bind_pose[bone];
+        int capture_bone = retarget.capture_bones[bone];
+        if (capture_bone >= 0) {
+            pose[bone].rotation = retarget.retarget(bone, data.sampleRotation(capture_bone, time));
         }
-        global_transform =
-                parent_transform * glm::translate(glm::mat4(1.0), position) * rotation;
     }
+}
 
-    void addKeyframe(const AnimationBoneKeyframe& keyframe) {
-        keyframes_.push_back(keyframe);
+// Skeleton hierarchy flattened so that parents always come before their children.
+struct SkeletonJoint {
+    int bone_index;           // BONE_NOT_FOUND for nodes without a bone
+    int parent;               // Index of the parent joint, -1 for the root
+    glm::mat4 node_transform; // For non-bone skeleton nodes
+};
+
+// Bones evaluated on one skeleton level of detail. Dropped bones are leaves (after the leaves below them were
+// dropped), their vertices move with the closest kept ancestor.
+struct SkeletonTier {
+    std::vector<int> bones;         // Kept bones, ascending. The palette of the tier has one matrix per kept bone
+    std::vector<int> joints;        // Joints to walk, in hierarchy order
+    std::vector<int> palette_index; // Per bone, its palette entry or the one of the ancestor it moves with
+};
+
+// Bounds of the vertices a bone moves, in bone space.
+struct BoneBounds {
+    int bone;
+    AABB bounds;
+};
+
+// Clip playing on a model. Later playbacks are layered over earlier ones.
+struct ClipPlayback {
+    int clip;
+    double start_time;
+    float speed;
+    float weight;
+    double fade_duration;         // Weight ramps up from 0 over this time after start_time
+    std::vector<float> bone_mask; // Empty for full body
+};
+
+// What one instance of a model plays. The instance keeps it, e.g. in the AnimationState of a scene entity, and
+// starts things on it through the play functions of the model, so instances of one model play clips, fades and
+// layers of their own.
+struct AnimationPlayback {
+    std::vector<ClipPlayback> clips;
+    const MotionStream* motion_stream = nullptr; // Played instead of the capture data if set
+    MotionCaptureRetarget stream_retarget;      // Of motion_stream
+    double motion_capture_start_time = 0.0;
+    bool motion_capture_playing = false;
+
+    // False while a live stream plays, which can take the model anywhere, so the instance has to be posed to be
+    // bounded even when hidden.
+    bool motionBounded() const {
+        return !(motion_capture_playing && motion_stream);
     }
+};
 
-private:
-    std::vector<AnimationBoneKeyframe> keyframes_;
-    unsigned int current_keyframe_; // Last rendered keyframe for quick lookup.
+enum class SkinningMode {
+    GPU, // In skeleton_shader.vert
+    CPU  // In skinning.h, meshes have to be drawn with a non-skinning shader like cube_shader.vert
 };
 
-struct SkeletonNode {
-    int bone_index;
-    glm::mat4 node_transform; // For non-bone skeleton nodes
-    std::vector<std::unique_ptr<SkeletonNode>> children;
+struct ModelSettings {
+    SkinningMode skinning_mode = SkinningMode::GPU;
+    // Clips are streamed from a temporary cache file per model, see ClipLibrary.
+    size_t clip_memory_budget = 32 << 20;
+    double clip_chunk_duration = 2.0; // In clip time units
+    std::string clip_cache_directory;  // Empty for $TMPDIR or /tmp
+    bool compress_clips = false;
+    CompressionSettings clip_compression;
+    // Levels of detail per mesh including the full one, each with about lod_reduction times the triangles of the
+    // one before. Level 1 is used below lod_screen_size (bounds height over viewport height), every further level
+    // at half the size of the one before.
+    int lod_levels = 4;
+    float lod_reduction = 0.5f;
+    float lod_screen_size = 0.5f;
+    float lod_hysteresis = 0.15f; // Relative size change past a threshold before switching back and forth
+    // Animation level of detail, the pose is updated every 2^level frames. Level 1 is used below
+    // animation_lod_screen_size, with the same halving and hysteresis as the mesh levels.
+    int animation_lod_levels = 4;
+    float animation_lod_screen_size = 0.25f;
+    // Skeleton level n, drawn with mesh level n, drops leaf bones whose vertices span less than
+    // skeleton_lod_leaf_size * 2^(n - 1) of the model size.
+    float skeleton_lod_leaf_size = 0.04f;
+    // Keeps vertex and index data in memory after upload, for CPU side consumers like picking. CPU skinning keeps
+    // its vertices either way.
+    bool keep_cpu_geometry = false;
+    // Triangles per mesh of the occluder drawn for occlusion culling, about. 0 imports none.
+    size_t occluder_triangles = 64;
+};
+
+// What debugPrintout() shows of the imported file, the Assimp scene itself is released after loading.
+struct SceneSummary {
+    struct Node {
+        std::string name;
+        int depth;
+        unsigned int num_children;
+        unsigned int num_meshes;
+    };
+
+    struct Material {
+        std::string name;
+        unsigned int num_diffuse_textures;
+        bool has_diffuse_texture;
+        std::string diffuse_texture;
+        bool has_diffuse_color;
+        glm::vec3 diffuse_color;
+        std::vector<std::string> property_keys;
+    };
+
+    std::vector<Node> nodes; // Depth first
+    std::vector<Material> materials;
+};
+
+// Level for something covering screen_size of the viewport height: 0 down to first_threshold and one more for
+// every halving below it, up to num_levels - 1. Leaving current_level takes a size past the threshold by the
+// hysteresis, so that sizes near a threshold don't flicker between two levels.
+size_t selectScreenSizeLevel(float screen_size, size_t current_level, size_t num_levels, float first_threshold,
+                             float hysteresis) {
+    auto level_for = [&](float size) {
+        size_t level = 0;
+        for (float threshold = first_threshold; level + 1 < num_levels && size < threshold; threshold *= 0.5f) {
+            ++level;
+        }
+        return level;
+    };
+    size_t coarser = level_for(screen_size * (1.0f + hysteresis));
+    size_t finer = level_for(screen_size * (1.0f - hysteresis));
+    if (coarser > current_level) {
+        return coarser;
+    }
+    return std::min(finer, current_level);
+}
+
+// When the constructor creates buffers and textures. Deferred models are imported without a GL context, e.g. on a
+// loader thread, and uploaded by uploadMeshes() on the thread that owns it.
+enum class GpuUpload {
+    Immediate,
+    Deferred
+};
+
+// One mesh as imported, before it has buffers.
+struct MeshImport {
+    std::vector<SkinnedMeshLod> levels; // Level n for skeleton tier n, level 0 is the full mesh
+    bool has_texture = false;
+    std::string texture_path;
+    ImageData diffuse_image;
+    glm::vec3 diffuse_color;
+    std::vector<BoneBounds> bone_bounds;
+    AABB bounds;
+    OccluderMesh occluder;
 };
 
 class AnimatedModel {
     const int BONE_NOT_FOUND = -1;
 public:
-    AnimatedModel(const std::string& path, MotionCaptureData* motion_capture_data) {
-        loadModel(path);
+    AnimatedModel(const std::string& path, MotionCaptureData* motion_capture_data,
+                  const ModelSettings& settings = ModelSettings(), GpuUpload upload = GpuUpload::Immediate) :
+            clips_(new ClipLibrary(settings.clip_memory_budget, settings.clip_chunk_duration,
+                                   settings.compress_clips ? &settings.clip_compression : nullptr,
+                                   settings.clip_cache_directory)),
+            skinning_mode_(settings.skinning_mode), lod_screen_size_(settings.lod_screen_size),
+            lod_hysteresis_(settings.lod_hysteresis),
+            animation_lod_levels_(static_cast<size_t>(std::max(1, settings.animation_lod_levels))),
+            animation_lod_screen_size_(settings.animation_lod_screen_size),
+            cpu_retention_(settings.keep_cpu_geometry ? CpuRetention::Keep : CpuRetention::Release) {
+        loadModel(path, settings);
         motion_capture_data_ = motion_capture_data;
+        if (upload == GpuUpload::Immediate) {
+            uploadMeshes();
+        }
     }
 
-    bool walkNodes(const aiNode* node, int offset) {
-        if (true) {
-            for (int i = 0; i < offset; ++i) {
-                std::cout << "|";
+    // False if the file could not be imported.
+    bool valid() const {
+        return valid_;
+    }
+
+    // Creates buffers and textures for up to max_meshes imported meshes, needs the GL context. Returns true once
+    // every mesh is uploaded, the model can't be drawn before.
+    bool uploadMeshes(size_t max_meshes = SIZE_MAX) {
+        for (; max_meshes > 0 && meshes_.size() < pending_meshes_.size(); --max_meshes) {
+            MeshImport& mesh_import = pending_meshes_[meshes_.size()];
+            // Todo: import specular and shininess
+            Material* material = mesh_import.has_texture
+                                 ? new DiffuseMapMaterial(mesh_import.diffuse_image, mesh_import.texture_path,
+                                                          glm::vec3(1.0f, 1.0f, 1.0f), 32.0f)
+                                 : new DiffuseMapMaterial(mesh_import.diffuse_color, glm::vec3(1.0f, 1.0f, 1.0f), 32.0f);
+            cpu_skinned_attributes_.emplace_back();
+            for (size_t level = 0; level < mesh_import.levels.size(); ++level) {
+                SkinnedMeshLod& lod = mesh_import.levels[level];
+                std::vector<VertexAttributes*> attributes = createAttributes(std::move(lod.vertices),
+                                                                             std::move(lod.bones),
+                                                                             cpu_skinned_attributes_.back());
+                if (level == 0) {
+                    meshes_.emplace_back(new Mesh(attributes, lod.indices, material, cpu_retention_));
+                } else {
+                    meshes_.back()->addLod(attributes, lod.indices);
+                }
             }
-            std::cout << node->mName.data << " " << node->mNumChildren << " " << node->mNumMeshes << "\n";
-            // std::cout << glm::to_string(aiToGlmMatrix(node->mTransformation)) << "\n";
+            mesh_import = MeshImport();
         }
-        for (int i = 0; i < node->mNumChildren; ++i) {
-            walkNodes(node->mChildren[i], offset + 1);
+        if (meshes_.size() == pending_meshes_.size()) {
+            pending_meshes_.clear();
+            pending_meshes_.shrink_to_fit();
         }
-        return true;
+        return pending_meshes_.empty();
+    }
+
+    // For models imported before their capture.
+    void setMotionCaptureData(MotionCaptureData* motion_capture_data) {
+        motion_capture_data_ = motion_capture_data;
+        motion_capture_retarget_ = MotionCaptureRetarget();
     }
 
     void debugPrintout() {
-        walkNodes(scene->mRootNode, 0);
-
-        int mat_index = 0;
-        aiString testString;
-        scene->mMaterials[mat_index]->Get(AI_MATKEY_NAME, testString);
-        std::cout << testString.data << std::endl;
-        std::cout << scene->mMaterials[mat_index]->GetTextureCount(aiTextureType_DIFFUSE) << std::endl;
-        if (scene->mMaterials[mat_index]->Get(AI_MATKEY_TEXTURE(aiTextureType_DIFFUSE, 0), testString) == AI_SUCCESS)
-            std::cout << testString.data << std::endl;
-        else
-            std::cout << "FAIL" << std::endl;
-
-        aiColor3D testColor;
-        if (scene->mMaterials[mat_index]->Get(AI_MATKEY_COLOR_DIFFUSE, testColor) == AI_SUCCESS)
-            std::cout << testColor.r << " " << testColor.g << " " << testColor.b << std::endl;
-        else
-            std::cout << "FAIL" << std::endl;
+        for (const auto& node : scene_summary_.nodes) {
+            for (int i = 0; i < node.depth; ++i) {
+                std::cout << "|";
+            }
+            std::cout << node.name << " " << node.num_children << " " << node.num_meshes << "\n";
+        }
 
-        for (int i = 0; i < scene->mNumMaterials; ++i) {
-            for (int j = 0; j < scene->mMaterials[i]->mNumProperties; ++j) {
-                std::cout << i << ' ' << j << " " << scene->mMaterials[i]->mProperties[j]->mKey.data << "\n";
+        if (!scene_summary_.materials.empty()) {
+            const SceneSummary::Material& material = scene_summary_.materials[0];
+            std::cout << material.name << std::endl;
+            std::cout << material.num_diffuse_textures << std::endl;
+            if (material.has_diffuse_texture)
+                std::cout << material.diffuse_texture << std::endl;
+            else
+                std::cout << "FAIL" << std::endl;
+
+            if (material.has_diffuse_color)
+                std::cout << material.diffuse_color.x << " " << material.diffuse_color.y << " "
+                          << material.diffuse_color.z << std::endl;
+            else
+                std::cout << "FAIL" << std::endl;
+        }
+
+        for (size_t i = 0; i < scene_summary_.materials.size(); ++i) {
+            const std::vector<std::string>& keys = scene_summary_.materials[i].property_keys;
+            for (size_t j = 0; j < keys.size(); ++j) {
+                std::cout << i << ' ' << j << " " << keys[j] << "\n";
             }
         }
 
@@ -393,203 +760,963 @@ public:
         std::cout << blend_power << std::endl;*/
     }
 
-    void draw(ShaderProgram shader, double time) {
-        std::vector<glm::mat4> final_transforms(bones_.size());
-        calculateBoneTransforms(skeleton_.get(), time, final_transforms, glm::mat4(1.0f));
-        shader.setMat4v("jointTransforms", final_transforms);
+    // Once per frame, before the instances of the model are updated. Clip chunks acquired after it stay loaded
+    // until the next frame.
+    void beginFrame() {
+        clips_->beginFrame();
+    }
+
+    // Poses the skeleton of a level of detail in what the instance plays and updates the bounds. The palette only
+    // fits meshes drawn at the same level. Per frame data lives in the arena, which the caller resets once the frame
+    // is drawn.
+    void update(AnimationPlayback& playback, double time, FrameArena& arena, size_t lod = 0) {
+        const SkeletonTier& tier = skeleton_tiers_[std::min(lod, skeleton_tiers_.size() - 1)];
+        evaluatePose(playback, time, arena, tier);
+        final_transforms_ = calculateBoneTransforms(arena, tier);
+        updateBounds(tier);
+    }
+
+    // Draws the pose of the last update. Meshes with a 0 in the visibility mask are skipped, all are drawn without
+    // one.
+    void draw(const ShaderProgram& shader, const uint8_t* mesh_visibility = nullptr) {
+        draw(shader, palette(), mesh_visibility);
+    }
+
+    // Draws a pose kept from an earlier update at the level of detail it was posed at, so one model can be drawn
+    // in several poses per frame.
+    void draw(const ShaderProgram& shader, ArrayView<const glm::mat4> palette,
+              const uint8_t* mesh_visibility = nullptr, size_t lod = 0) {
+        if (skinning_mode_ == SkinningMode::GPU) {
+            shader.setMat4v("jointTransforms", palette);
+        }
+        for (size_t i = 0; i < meshes_.size(); ++i) {
+            if (mesh_visibility && !mesh_visibility[i]) {
+                continue;
+            }
+            if (skinning_mode_ == SkinningMode::CPU) {
+                const std::vector<CpuSkinnedAttributes*>& levels = cpu_skinned_attributes_[i];
+                meshes_[i]->makeResident(lod);
+                levels[std::min(lod, levels.size() - 1)]->update(palette.data());
+            }
+            meshes_[i]->draw(shader, lod);
+        }
+    }
+
+    // Skins every mesh at a level of detail into the buffers of an instance with transform feedback. The shader is
+    // skin_feedback.vert, rasterizer discard has to be enabled. Only for SkinningMode::GPU.
+    void skin(const ShaderProgram& feedback_shader, ArrayView<const glm::mat4> palette, size_t lod,
+              SkinnedVertexBuffers& buffers, const uint8_t* mesh_visibility = nullptr) {
+        feedback_shader.setMat4v("jointTransforms", palette);
+        for (size_t i = 0; i < meshes_.size(); ++i) {
+            if (mesh_visibility && !mesh_visibility[i]) {
+                continue;
+            }
+            buffers.reserve(i, meshes_[i]->numVertices(0));
+            glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, buffers.vertexBuffer(i));
+            glBeginTransformFeedback(GL_POINTS);
+            meshes_[i]->drawPoints(lod);
+            glEndTransformFeedback();
+            // After drawPoints, which restores the level if it was evicted.
+            buffers.setIndexBuffer(i, meshes_[i]->indexBuffer(lod));
+        }
+        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    }
+
+    // Draws an instance skinned by skin() in this frame, with a shader that does no skinning. The visibility mask
+    // has to hide no mesh that skin() skipped.
+    void drawSkinned(const ShaderProgram& shader, const SkinnedVertexBuffers& buffers, size_t lod,
+                     const uint8_t* mesh_visibility = nullptr) {
+        for (size_t i = 0; i < meshes_.size(); ++i) {
+            if (mesh_visibility && !mesh_visibility[i]) {
+                continue;
+            }
+            meshes_[i]->draw(shader, lod, buffers.vertexArray(i));
+        }
+    }
+
+    // Depth only draw(), with depth_skeleton.vert for SkinningMode::GPU and depth_static.vert otherwise. CPU skinned
+    // meshes are drawn as skinned by the last draw().
+    void drawDepth(const ShaderProgram& depth_shader, ArrayView<const glm::mat4> palette, size_t lod,
+                   const uint8_t* mesh_visibility = nullptr) {
+        if (skinning_mode_ == SkinningMode::GPU) {
+            depth_shader.setMat4v("jointTransforms", palette);
+        }
+        for (size_t i = 0; i < meshes_.size(); ++i) {
+            if (mesh_visibility && !mesh_visibility[i]) {
+                continue;
+            }
+            meshes_[i]->drawDepth(lod);
+        }
+    }
+
+    // Depth only drawSkinned(), with depth_static.vert.
+    void drawSkinnedDepth(const SkinnedVertexBuffers& buffers, size_t lod, const uint8_t* mesh_visibility = nullptr) {
+        for (size_t i = 0; i < meshes_.size(); ++i) {
+            if (mesh_visibility && !mesh_visibility[i]) {
+                continue;
+            }
+            meshes_[i]->drawDepth(lod, buffers.vertexArray(i));
+        }
+    }
+
+    SkinningMode skinningMode() const {
+        return skinning_mode_;
+    }
+
+    // Every mesh has this many levels, level n matches skeleton level n.
+    size_t numLods() const {
+        return skeleton_tiers_.size();
+    }
+
+    size_t numSkeletonBones(size_t lod) const {
+        return skeleton_tiers_[std::min(lod, skeleton_tiers_.size() - 1)].bones.size();
+    }
+
+    size_t numTriangles(size_t lod = 0) const {
+        size_t indices = 0;
+        for (const auto& mesh : meshes_) {
+            indices += mesh->numIndices(lod);
+        }
+        return indices / 3;
+    }
+
+    // Mesh level of detail for bounds covering screen_size of the viewport height.
+    size_t selectLod(float screen_size, size_t current_lod) const {
+        return selectScreenSizeLevel(screen_size, current_lod, numLods(), lod_screen_size_, lod_hysteresis_);
+    }
+
+    // Animation level of detail, instances on level n are posed every 2^n frames.
+    size_t selectAnimationLod(float screen_size, size_t current_lod) const {
+        return selectScreenSizeLevel(screen_size, current_lod, animation_lod_levels_, animation_lod_screen_size_,
+                                     lod_hysteresis_);
+    }
+
+    // Skinning matrices of the last update, valid until the frame arena is reset.
+    ArrayView<const glm::mat4> palette() const {
+        return final_transforms_;
+    }
+
+    size_t numMeshes() const {
+        return meshes_.size();
+    }
+
+    // Model space bounds of the posed model and of each mesh, as of the last update.
+    const AABB& bounds() const {
+        return bounds_;
+    }
+
+    ArrayView<const AABB> meshBounds() const {
+        return mesh_bounds_;
+    }
+
+    // Model space box around the bind pose and every pose of the clips and the capture the model can play, for
+    // instances that are not posed. Built when a clip is registered or the capture first played, by posing every
+    // key. Poses interpolated between keys can reach slightly past it.
+    const AABB& motionBounds() const {
+        return motion_bounds_;
+    }
+
+    // Simplified meshes in the bind pose, empty if the settings ask for none.
+    const OccluderMesh& occluder() const {
+        return occluder_;
+    }
+
+    // Occluder vertices in clip space, skinned with a palette of the given level like draw().
+    void transformOccluder(ArrayView<const glm::mat4> palette, size_t lod, const glm::mat4& model_view_projection,
+                           glm::vec4* clip_positions) const {
+        const SkeletonTier& tier = skeleton_tiers_[std::min(lod, skeleton_tiers_.size() - 1)];
+        for (size_t i = 0; i < occluder_.positions.size(); ++i) {
+            const VertexBoneAttribute& vertex_bones = occluder_.bones[i];
+            glm::vec4 position(occluder_.positions[i], 1.0f);
+            glm::vec4 skinned(0.0f);
+            for (int j = 0; j < 4; ++j) {
+                if (vertex_bones.weights[j] > 0.0f) {
+                    skinned += palette[tier.palette_index[vertex_bones.bones[j]]] * position * vertex_bones.weights[j];
+                }
+            }
+            clip_positions[i] = model_view_projection * skinned;
+        }
+    }
+
+    size_t numBones() const {
+        return bones_.size();
+    }
+
+    size_t numClips() const {
+        return clips_->size();
+    }
+
+    const std::string& clipName(int clip) const {
+        return clips_->name(clip);
+    }
+
+    double clipDuration(int clip) const {
+        return clips_->duration(clip);
+    }
+
+    // Returns -1 if the model has no clip with this name.
+    int findClip(const std::string& name) const {
+        return clips_->find(name);
+    }
+
+    // Stops everything else the instance plays and plays the clip in a loop from the given time on.
+    void play(AnimationPlayback& playback, int clip, double time, float speed = 1.0f) const {
+        playback.motion_capture_playing = false;
+        playback.clips.clear();
+        playback.clips.push_back({clip, time, speed, 1.0f, 0.0, {}});
+    }
 
-        for (const auto& mesh: meshes_) {
-            mesh->draw(shader);
+    // Fades the clip in over the current playbacks, which are dropped once the fade is over.
+    void crossFade(AnimationPlayback& playback, int clip, double time, double fade_duration,
+                   float speed = 1.0f) const {
+        playback.motion_capture_playing = false;
+        playback.clips.push_back({clip, time, speed, 1.0f, fade_duration, {}});
+    }
+
+    // Plays the clip over the current playbacks, only on the bones of the mask (see createBoneMask).
+    void playLayer(AnimationPlayback& playback, int clip, double time, const std::vector<float>& bone_mask,
+                   float weight = 1.0f, float speed = 1.0f) const {
+        playback.motion_capture_playing = false;
+        playback.clips.push_back({clip, time, speed, weight, 0.0, bone_mask});
+    }
+
+    // Mask covering the bone and all bones below it, e.g. the spine for upper body layers.
+    std::vector<float> createBoneMask(const std::string& root_bone_name) const {
+        std::vector<float> mask(bones_.size(), 0.0f);
+        std::vector<bool> in_subtree(joints_.size(), false);
+        for (size_t i = 0; i < joints_.size(); ++i) {
+            const SkeletonJoint& joint = joints_[i];
+            in_subtree[i] = (joint.bone_index != BONE_NOT_FOUND && bones_[joint.bone_index].name == root_bone_name) ||
+                            (joint.parent >= 0 && in_subtree[joint.parent]);
+            if (in_subtree[i] && joint.bone_index != BONE_NOT_FOUND) {
+                mask[joint.bone_index] = 1.0f;
+            }
         }
+        return mask;
+    }
+
+    // Matches capture bones to model bones by name.
+    template<typename Capture>
+    MotionCaptureRetarget bindMotionCapture(const Capture& data) const {
+        MotionCaptureRetarget retarget;
+        retarget.capture_bones.resize(bones_.size());
+        retarget.rotation_fixes.resize(bones_.size());
+        for (size_t i = 0; i < bones_.size(); ++i) {
+            retarget.capture_bones[i] = data.findBone(bones_[i].name_id);
+            retarget.rotation_fixes[i] = bones_[i].rotation_fix;
+        }
+        return retarget;
+    }
+
+    // Plays the capture given to the constructor, converting each sample on the fly. Any clip playback stops it.
+    // Bake the capture to blend it with other clips.
+    void playMotionCapture(AnimationPlayback& playback, double time) {
+        assert(motion_capture_data_);
+        if (motion_capture_retarget_.capture_bones.size() != bones_.size()) {
+            motion_capture_retarget_ = bindMotionCapture(*motion_capture_data_);
+        }
+        if (!motion_capture_bounded_) {
+            extendMotionBounds(*motion_capture_data_, motion_capture_retarget_);
+            motion_capture_bounded_ = true;
+        }
+        playback.motion_stream = nullptr;
+        playback.clips.clear();
+        playback.motion_capture_start_time = time;
+        playback.motion_capture_playing = true;
+    }
+
+    // Plays a live stream at the position of its last update(), converting each sample like playMotionCapture.
+    // Any clip playback or playMotionCapture stops it.
+    void playMotionStream(AnimationPlayback& playback, const MotionStream* stream) const {
+        playback.stream_retarget = bindMotionCapture(*stream);
+        playback.motion_stream = stream;
+        playback.clips.clear();
+        playback.motion_capture_playing = true;
+    }
+
+    // Converts the whole capture to a clip of the model, one keyframe per captured frame.
+    int bakeMotionCapture(const MotionCaptureData& data, const std::string& name = "motion_capture") {
+        MotionCaptureRetarget retarget = bindMotionCapture(data);
+        AnimationClip clip(name);
+        std::vector<std::vector<AnimationBoneKeyframe>> tracks(bones_.size());
+        for (size_t bone = 0; bone < bones_.size(); ++bone) {
+            if (retarget.capture_bones[bone] >= 0) {
+                tracks[bone].resize(data.numFrames());
+            }
+        }
+        // Frame by frame, so an indexed capture decodes each frame once.
+        for (int frame = 0; frame < data.numFrames(); ++frame) {
+            double time = frame * data.frameTime();
+            for (size_t bone = 0; bone < bones_.size(); ++bone) {
+                int capture_bone = retarget.capture_bones[bone];
+                if (capture_bone < 0) {
+                    continue;
+                }
+                AnimationBoneKeyframe& keyframe = tracks[bone][frame];
+                keyframe.position = bind_pose_[bone].position;
+                keyframe.rotation = retarget.retarget(bone, data.sampleRotation(capture_bone, time));
+                keyframe.time = time;
+            }
+        }
+        for (size_t bone = 0; bone < bones_.size(); ++bone) {
+            if (retarget.capture_bones[bone] >= 0) {
+                clip.addTrack(bone, tracks[bone]);
+            }
+        }
+        extendMotionBounds(clip);
+        return clips_->registerClip(clip);
+    }
+
+    const ClipLibraryStats& clipStats() const {
+        return clips_->stats();
+    }
+
+    // Ratio and error over all clips, empty unless ModelSettings::compress_clips is set.
+    const CompressionStats& clipCompressionStats() const {
+        return clips_->compressionStats();
+    }
+
+    // Posed vertices of a mesh level from the last draw call of that level. Only available with SkinningMode::CPU.
+    const std::vector<Vertex>& skinnedVertices(size_t mesh_index, size_t lod = 0) const {
+        return cpu_skinned_attributes_[mesh_index][lod]->skinnedVertices();
     }
 
 private:
-    void calculateBoneTransforms(SkeletonNode* node, double time, std::vector<glm::mat4>& final_tranforms,
-                                 glm::mat4 parent_transform) {
-        glm::mat4 next_parent_transform = parent_transform;
-        if (node->bone_index != BONE_NOT_FOUND) {
-            Bone& bone = bones_[node->bone_index];
-            bone.updateGlobalTransform(parent_transform, time);
-            // bone.updateGlobalTranformFromMotionCapture(parent_transform, time, motion_capture_data_);
-            final_tranforms[node->bone_index] = bone.global_transform * bone.offset;
-            next_parent_transform = bone.global_transform;
-        } else {
-            next_parent_transform = parent_transform * node->node_transform;
+
+    // Samples all clip playbacks, or the motion capture, into pose_ in one pass over the bones of the tier.
+    void evaluatePose(AnimationPlayback& state, double time, FrameArena& arena, const SkeletonTier& tier) {
+        if (state.motion_capture_playing && state.motion_stream) {
+            retargetPose(*state.motion_stream, state.stream_retarget, 0.0, bind_pose_, pose_, &tier.bones);
+            return;
+        }
+        if (state.motion_capture_playing) {
+            retargetPose(*motion_capture_data_, motion_capture_retarget_,
+                         std::max(0.0, time - state.motion_capture_start_time), bind_pose_, pose_, &tier.bones);
+            return;
+        }
+        // A finished fade fully covers the playbacks below it.
+        std::vector<ClipPlayback>& playbacks = state.clips;
+        for (size_t i = playbacks.size(); i-- > 1;) {
+            const ClipPlayback& playback = playbacks[i];
+            if (playback.bone_mask.empty() && playback.weight >= 1.0f &&
+                time - playback.start_time >= playback.fade_duration) {
+                playbacks.erase(playbacks.begin(), playbacks.begin() + i);
+                break;
+            }
         }
 
-        for (const auto& child : node->children) {
-            calculateBoneTransforms(child.get(), time, final_tranforms, next_parent_transform);
+        ArrayView<AnimationLayer> layers = arena.allocate<AnimationLayer>(playbacks.size());
+        for (size_t i = 0; i < playbacks.size(); ++i) {
+            const ClipPlayback& playback = playbacks[i];
+            double elapsed = std::max(0.0, time - playback.start_time);
+            double clip_time = clips_->loopTime(playback.clip, elapsed * playback.speed);
+            float weight = playback.weight;
+            if (playback.fade_duration > 0.0 && elapsed < playback.fade_duration) {
+                weight *= static_cast<float>(elapsed / playback.fade_duration);
+            }
+            layers[i] = {clips_->acquire(playback.clip, clip_time), clip_time, weight,
+                         playback.bone_mask.empty() ? nullptr : &playback.bone_mask};
         }
+        blendLayers(layers.data(), layers.size(), bind_pose_, pose_, &tier.bones);
     }
 
-    int getBoneId(const std::string& node_name, bool create_bone = true) {
-        // Armature name strip.
-        size_t pos = node_name.rfind("_");
-        std::string bone_name;
-        if (pos == std::string::npos) {
-            bone_name = node_name;
-        } else {
-            bone_name = node_name.substr(pos + 1, node_name.size() - pos - 1);
+    // The skinned vertices are weighted averages of their positions moved by each influencing bone, so they stay
+    // inside the union of the bone space boxes moved by their bones. Bones the tier drops are not posed, the boxes
+    // of their ancestors hold the vertices moved by them at that level.
+    void updateBounds(const SkeletonTier& tier) {
+        bounds_ = AABB();
+        for (size_t i = 0; i < mesh_bone_bounds_.size(); ++i) {
+            AABB mesh_bounds;
+            for (const auto& bone_bounds : mesh_bone_bounds_[i]) {
+                if (tier.bones[tier.palette_index[bone_bounds.bone]] != bone_bounds.bone) {
+                    continue;
+                }
+                mesh_bounds.extend(transformAABB(bone_bounds.bounds, bones_[bone_bounds.bone].global_transform));
+            }
+            mesh_bounds_[i] = mesh_bounds;
+            bounds_.extend(mesh_bounds);
         }
+        motion_bounds_.extend(bounds_);
+    }
 
-        auto it = bone_to_idx_.find(bone_name);
-        int bone_index;
-        if (it != bone_to_idx_.end()) {
-            bone_index = it->second;
-        } else {
-            if (create_bone) {
-                bone_index = bones_.size();
-                bone_to_idx_[bone_name] = bone_index;
-                bones_.emplace_back();
-                bones_.back().name = bone_name;
+    // Grows the motion bounds by the pose at every key of the clip, with the full skeleton. The pose and bounds of
+    // the last update are kept.
+    void extendMotionBounds(const AnimationClip& clip) {
+        std::vector<double> times = clip.keyTimes();
+        PoseScope scope(*this);
+        for (double time : times) {
+            AnimationLayer layer = {&clip, time, 1.0f, nullptr};
+            blendLayers(&layer, 1, bind_pose_, pose_, &skeleton_tiers_[0].bones);
+            boundPose(scope.arena);
+        }
+    }
+
+    // Same for every frame of a capture, retargeted like playMotionCapture does.
+    void extendMotionBounds(const MotionCaptureData& data, const MotionCaptureRetarget& retarget) {
+        PoseScope scope(*this);
+        for (int frame = 0; frame < data.numFrames(); ++frame) {
+            retargetPose(data, retarget, frame * data.frameTime(), bind_pose_, pose_, &skeleton_tiers_[0].bones);
+            boundPose(scope.arena);
+        }
+    }
+
+    // Keeps the state of the last update while extendMotionBounds poses the model.
+    struct PoseScope {
+        explicit PoseScope(AnimatedModel& model) :
+                model(model), arena(model.joints_.size() * sizeof(glm::mat4) * 2 + 4096), pose(model.pose_),
+                bounds(model.bounds_), mesh_bounds(model.mesh_bounds_) {}
+
+        ~PoseScope() {
+            model.pose_.swap(pose);
+            model.bounds_ = bounds;
+            model.mesh_bounds_.swap(mesh_bounds);
+        }
+
+        ScopedAllocationAllowance allowance; // Also runs when the capture is first played
+        AnimatedModel& model;
+        FrameArena arena;
+        std::vector<BoneTransform> pose;
+        AABB bounds;
+        std::vector<AABB> mesh_bounds;
+    };
+
+    void boundPose(FrameArena& arena) {
+        calculateBoneTransforms(arena, skeleton_tiers_[0]);
+        updateBounds(skeleton_tiers_[0]);
+        arena.reset();
+    }
+
+    // Walks the joints of the tier once, parents are always updated before their children. Returns the skinning
+    // matrix of every kept bone, in palette order.
+    ArrayView<glm::mat4> calculateBoneTransforms(FrameArena& arena, const SkeletonTier& tier) {
+        ArrayView<glm::mat4> joint_transforms = arena.allocate<glm::mat4>(joints_.size());
+        ArrayView<glm::mat4> final_transforms = arena.allocate<glm::mat4>(tier.bones.size());
+        const glm::mat4 identity(1.0f);
+        for (int i : tier.joints) {
+            const SkeletonJoint& joint = joints_[i];
+            const glm::mat4& parent_transform = joint.parent >= 0 ? joint_transforms[joint.parent] : identity;
+            if (joint.bone_index != BONE_NOT_FOUND) {
+                Bone& bone = bones_[joint.bone_index];
+                bone.updateGlobalTransform(parent_transform, pose_[joint.bone_index]);
+                final_transforms[tier.palette_index[joint.bone_index]] = bone.global_transform * bone.offset;
+                joint_transforms[i] = bone.global_transform;
             } else {
-                return BONE_NOT_FOUND;
+                joint_transforms[i] = parent_transform * joint.node_transform;
             }
         }
-        return bone_index;
+        return final_transforms;
+    }
+
+    // Node name without the armature prefix, e.g. "Armature_Spine" is "Spine". The node name is left as it is,
+    // the result points into it.
+    static const char* stripArmatureName(const aiString& node_name, size_t& length) {
+        const char* name = node_name.data;
+        for (size_t i = node_name.length; i-- > 0;) {
+            if (node_name.data[i] == '_') {
+                name = node_name.data + i + 1;
+                break;
+            }
+        }
+        length = node_name.data + node_name.length - name;
+        return name;
+    }
+
+    int getBoneId(const aiString& node_name) const {
+        size_t length;
+        const char* bone_name = stripArmatureName(node_name, length);
+        int bone_index = bone_hash_.find(bone_name, length);
+        return bone_index < 0 ? BONE_NOT_FOUND : bone_index;
+    }
+
+    // Creates a bone for every name referenced by mesh weights and animation channels and builds the hash all
+    // later lookups go through.
+    void collectBones() {
+        NameTable& names = NameTable::instance();
+        std::vector<NameId> bone_names;
+        std::unordered_set<NameId> seen;
+        auto add_bone = [&](const aiString& node_name) {
+            size_t length;
+            const char* bone_name = stripArmatureName(node_name, length);
+            NameId id = names.intern(bone_name, length);
+            if (seen.insert(id).second) {
+                bone_names.push_back(id);
+                bones_.emplace_back();
+                bones_.back().name = names.name(id);
+                bones_.back().name_id = id;
+            }
+        };
+        for (int mesh_index = 0; mesh_index < scene->mNumMeshes; ++mesh_index) {
+            const aiMesh* mesh = scene->mMeshes[mesh_index];
+            for (int i = 0; i < mesh->mNumBones; ++i) {
+                add_bone(mesh->mBones[i]->mName);
+            }
+        }
+        for (int animation_index = 0; animation_index < scene->mNumAnimations; ++animation_index) {
+            const aiAnimation* animation = scene->mAnimations[animation_index];
+            for (int i = 0; i < animation->mNumChannels; ++i) {
+                add_bone(animation->mChannels[i]->mNodeName);
+            }
+        }
+        bone_hash_ = PerfectNameHash(bone_names);
     }
 
     // Returns true if there are nodes correlating to bones in subtree.
-    bool buildSkeleton(const aiNode* ai_node, SkeletonNode* skeleton_node) {
-        int bone_id = getBoneId(ai_node->mName.data, false);
-        skeleton_node->bone_index = bone_id;
-        skeleton_node->node_transform = aiToGlmMatrix(ai_node->mTransformation);
-        int num_children = ai_node->mNumChildren;
+    bool buildSkeleton(const aiNode* ai_node, int parent) {
+        int bone_id = getBoneId(ai_node->mName);
+        int joint_index = static_cast<int>(joints_.size());
+        joints_.push_back({bone_id, parent, aiToGlmMatrix(ai_node->mTransformation)});
         bool bone_node = false;
         if (bone_id != BONE_NOT_FOUND) {
             bone_node = true;
-            bones_[bone_id].default_tranform = skeleton_node->node_transform;
+            bones_[bone_id].default_tranform = joints_[joint_index].node_transform;
         }
 
-        for (int i = 0; i < num_children; ++i) {
-            SkeletonNode* new_node = new SkeletonNode();
-            bool bones_in_subtree = buildSkeleton(ai_node->mChildren[i], new_node);
-            if (bones_in_subtree) {
-                skeleton_node->children.emplace_back(new_node);
+        for (int i = 0; i < ai_node->mNumChildren; ++i) {
+            if (buildSkeleton(ai_node->mChildren[i], joint_index)) {
                 bone_node = true;
-            } else {
-                delete new_node;
             }
         }
+        // Subtrees without bones have already removed themselves, so this node is the last one.
+        if (!bone_node) {
+            joints_.pop_back();
+        }
         return bone_node;
     }
 
-    void loadModel(const std::string& path) {
-//        Assimp::Importer importer;
-//        const aiScene*
-        scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_GenSmoothNormals |
-                                        aiProcess_FlipUVs);
-        if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) // if is Not Zero
-        {
-            std::cout << "ERROR::ASSIMP:: " << importer.GetErrorString() << std::endl;
-            return;
-        }
-        // Todo: remove
-        std::ofstream temp_file("temp.txt");
-        int num_bones = 0;
+    // Offsets come with the mesh weights. Bones without weights get theirs from the bind pose of a descendant, so
+    // that vertices of dropped bones can be moved to them.
+    void loadBoneOffsets() {
+        std::vector<bool> has_offset(bones_.size(), false);
         for (int mesh_index = 0; mesh_index < scene->mNumMeshes; ++mesh_index) {
             const aiMesh* mesh = scene->mMeshes[mesh_index];
-            int num_vertices = mesh->mNumVertices;
-
-            std::vector<Vertex> vertices(num_vertices);
-            std::vector<VertexBoneAttribute> bone_data(num_vertices);
-            std::vector<unsigned int> indices;
+            for (int i = 0; i < mesh->mNumBones; ++i) {
+                int bone_index = getBoneId(mesh->mBones[i]->mName);
+                // Todo: update to have different offsets for different meshes.
+                bones_[bone_index].offset = aiToGlmMatrix(mesh->mBones[i]->mOffsetMatrix);
+                has_offset[bone_index] = true;
+            }
+        }
+        // Offset of a joint, inverse bind transform times the mesh transform, is the node transform of a child
+        // times the offset of that child. Children come after their parents.
+        std::vector<glm::mat4> joint_offsets(joints_.size());
+        std::vector<bool> known(joints_.size(), false);
+        for (size_t i = joints_.size(); i-- > 0;) {
+            const SkeletonJoint& joint = joints_[i];
+            if (joint.bone_index != BONE_NOT_FOUND && has_offset[joint.bone_index]) {
+                joint_offsets[i] = bones_[joint.bone_index].offset;
+                known[i] = true;
+            } else if (joint.bone_index != BONE_NOT_FOUND && known[i]) {
+                bones_[joint.bone_index].offset = joint_offsets[i];
+                has_offset[joint.bone_index] = true;
+            }
+            if (known[i] && joint.parent >= 0 && !known[joint.parent]) {
+                joint_offsets[joint.parent] = joint.node_transform * joint_offsets[i];
+                known[joint.parent] = true;
+            }
+        }
+        for (size_t i = 0; i < bones_.size(); ++i) {
+            if (has_offset[i]) {
+                bones_[i].init();
+            }
+        }
+    }
 
-            if (!scene->mMeshes[mesh_index]->HasTextureCoords(0))
-                std::cout << "Mesh " << mesh_index << " has no texture coordinates" << std::endl;
+    // Tier 0 keeps every bone. Every further tier drops the leaf bones whose vertices, together with those of the
+    // bones dropped below them, span less than the tier's share of the model size.
+    void buildSkeletonTiers(size_t num_tiers, float leaf_size) {
+        std::vector<AABB> influence(bones_.size());
+        AABB model_bounds;
+        for (int mesh_index = 0; mesh_index < scene->mNumMeshes; ++mesh_index) {
+            const aiMesh* mesh = scene->mMeshes[mesh_index];
+            for (int i = 0; i < mesh->mNumBones; ++i) {
+                const aiBone* bone = mesh->mBones[i];
+                int bone_index = getBoneId(bone->mName);
+                for (int j = 0; j < bone->mNumWeights; ++j) {
+                    if (bone->mWeights[j].mWeight > 0.0f) {
+                        influence[bone_index].extend(aiToGlmVec3(mesh->mVertices[bone->mWeights[j].mVertexId]));
+                    }
+                }
+            }
+        }
+        for (const auto& box : influence) {
+            model_bounds.extend(box);
+        }
+        float model_size = model_bounds.empty() ? 0.0f : glm::length(model_bounds.max - model_bounds.min);
+
+        // Closest bone above each joint.
+        std::vector<int> parent_bone(joints_.size(), -1);
+        std::vector<int> kept_children(bones_.size(), 0);
+        for (size_t i = 0; i < joints_.size(); ++i) {
+            int parent = joints_[i].parent;
+            if (parent >= 0) {
+                parent_bone[i] = joints_[parent].bone_index != BONE_NOT_FOUND ? joints_[parent].bone_index
+                                                                              : parent_bone[parent];
+            }
+            if (joints_[i].bone_index != BONE_NOT_FOUND && parent_bone[i] >= 0) {
+                ++kept_children[parent_bone[i]];
+            }
+        }
 
-            for (int vertex_id = 0; vertex_id < num_vertices; ++vertex_id) {
-                vertices[vertex_id].position = aiToGlmVec3(mesh->mVertices[vertex_id]);
-                vertices[vertex_id].normal = aiToGlmVec3(mesh->mNormals[vertex_id]);
+        std::vector<bool> kept(bones_.size(), true);
+        skeleton_tiers_.assign(num_tiers, SkeletonTier());
+        for (size_t level = 0; level < num_tiers; ++level) {
+            if (level > 0) {
+                float threshold = model_size * leaf_size * static_cast<float>(1 << (level - 1));
+                // Children first, so a parent whose last child goes is considered in the same pass.
+                for (size_t i = joints_.size(); i-- > 0;) {
+                    int bone = joints_[i].bone_index;
+                    int parent = parent_bone[i];
+                    if (bone == BONE_NOT_FOUND || !kept[bone] || kept_children[bone] > 0 || parent < 0) {
+                        continue;
+                    }
+                    const AABB& box = influence[bone];
+                    if (!box.empty() && glm::length(box.max - box.min) >= threshold) {
+                        continue;
+                    }
+                    kept[bone] = false;
+                    influence[parent].extend(box);
+                    --kept_children[parent];
+                }
+            }
 
-                // Todo: Add support for multiple texture coordinates.
-                if (scene->mMeshes[mesh_index]->HasTextureCoords(0))
-                    vertices[vertex_id].tex_coords = aiToGlmVec2(mesh->mTextureCoords[0][vertex_id]);
+            SkeletonTier& tier = skeleton_tiers_[level];
+            tier.palette_index.assign(bones_.size(), -1);
+            for (size_t bone = 0; bone < bones_.size(); ++bone) {
+                if (kept[bone]) {
+                    tier.palette_index[bone] = static_cast<int>(tier.bones.size());
+                    tier.bones.push_back(static_cast<int>(bone));
+                }
             }
+            std::vector<bool> needed(joints_.size(), false);
+            for (size_t i = joints_.size(); i-- > 0;) {
+                int bone = joints_[i].bone_index;
+                needed[i] = needed[i] || (bone != BONE_NOT_FOUND && kept[bone]);
+                if (needed[i] && joints_[i].parent >= 0) {
+                    needed[joints_[i].parent] = true;
+                }
+            }
+            for (size_t i = 0; i < joints_.size(); ++i) {
+                int bone = joints_[i].bone_index;
+                if (needed[i]) {
+                    tier.joints.push_back(static_cast<int>(i));
+                }
+                if (bone != BONE_NOT_FOUND && !kept[bone]) {
+                    tier.palette_index[bone] = tier.palette_index[parent_bone[i]];
+                }
+            }
+        }
+    }
 
-            for (int face_id = 0; face_id < mesh->mNumFaces; ++face_id) {
-                if (mesh->mFaces[face_id].mNumIndices != 3) {
-                    std::cout << "Ignoring non-triangle face\n";
+    // Bone indices to palette entries of the tier, weights of dropped bones are added to their ancestor's.
+    static void remapBones(std::vector<VertexBoneAttribute>& vertex_bones, const SkeletonTier& tier) {
+        for (auto& vertex : vertex_bones) {
+            VertexBoneAttribute remapped;
+            remapped.bones = glm::ivec4(0);
+            remapped.weights = glm::vec4(0.0f);
+            int count = 0;
+            for (int j = 0; j < 4; ++j) {
+                if (vertex.weights[j] <= 0.0f) {
                     continue;
                 }
-                for (int i = 0; i < 3; ++i) {
-                    indices.push_back(mesh->mFaces[face_id].mIndices[i]);
+                int index = tier.palette_index[vertex.bones[j]];
+                int k = 0;
+                while (k < count && remapped.bones[k] != index) {
+                    ++k;
                 }
+                if (k == count) {
+                    remapped.bones[count++] = index;
+                }
+                remapped.weights[k] += vertex.weights[j];
             }
+            remapped.NormalizeWeights();
+            vertex = remapped;
+        }
+    }
 
-            // Load bones and bone weights for vertices.
-            int mesh_bones = mesh->mNumBones;
-            for (int i = 0; i < mesh_bones; ++i) {
-                const aiBone* bone = mesh->mBones[i];
-                int bone_index = getBoneId(bone->mName.data);
-                // Todo: update to have different offsets for different meshes.
-                bones_[bone_index].offset = aiToGlmMatrix(bone->mOffsetMatrix);
-                bones_[bone_index].init();
-                for (int j = 0; j < bone->mNumWeights; ++j) {
-                    int vertex_id = bone->mWeights[j].mVertexId;
-                    bone_data[vertex_id].AddBone(bone_index, bone->mWeights[j].mWeight);
-                }
+    // Converts a mesh, builds its levels of detail and decodes its texture. Only reads the model, so meshes can be
+    // imported in parallel.
+    MeshImport importMesh(int mesh_index, const std::string& dir, const ModelSettings& settings) const {
+        const aiMesh* mesh = scene->mMeshes[mesh_index];
+        MeshImport mesh_import;
+        int num_vertices = mesh->mNumVertices;
+
+        std::vector<Vertex> vertices(num_vertices);
+        std::vector<VertexBoneAttribute> bone_data(num_vertices);
+        std::vector<unsigned int> indices;
+
+        if (!mesh->HasTextureCoords(0))
+            std::cout << "Mesh " << mesh_index << " has no texture coordinates" << std::endl;
+
+        for (int vertex_id = 0; vertex_id < num_vertices; ++vertex_id) {
+            vertices[vertex_id].position = aiToGlmVec3(mesh->mVertices[vertex_id]);
+            vertices[vertex_id].normal = aiToGlmVec3(mesh->mNormals[vertex_id]);
+
+            // Todo: Add support for multiple texture coordinates.
+            if (mesh->HasTextureCoords(0))
+                vertices[vertex_id].tex_coords = aiToGlmVec2(mesh->mTextureCoords[0][vertex_id]);
+        }
+
+        for (int face_id = 0; face_id < mesh->mNumFaces; ++face_id) {
+            if (mesh->mFaces[face_id].mNumIndices != 3) {
+                std::cout << "Ignoring non-triangle face\n";
+                continue;
+            }
+            for (int i = 0; i < 3; ++i) {
+                indices.push_back(mesh->mFaces[face_id].mIndices[i]);
             }
+        }
 
-            // Normalize bone weights to sum up to 1
-            for (int i = 0; i < num_vertices; ++i) {
-                bone_data[i].NormalizeWeights();
+        // Load bones and bone weights for vertices.
+        int mesh_bones = mesh->mNumBones;
+        for (int i = 0; i < mesh_bones; ++i) {
+            const aiBone* bone = mesh->mBones[i];
+            int bone_index = getBoneId(bone->mName);
+            for (int j = 0; j < bone->mNumWeights; ++j) {
+                int vertex_id = bone->mWeights[j].mVertexId;
+                bone_data[vertex_id].AddBone(bone_index, bone->mWeights[j].mWeight);
             }
+        }
 
-            std::string dir = path.substr(0, path.rfind('/') + 1);
+        // Normalize bone weights to sum up to 1
+        for (int i = 0; i < num_vertices; ++i) {
+            bone_data[i].NormalizeWeights();
+        }
 
-            Material* material;
-            const aiMaterial* ai_material = scene->mMaterials[mesh->mMaterialIndex];
-            aiString texture_path;
-            if (ai_material->Get(AI_MATKEY_TEXTURE(aiTextureType_DIFFUSE, 0), texture_path) == AI_SUCCESS) {
-                // Todo: import specular and shininess
-                material = new DiffuseMapMaterial(dir + "textures/" + std::string(texture_path.data),
-                                                  glm::vec3(1.0f, 1.0f, 1.0f),
-                                                  32.0f);
+        // One level per skeleton tier. Meshes too small to simplify further repeat their last geometry with
+        // the weights of the tier.
+        std::vector<SkinnedMeshLod> lods = buildLodChain(vertices, bone_data, indices,
+                                                         static_cast<int>(skeleton_tiers_.size()),
+                                                         settings.lod_reduction);
+        std::vector<SkinnedMeshLod>& levels = mesh_import.levels;
+        levels.resize(skeleton_tiers_.size());
+        for (size_t level = 1; level < skeleton_tiers_.size(); ++level) {
+            if (lods.empty()) {
+                levels[level] = {vertices, bone_data, indices};
             } else {
-                aiColor4D ai_color;
-                ai_material->Get(AI_MATKEY_COLOR_DIFFUSE, ai_color);
-                glm::vec3 color = aiToGlmVec3(ai_color);
-                material = new DiffuseMapMaterial(color, glm::vec3(1.0f, 1.0f, 1.0f), 32.0f);
+                levels[level] = lods[std::min(level, lods.size()) - 1];
             }
+            remapBones(levels[level].bones, skeleton_tiers_[level]);
+        }
 
-            meshes_.emplace_back(new Mesh({new PositionalAttributes(std::move(vertices)),
-                                           new BonesAttributes(std::move(bone_data))},
-                                          indices,
-                                          material));
+        // Occluder simplified on from the coarsest level, which still has the bones of the full skeleton.
+        if (settings.occluder_triangles > 0) {
+            MeshSimplifier simplifier(lods.empty() ? vertices : lods.back().vertices,
+                                      lods.empty() ? bone_data : lods.back().bones,
+                                      lods.empty() ? indices : lods.back().indices);
+            simplifier.simplify(settings.occluder_triangles);
+            SkinnedMeshLod proxy = simplifier.extract();
+            std::vector<glm::vec3> normals;
+            for (const auto& vertex : proxy.vertices) {
+                mesh_import.occluder.positions.push_back(vertex.position);
+                normals.push_back(vertex.normal);
+            }
+            mesh_import.occluder.bones = std::move(proxy.bones);
+            mesh_import.occluder.indices = std::move(proxy.indices);
+            // Checked against the full mesh, the coarsest level may already stick out.
+            if (!shrinkOccluder(mesh_import.occluder, normals, vertices, indices)) {
+                std::cout << "Mesh " << mesh_index << " has no occluder, its proxy does not fit inside it\n";
+            }
+        }
+
+        // Bounds of the vertices each bone moves, in the space of the bone. Simplified levels blend the
+        // weights of collapsed vertices and dropped bones pass theirs to an ancestor, so the vertices of
+        // a level can be moved by more bones.
+        std::vector<AABB> bone_bounds(bones_.size());
+        auto add_bone_bounds = [&](const std::vector<Vertex>& lod_vertices,
+                                   const std::vector<VertexBoneAttribute>& lod_bones, const SkeletonTier& tier) {
+            for (size_t i = 0; i < lod_vertices.size(); ++i) {
+                for (int j = 0; j < 4; ++j) {
+                    if (lod_bones[i].weights[j] > 0.0f) {
+                        int bone = tier.bones[lod_bones[i].bones[j]];
+                        glm::vec4 position(lod_vertices[i].position, 1.0f);
+                        bone_bounds[bone].extend(glm::vec3(bones_[bone].offset * position));
+                    }
+                }
+            }
+        };
+        add_bone_bounds(vertices, bone_data, skeleton_tiers_[0]);
+        for (const auto& vertex : vertices) {
+            mesh_import.bounds.extend(vertex.position);
+        }
+        for (size_t level = 1; level < skeleton_tiers_.size(); ++level) {
+            add_bone_bounds(levels[level].vertices, levels[level].bones, skeleton_tiers_[level]);
+        }
+        for (size_t bone = 0; bone < bone_bounds.size(); ++bone) {
+            if (!bone_bounds[bone].empty()) {
+                mesh_import.bone_bounds.push_back({static_cast<int>(bone), bone_bounds[bone]});
+            }
+        }
+        levels[0] = {std::move(vertices), std::move(bone_data), std::move(indices)};
+
+        const aiMaterial* ai_material = scene->mMaterials[mesh->mMaterialIndex];
+        aiString texture_path;
+        if (ai_material->Get(AI_MATKEY_TEXTURE(aiTextureType_DIFFUSE, 0), texture_path) == AI_SUCCESS) {
+            mesh_import.has_texture = true;
+            mesh_import.texture_path = dir + "textures/" + std::string(texture_path.data);
+            mesh_import.diffuse_image = decodeImage(mesh_import.texture_path);
+        } else {
+            aiColor4D ai_color;
+            ai_material->Get(AI_MATKEY_COLOR_DIFFUSE, ai_color);
+            mesh_import.diffuse_color = aiToGlmVec3(ai_color);
+        }
+        return mesh_import;
+    }
+
+    // Mesh vertex and bone buffers, for CPU or GPU skinning.
+    std::vector<VertexAttributes*> createAttributes(std::vector<Vertex>&& vertices,
+                                                    std::vector<VertexBoneAttribute>&& bone_data,
+                                                    std::vector<CpuSkinnedAttributes*>& cpu_levels) {
+        if (skinning_mode_ == SkinningMode::CPU) {
+            CpuSkinnedAttributes* skinned_attributes = new CpuSkinnedAttributes(std::move(vertices),
+                                                                                std::move(bone_data));
+            cpu_levels.push_back(skinned_attributes);
+            return {skinned_attributes};
+        }
+        return {new PositionalAttributes(vertices), new BonesAttributes(std::move(bone_data))};
+    }
+
+    void loadModel(const std::string& path, const ModelSettings& settings) {
+//        Assimp::Importer importer;
+//        const aiScene*
+        scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_GenSmoothNormals |
+                                        aiProcess_FlipUVs);
+        if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) // if is Not Zero
+        {
+            std::cout << "ERROR::ASSIMP:: " << importer.GetErrorString() << std::endl;
+            scene = nullptr;
+            return;
+        }
+        collectBones();
+        bool has_bones = buildSkeleton(scene->mRootNode, -1);
+        assert(has_bones && "No bone structure information found");
+        loadBoneOffsets();
+        buildSkeletonTiers(static_cast<size_t>(std::max(1, settings.lod_levels)), settings.skeleton_lod_leaf_size);
+        // Todo: remove
+        std::ofstream temp_file("temp.txt");
+        // Meshes are converted and simplified in parallel, uploading them is left to uploadMeshes().
+        std::string dir = path.substr(0, path.rfind('/') + 1);
+        pending_meshes_.resize(scene->mNumMeshes);
+        ThreadPool::instance().parallelFor(scene->mNumMeshes, 1, [&](size_t begin, size_t end) {
+            for (size_t mesh_index = begin; mesh_index < end; ++mesh_index) {
+                pending_meshes_[mesh_index] = importMesh(static_cast<int>(mesh_index), dir, settings);
+            }
+        });
+        for (auto& mesh_import : pending_meshes_) {
+            motion_bounds_.extend(mesh_import.bounds);
+            mesh_bone_bounds_.push_back(std::move(mesh_import.bone_bounds));
+            mesh_bounds_.emplace_back();
+            occluder_.append(mesh_import.occluder);
+            mesh_import.occluder = OccluderMesh();
         }
 
 
         global_inverse_transform_ = glm::inverse(aiToGlmMatrix(scene->mRootNode->mTransformation));
 
-        // Todo: support several animations.
-        const aiAnimation* animation = scene->mAnimations[0];
-        for (int i = 0; i < animation->mNumChannels; ++i) {
-            const aiNodeAnim* channel = animation->mChannels[i];
-            int bone_id = getBoneId(channel->mNodeName.data);
-            assert(bone_id != BONE_NOT_FOUND);
-            assert(channel->mNumPositionKeys == channel->mNumRotationKeys);
-            for (int j = 0; j < channel->mNumPositionKeys; ++j) {
-                bones_[bone_id].addKeyframe({aiToGlmVec3(channel->mPositionKeys[j].mValue),
-                                             aiToGlmQuat(channel->mRotationKeys[j].mValue),
-                                             channel->mPositionKeys[j].mTime});
+        bind_pose_.resize(bones_.size());
+        for (size_t i = 0; i < bones_.size(); ++i) {
+            const glm::mat4& transform = bones_[i].default_tranform;
+            bind_pose_[i].position = glm::vec3(transform[3]);
+            bind_pose_[i].rotation = glm::quat_cast(glm::mat3(glm::normalize(glm::vec3(transform[0])),
+                                                              glm::normalize(glm::vec3(transform[1])),
+                                                              glm::normalize(glm::vec3(transform[2]))));
+        }
+        pose_ = bind_pose_;
+
+        std::vector<AnimationBoneKeyframe> keyframes;
+        for (int animation_index = 0; animation_index < scene->mNumAnimations; ++animation_index) {
+            const aiAnimation* animation = scene->mAnimations[animation_index];
+            std::string name = animation->mName.length > 0 ? animation->mName.data
+                                                            : "animation_" + std::to_string(animation_index);
+            AnimationClip clip(name);
+            for (int i = 0; i < animation->mNumChannels; ++i) {
+                const aiNodeAnim* channel = animation->mChannels[i];
+                int bone_id = getBoneId(channel->mNodeName);
+                assert(bone_id != BONE_NOT_FOUND);
+                assert(channel->mNumPositionKeys == channel->mNumRotationKeys);
+                keyframes.clear();
+                for (int j = 0; j < channel->mNumPositionKeys; ++j) {
+                    keyframes.push_back({aiToGlmVec3(channel->mPositionKeys[j].mValue),
+                                         aiToGlmQuat(channel->mRotationKeys[j].mValue),
+                                         channel->mPositionKeys[j].mTime});
+                }
+                clip.addTrack(bone_id, keyframes);
             }
+            // Only one clip is fully in memory at a time.
+            extendMotionBounds(clip);
+            clips_->registerClip(clip);
         }
         // Todo: remove
         temp_file.close();
-        skeleton_.reset(new SkeletonNode);
-        assert(buildSkeleton(scene->mRootNode, skeleton_.get()) && "No bone structure information found");
+
+        summarizeScene();
+        valid_ = true;
+        importer.FreeScene();
+        scene = nullptr;
+    }
+
+    void summarizeNodes(const aiNode* node, int depth) {
+        scene_summary_.nodes.push_back({node->mName.data, depth, node->mNumChildren, node->mNumMeshes});
+        for (int i = 0; i < node->mNumChildren; ++i) {
+            summarizeNodes(node->mChildren[i], depth + 1);
+        }
+    }
+
+    // Copies what debugPrintout() needs, so that the scene can be released.
+    void summarizeScene() {
+        summarizeNodes(scene->mRootNode, 0);
+        for (int i = 0; i < scene->mNumMaterials; ++i) {
+            const aiMaterial* ai_material = scene->mMaterials[i];
+            SceneSummary::Material material;
+            aiString string;
+            ai_material->Get(AI_MATKEY_NAME, string);
+            material.name = string.data;
+            material.num_diffuse_textures = ai_material->GetTextureCount(aiTextureType_DIFFUSE);
+            material.has_diffuse_texture =
+                    ai_material->Get(AI_MATKEY_TEXTURE(aiTextureType_DIFFUSE, 0), string) == AI_SUCCESS;
+            if (material.has_diffuse_texture) {
+                material.diffuse_texture = string.data;
+            }
+            aiColor3D color;
+            material.has_diffuse_color = ai_material->Get(AI_MATKEY_COLOR_DIFFUSE, color) == AI_SUCCESS;
+            material.diffuse_color = glm::vec3(color.r, color.g, color.b);
+            for (int j = 0; j < ai_material->mNumProperties; ++j) {
+                material.property_keys.push_back(ai_material->mProperties[j]->mKey.data);
+            }
+            scene_summary_.materials.push_back(std::move(material));
+        }
     }
 
 
     std::vector<std::unique_ptr<Mesh>> meshes_;
     glm::mat4 global_inverse_transform_;
-    std::unordered_map<std::string, int> bone_to_idx_;
+    PerfectNameHash bone_hash_; // Bone name to index in bones_
     std::vector<Bone> bones_;
-    std::unique_ptr<SkeletonNode> skeleton_;
+    std::vector<SkeletonJoint> joints_;
+    std::vector<SkeletonTier> skeleton_tiers_; // Skeleton levels of detail, tier 0 has every bone
+    std::unique_ptr<ClipLibrary> clips_;
+    std::vector<BoneTransform> bind_pose_;
+    std::vector<BoneTransform> pose_; // Kept between frames to avoid allocations
+    ArrayView<glm::mat4> final_transforms_; // In the frame arena, valid from update until the arena is reset
+    std::vector<std::vector<BoneBounds>> mesh_bone_bounds_; // Per mesh, only for bones that move its vertices
+    std::vector<AABB> mesh_bounds_;
+    OccluderMesh occluder_;
+    AABB bounds_;
+    AABB motion_bounds_;
+    bool motion_capture_bounded_ = false; // The capture of the constructor is part of motion_bounds_
     MotionCaptureData* motion_capture_data_;
-
-    // Todo: move back into init function. Exposed for testing purposes
+    MotionCaptureRetarget motion_capture_retarget_; // Of motion_capture_data_, bound when it is first played
+    SkinningMode skinning_mode_;
+    float lod_screen_size_;
+    float lod_hysteresis_;
+    size_t animation_lod_levels_;
+    float animation_lod_screen_size_;
+    std::vector<std::vector<CpuSkinnedAttributes*>> cpu_skinned_attributes_; // Per mesh and level, owned by meshes_
+    std::vector<MeshImport> pending_meshes_; // Imported, not yet uploaded
+    CpuRetention cpu_retention_;
+    SceneSummary scene_summary_;
+    bool valid_ = false;
+
+    // Todo: move back into init function. Exposed for testing purposes. Released at the end of loadModel.
     const aiScene* scene;
     Assimp::Importer importer;
 };
@@ -0,0 +1,439 @@
+#ifndef FIRST_TRY_MOTION_STREAM_H
+#define FIRST_TRY_MOTION_STREAM_H
+
+#include <glm/glm.hpp>
+
+#include "bvh.h"
+#include "name_table.h"
+#include "spsc_ring.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Live motion capture protocol, text over a stream socket. The source sends the BVH hierarchy from HIERARCHY
+// through MOTION, a "Frame Time: <seconds>" line, and then one line per captured frame:
+//     <sequence number> <capture time in microseconds> <BVH motion channels>
+// Capture times are on the steady clock of the sender, see motionClockMicros.
+
+// Microseconds on the monotonic clock, which all processes on a machine share.
+int64_t motionClockMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Socket for an address "unix:<path>" or "<host>:<port>", the host defaults to the loopback interface. A listening
+// socket is bound to the address, any other one connected to it. Returns -1 on failure.
+int openMotionSocket(const std::string& address, bool listening) {
+    int fd = -1;
+    if (address.compare(0, 5, "unix:") == 0) {
+        sockaddr_un unix_address;
+        std::memset(&unix_address, 0, sizeof(unix_address));
+        unix_address.sun_family = AF_UNIX;
+        std::string path = address.substr(5);
+        if (path.empty() || path.size() >= sizeof(unix_address.sun_path)) {
+            return -1;
+        }
+        std::strcpy(unix_address.sun_path, path.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (listening) {
+            unlink(path.c_str());
+        }
+        const sockaddr* socket_address = reinterpret_cast<const sockaddr*>(&unix_address);
+        if ((listening ? bind(fd, socket_address, sizeof(unix_address)) || listen(fd, 1)
+                       : connect(fd, socket_address, sizeof(unix_address))) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        return -1;
+    }
+    std::string host = colon ? address.substr(0, colon) : "127.0.0.1";
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(host.c_str(), address.c_str() + colon + 1, &hints, &addresses) != 0) {
+        return -1;
+    }
+    for (addrinfo* candidate = addresses; candidate; candidate = candidate->ai_next) {
+        fd = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int enable = 1;
+        if (listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        }
+        // Frames are small and due right away.
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        if ((listening ? bind(fd, candidate->ai_addr, candidate->ai_addrlen) || listen(fd, 1)
+                       : connect(fd, candidate->ai_addr, candidate->ai_addrlen)) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addresses);
+    return fd;
+}
+
+// Splits what arrives on a socket into lines. The line buffer is reused, steady state reads allocate nothing.
+class SocketLineReader {
+public:
+    explicit SocketLineReader(int fd) : fd_(fd), buffer_(1 << 16) {}
+
+    // Points line at the next line without its newline, valid until the next call. False once the socket is
+    // closed or fails.
+    bool readLine(const char*& line, size_t& length) {
+        while (true) {
+            char* newline = static_cast<char*>(std::memchr(buffer_.data() + begin_, '\n', end_ - begin_));
+            if (newline) {
+                *newline = '\0';
+                line = buffer_.data() + begin_;
+                length = newline - line;
+                begin_ = newline + 1 - buffer_.data();
+                return true;
+            }
+            // Partial line to the front, the buffer only grows for lines longer than it.
+            std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+            if (end_ + 1 >= buffer_.size()) {
+                buffer_.resize(buffer_.size() * 2);
+            }
+            ssize_t received = recv(fd_, buffer_.data() + end_, buffer_.size() - end_ - 1, 0);
+            if (received <= 0) {
+                return false;
+            }
+            end_ += static_cast<size_t>(received);
+        }
+    }
+
+private:
+    int fd_;
+    std::vector<char> buffer_;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+};
+
+struct MotionFrame {
+    uint64_t sequence = 0;
+    int64_t capture_time = 0; // Microseconds, clock of the sender
+    int64_t receive_time = 0; // Microseconds, motionClockMicros
+    glm::vec3 root_position = glm::vec3(0.0f);
+    std::vector<glm::quat> rotations;
+};
+
+struct MotionStreamStats {
+    size_t frames_received = 0;
+    size_t frames_lost = 0;       // Gaps in the sequence numbers
+    size_t frames_late = 0;       // Arrived after playback had passed them
+    size_t frames_overflowed = 0; // Dropped by the I/O thread because the ring was full
+    size_t frames_played = 0;
+    size_t underruns = 0;         // Updates that found no frame after the playback position
+    double total_latency_ms = 0.0; // Capture to playback, over the frames played
+    double max_latency_ms = 0.0;
+    double total_network_ms = 0.0; // Capture to receipt, over the frames received
+
+    double averageLatencyMs() const {
+        return frames_played ? total_latency_ms / frames_played : 0.0;
+    }
+
+    double averageNetworkMs() const {
+        return frames_received ? total_network_ms / frames_received : 0.0;
+    }
+};
+
+// Live motion capture from a socket, see the protocol above. An I/O thread decodes frames and pushes them through
+// a lock-free ring. update() moves them into a jitter buffer and samples it a fixed delay behind the newest
+// frames, interpolating between the two around the playback position, so uneven arrival does not show as stutter.
+// Bones are looked up like those of MotionCaptureData, so the stream can be retargeted the same way.
+class MotionStream {
+public:
+    // Connects and reads the hierarchy, blocking. The delay is in frames. Check valid() afterwards.
+    explicit MotionStream(const std::string& address, double delay_frames = 3.0, size_t ring_capacity = 256,
+                          size_t jitter_capacity = 64) {
+        fd_ = openMotionSocket(address, false);
+        if (fd_ < 0) {
+            std::cout << "ERROR::MOTION_STREAM::CONNECT_FAILED " << address << std::endl;
+            return;
+        }
+        reader_.reset(new SocketLineReader(fd_));
+        if (!readHeader()) {
+            std::cout << "ERROR::MOTION_STREAM::INVALID_HEADER " << address << std::endl;
+            close(fd_);
+            fd_ = -1;
+            return;
+        }
+        for (const std::string& bone : bone_list_) {
+            bone_ids_.push_back(NameTable::instance().intern(bone));
+        }
+        bone_hash_ = PerfectNameHash(bone_ids_);
+
+        MotionFrame prototype;
+        prototype.rotations.resize(bone_list_.size());
+        ring_.reset(new SpscRing<MotionFrame>(ring_capacity, prototype));
+        jitter_buffer_.assign(jitter_capacity, prototype);
+        jitter_valid_.assign(jitter_capacity, 0);
+        // Interpolation needs the frame after the playback position in the buffer as well.
+        delay_frames_ = std::min(delay_frames, static_cast<double>(jitter_capacity) - 2.0);
+        rotations_.assign(bone_list_.size(), glm::quat(1.0f, 0.0f, 0.0f, 0.0f));
+        connected_.store(true);
+        io_thread_ = std::thread([this]() { receiveFrames(); });
+    }
+
+    MotionStream(const MotionStream&) = delete;
+    MotionStream& operator=(const MotionStream&) = delete;
+
+    ~MotionStream() {
+        if (fd_ >= 0) {
+            // Wakes the I/O thread out of recv.
+            shutdown(fd_, SHUT_RDWR);
+            if (io_thread_.joinable()) {
+                io_thread_.join();
+            }
+            close(fd_);
+        }
+    }
+
+    bool valid() const {
+        return fd_ >= 0;
+    }
+
+    // False once the source closed the connection, the last pose is kept.
+    bool connected() const {
+        return connected_.load();
+    }
+
+    size_t numBones() const {
+        return bone_list_.size();
+    }
+
+    const std::string& boneName(size_t bone) const {
+        return bone_list_[bone];
+    }
+
+    // Returns -1 if the stream has no bone with this name.
+    int findBone(NameId bone_name) const {
+        return bone_hash_.find(bone_name);
+    }
+
+    double frameTime() const {
+        return frame_time_;
+    }
+
+    // Takes the frames received so far and moves the playback position to now. Once per frame, before the models
+    // playing the stream are updated, on the thread that updates them.
+    void update() {
+        int64_t now = motionClockMicros();
+        receive();
+        if (!has_base_time_) {
+            return;
+        }
+        double position = static_cast<double>(now - base_time_) / frame_micros_ - delay_frames_;
+        if (position < 0.0) {
+            return;
+        }
+        uint64_t frame = static_cast<uint64_t>(position);
+        const MotionFrame* current = bufferedFrame(frame);
+        const MotionFrame* next = bufferedFrame(frame + 1);
+        if (!current || !next) {
+            // Holds the newest frame before the position until the stream catches up.
+            ++stats_.underruns;
+            for (uint64_t back = 1; !current && back <= frame && back <= jitter_buffer_.size(); ++back) {
+                current = bufferedFrame(frame - back);
+            }
+            if (!current) {
+                return;
+            }
+            next = current;
+        }
+        float mix_ratio = static_cast<float>(std::min(position - static_cast<double>(frame), 1.0));
+        for (size_t bone = 0; bone < rotations_.size(); ++bone) {
+            rotations_[bone] = glm::slerp(current->rotations[bone], next->rotations[bone], mix_ratio);
+        }
+        root_position_ = current->root_position * (1.0f - mix_ratio) + next->root_position * mix_ratio;
+
+        if (!has_played_ || current->sequence > played_sequence_) {
+            double latency_ms = (now - current->capture_time) / 1000.0;
+            ++stats_.frames_played;
+            stats_.total_latency_ms += latency_ms;
+            stats_.max_latency_ms = std::max(stats_.max_latency_ms, latency_ms);
+            played_sequence_ = current->sequence;
+            has_played_ = true;
+        }
+    }
+
+    // Rotation at the playback position of the last update(), whatever the time. Identity until the first frame is
+    // played.
+    glm::quat sampleRotation(size_t bone, double /*time*/) const {
+        return rotations_[bone];
+    }
+
+    const glm::vec3& rootPosition() const {
+        return root_position_;
+    }
+
+    // As of the last update().
+    MotionStreamStats stats() const {
+        MotionStreamStats stats = stats_;
+        stats.frames_overflowed = frames_overflowed_.load();
+        return stats;
+    }
+
+private:
+    bool readHeader() {
+        std::string header;
+        const char* line;
+        size_t length;
+        while (reader_->readLine(line, length)) {
+            if (std::strncmp(line, "Frame Time:", 11) == 0) {
+                frame_time_ = std::atof(line + 11);
+                frame_micros_ = frame_time_ * 1e6;
+                std::istringstream header_stream(header);
+                BvhHierarchy hierarchy;
+                if (!readBvhHierarchy(header_stream, hierarchy) || frame_time_ <= 0.0) {
+                    return false;
+                }
+                bone_list_ = hierarchy.bones;
+                return true;
+            }
+            header.append(line, length);
+            header += '\n';
+        }
+        return false;
+    }
+
+    // I/O thread.
+    void receiveFrames() {
+        std::vector<float> channels(bvhChannelCount(bone_list_.size()));
+        const char* line;
+        size_t length;
+        while (reader_->readLine(line, length)) {
+            char* cursor;
+            uint64_t sequence = std::strtoull(line, &cursor, 10);
+            int64_t capture_time = std::strtoll(cursor, &cursor, 10);
+            size_t parsed = 0;
+            while (parsed < channels.size()) {
+                char* end;
+                channels[parsed] = std::strtof(cursor, &end);
+                if (end == cursor) {
+                    break;
+                }
+                cursor = end;
+                ++parsed;
+            }
+            if (parsed < channels.size()) {
+                continue;
+            }
+            MotionFrame* frame = ring_->beginPush();
+            if (!frame) {
+                frames_overflowed_.fetch_add(1);
+                continue;
+            }
+            frame->sequence = sequence;
+            frame->capture_time = capture_time;
+            frame->receive_time = motionClockMicros();
+            decodeBvhFrame(channels.data(), bone_list_.size(), SCALE, frame->root_position,
+                           frame->rotations.data());
+            ring_->endPush();
+        }
+        connected_.store(false);
+    }
+
+    void receive() {
+        while (MotionFrame* frame = ring_->front()) {
+            ++stats_.frames_received;
+            stats_.total_network_ms += (frame->receive_time - frame->capture_time) / 1000.0;
+            if (has_newest_ && frame->sequence > newest_sequence_ + 1) {
+                stats_.frames_lost += frame->sequence - newest_sequence_ - 1;
+            }
+            if (has_played_ && frame->sequence <= played_sequence_) {
+                ++stats_.frames_late;
+            } else {
+                size_t slot = frame->sequence % jitter_buffer_.size();
+                MotionFrame& buffered = jitter_buffer_[slot];
+                buffered.sequence = frame->sequence;
+                buffered.capture_time = frame->capture_time;
+                buffered.receive_time = frame->receive_time;
+                buffered.root_position = frame->root_position;
+                std::copy(frame->rotations.begin(), frame->rotations.end(), buffered.rotations.begin());
+                jitter_valid_[slot] = 1;
+            }
+            // Frames are due frame_time apart, the earliest arrival so far ties the sequence to this clock.
+            int64_t base_time = frame->receive_time - static_cast<int64_t>(frame->sequence * frame_micros_);
+            if (!has_base_time_ || base_time < base_time_) {
+                base_time_ = base_time;
+                has_base_time_ = true;
+            }
+            if (!has_newest_ || frame->sequence > newest_sequence_) {
+                newest_sequence_ = frame->sequence;
+                has_newest_ = true;
+            }
+            ring_->pop();
+        }
+    }
+
+    const MotionFrame* bufferedFrame(uint64_t sequence) const {
+        size_t slot = sequence % jitter_buffer_.size();
+        return jitter_valid_[slot] && jitter_buffer_[slot].sequence == sequence ? &jitter_buffer_[slot] : nullptr;
+    }
+
+    const float SCALE = 0.028f; // As MotionCaptureData
+
+    int fd_ = -1;
+    std::unique_ptr<SocketLineReader> reader_; // Used by the I/O thread once it runs
+    std::thread io_thread_;
+    std::atomic<bool> connected_{false};
+    std::atomic<size_t> frames_overflowed_{0};
+    std::unique_ptr<SpscRing<MotionFrame>> ring_;
+
+    std::vector<std::string> bone_list_;
+    std::vector<NameId> bone_ids_;
+    PerfectNameHash bone_hash_;
+    double frame_time_ = 0.0;
+    double frame_micros_ = 0.0;
+    double delay_frames_ = 3.0;
+
+    // Update side.
+    std::vector<MotionFrame> jitter_buffer_; // Frame n at n % size
+    std::vector<uint8_t> jitter_valid_;
+    int64_t base_time_ = 0; // Arrival time of frame 0 on a stream without delays
+    bool has_base_time_ = false;
+    uint64_t newest_sequence_ = 0;
+    bool has_newest_ = false;
+    uint64_t played_sequence_ = 0;
+    bool has_played_ = false;
+    std::vector<glm::quat> rotations_;
+    glm::vec3 root_position_ = glm::vec3(0.0f);
+    MotionStreamStats stats_;
+};
+
+#endif //FIRST_TRY_MOTION_STREAM_H
@@ -0,0 +1,257 @@
+#ifndef FIRST_TRY_NAME_TABLE_H
+#define FIRST_TRY_NAME_TABLE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+typedef uint32_t NameId;
+const NameId INVALID_NAME = 0xffffffff;
+
+// FNV-1a, good enough for short identifiers like bone names.
+uint64_t hashName(const char* data, size_t length) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Rehashes a name hash with a seed, finalizer of splitmix64.
+uint64_t mixHash(uint64_t hash, uint64_t seed) {
+    hash ^= seed * 0x9e3779b97f4a7c15ull;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+    return hash ^ (hash >> 31);
+}
+
+// Gives every distinct name a stable id for the lifetime of the program, so names can be stored and compared as
+// integers. Names are interned by asset imports running on worker threads, so interning and lookups by name take
+// a lock. Entries never move once added, name() and hash() of an id the caller already holds read them without one.
+class NameTable {
+public:
+    static NameTable& instance() {
+        static NameTable table;
+        return table;
+    }
+
+    ~NameTable() {
+        for (auto& chunk : chunks_) {
+            delete[] chunk.load(std::memory_order_relaxed);
+        }
+    }
+
+    NameId intern(const char* data, size_t length) {
+        uint64_t hash = hashName(data, length);
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t slot = findSlot(data, length, hash);
+        if (slots_[slot] != INVALID_NAME) {
+            return slots_[slot];
+        }
+        NameId id = static_cast<NameId>(size_);
+        assert(id / CHUNK_SIZE < MAX_CHUNKS && "Too many names");
+        std::atomic<Entry*>& chunk = chunks_[id / CHUNK_SIZE];
+        if (!chunk.load(std::memory_order_relaxed)) {
+            chunk.store(new Entry[CHUNK_SIZE], std::memory_order_release);
+        }
+        Entry& entry = chunk.load(std::memory_order_relaxed)[id % CHUNK_SIZE];
+        entry.name.assign(data, length);
+        entry.hash = hash;
+        ++size_;
+        slots_[slot] = id;
+        // Keep the load factor under a half.
+        if (size_ * 2 > slots_.size()) {
+            rehash(slots_.size() * 2);
+        }
+        return id;
+    }
+
+    NameId intern(const std::string& name) {
+        return intern(name.data(), name.size());
+    }
+
+    // Returns INVALID_NAME if the name was never interned.
+    NameId find(const char* data, size_t length) const {
+        uint64_t hash = hashName(data, length);
+        std::lock_guard<std::mutex> lock(mutex_);
+        return slots_[findSlot(data, length, hash)];
+    }
+
+    const std::string& name(NameId id) const {
+        return entry(id).name;
+    }
+
+    uint64_t hash(NameId id) const {
+        return entry(id).hash;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return size_;
+    }
+
+private:
+    struct Entry {
+        std::string name;
+        uint64_t hash;
+    };
+
+    static const size_t CHUNK_SIZE = 1024;
+    static const size_t MAX_CHUNKS = 4096;
+
+    NameTable() : slots_(1024, INVALID_NAME) {
+        for (auto& chunk : chunks_) {
+            chunk.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    const Entry& entry(NameId id) const {
+        return chunks_[id / CHUNK_SIZE].load(std::memory_order_acquire)[id % CHUNK_SIZE];
+    }
+
+    bool equals(NameId id, const char* data, size_t length) const {
+        const std::string& name = entry(id).name;
+        return name.size() == length && std::memcmp(name.data(), data, length) == 0;
+    }
+
+    // Slot of the name, or the empty slot it would go into. Called with mutex_ held.
+    size_t findSlot(const char* data, size_t length, uint64_t hash) const {
+        size_t mask = slots_.size() - 1;
+        size_t slot = hash & mask;
+        while (slots_[slot] != INVALID_NAME &&
+               (entry(slots_[slot]).hash != hash || !equals(slots_[slot], data, length))) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    void rehash(size_t num_slots) {
+        slots_.assign(num_slots, INVALID_NAME);
+        for (NameId id = 0; id < size_; ++id) {
+            size_t slot = entry(id).hash & (num_slots - 1);
+            while (slots_[slot] != INVALID_NAME) {
+                slot = (slot + 1) & (num_slots - 1);
+            }
+            slots_[slot] = id;
+        }
+    }
+
+    std::atomic<Entry*> chunks_[MAX_CHUNKS]; // Ids in order, allocated a chunk at a time so entries never move
+    size_t size_ = 0;
+    std::vector<NameId> slots_;              // Open addressing, power of two size
+    mutable std::mutex mutex_;
+};
+
+// Perfect hash from a fixed set of names to their index in it, built once with hash and displace. It is not
+// minimal: the slots are rounded up to a power of two, so a lookup masks instead of dividing. Every lookup is
+// a single probe, names outside the set are rejected by comparing ids.
+class PerfectNameHash {
+public:
+    PerfectNameHash() = default;
+
+    // The names must be unique.
+    explicit PerfectNameHash(const std::vector<NameId>& names) {
+        if (names.empty()) {
+            return;
+        }
+        size_t num_slots = 1;
+        while (num_slots < names.size()) {
+            num_slots *= 2;
+        }
+        size_t num_buckets = 1;
+        while (num_buckets * 4 < names.size()) {
+            num_buckets *= 2;
+        }
+        slot_mask_ = num_slots - 1;
+        bucket_mask_ = num_buckets - 1;
+        slot_names_.assign(num_slots, INVALID_NAME);
+        slot_values_.assign(num_slots, -1);
+        seeds_.assign(num_buckets, 0);
+
+        const NameTable& table = NameTable::instance();
+        std::vector<std::vector<int>> buckets(num_buckets);
+        for (size_t i = 0; i < names.size(); ++i) {
+            buckets[table.hash(names[i]) & bucket_mask_].push_back(static_cast<int>(i));
+        }
+        // Largest buckets first, while most slots are still free.
+        std::vector<size_t> order(num_buckets);
+        for (size_t i = 0; i < num_buckets; ++i) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(),
+                  [&buckets](size_t a, size_t b) { return buckets[a].size() > buckets[b].size(); });
+
+        std::vector<size_t> slots;
+        for (size_t bucket : order) {
+            if (buckets[bucket].empty()) {
+                break;
+            }
+            for (uint32_t seed = 1;; ++seed) {
+                slots.clear();
+                for (int key : buckets[bucket]) {
+                    size_t slot = mixHash(table.hash(names[key]), seed) & slot_mask_;
+                    if (slot_names_[slot] != INVALID_NAME ||
+                        std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+                        break;
+                    }
+                    slots.push_back(slot);
+                }
+                if (slots.size() == buckets[bucket].size()) {
+                    seeds_[bucket] = seed;
+                    break;
+                }
+            }
+            for (size_t i = 0; i < slots.size(); ++i) {
+                int key = buckets[bucket][i];
+                slot_names_[slots[i]] = names[key];
+                slot_values_[slots[i]] = key;
+            }
+        }
+    }
+
+    // Index of the name in the set, -1 if it is not in it.
+    int find(NameId name) const {
+        if (slot_names_.empty() || name == INVALID_NAME) {
+            return -1;
+        }
+        size_t slot = slotOf(NameTable::instance().hash(name));
+        return slot_names_[slot] == name ? slot_values_[slot] : -1;
+    }
+
+    int find(const char* data, size_t length) const {
+        if (slot_names_.empty()) {
+            return -1;
+        }
+        size_t slot = slotOf(hashName(data, length));
+        NameId name = slot_names_[slot];
+        if (name == INVALID_NAME) {
+            return -1;
+        }
+        const std::string& slot_name = NameTable::instance().name(name);
+        return slot_name.size() == length && std::memcmp(slot_name.data(), data, length) == 0 ? slot_values_[slot]
+                                                                                               : -1;
+    }
+
+    int find(const std::string& name) const {
+        return find(name.data(), name.size());
+    }
+
+private:
+    size_t slotOf(uint64_t hash) const {
+        return mixHash(hash, seeds_[hash & bucket_mask_]) & slot_mask_;
+    }
+
+    size_t slot_mask_ = 0;
+    size_t bucket_mask_ = 0;
+    std::vector<uint32_t> seeds_;    // Per bucket
+    std::vector<NameId> slot_names_; // INVALID_NAME for unused slots
+    std::vector<int> slot_values_;
+};
+
+#endif //FIRST_TRY_NAME_TABLE_H
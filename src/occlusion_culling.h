@@ -0,0 +1,469 @@
+#ifndef FIRST_TRY_OCCLUSION_CULLING_H
+#define FIRST_TRY_OCCLUSION_CULLING_H
+
+#include <glm/glm.hpp>
+
+#include "array_view.h"
+#include "culling.h"
+#include "frame_memory.h"
+#include "mesh.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Low poly stand-in for a mesh, drawn into the occlusion buffer. It has to stay inside the surface it stands for,
+// anything it sticks out of is hidden wrongly. Simplified proxies are pulled back inside with shrinkOccluder().
+struct OccluderMesh {
+    std::vector<glm::vec3> positions;
+    std::vector<VertexBoneAttribute> bones; // Model bone ids, empty for static meshes
+    std::vector<unsigned int> indices;
+
+    bool empty() const {
+        return indices.empty();
+    }
+
+    void append(const OccluderMesh& other) {
+        unsigned int base = static_cast<unsigned int>(positions.size());
+        positions.insert(positions.end(), other.positions.begin(), other.positions.end());
+        bones.insert(bones.end(), other.bones.begin(), other.bones.end());
+        for (unsigned int index : other.indices) {
+            indices.push_back(base + index);
+        }
+    }
+};
+
+// The twelve triangles of a box, for meshes that fill their bounds like the cube.
+OccluderMesh boxOccluder(const AABB& box) {
+    OccluderMesh occluder;
+    for (int corner = 0; corner < 8; ++corner) {
+        occluder.positions.push_back(glm::vec3(corner & 1 ? box.max.x : box.min.x, corner & 2 ? box.max.y : box.min.y,
+                                               corner & 4 ? box.max.z : box.min.z));
+    }
+    // Counter clockwise seen from outside.
+    const unsigned int faces[6][4] = {{0, 4, 6, 2}, {1, 3, 7, 5}, {0, 1, 5, 4}, {2, 6, 7, 3}, {0, 2, 3, 1}, {4, 5, 7, 6}};
+    for (const auto& face : faces) {
+        occluder.indices.insert(occluder.indices.end(), {face[0], face[1], face[2], face[0], face[2], face[3]});
+    }
+    return occluder;
+}
+
+// Closest point to p on the triangle abc.
+glm::vec3 closestPointOnTriangle(const glm::vec3& p, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+    glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+    float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f) {
+        return a;
+    }
+    glm::vec3 bp = p - b;
+    float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3) {
+        return b;
+    }
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+        return a + ab * (d1 / (d1 - d3));
+    }
+    glm::vec3 cp = p - c;
+    float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6) {
+        return c;
+    }
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+        return a + ac * (d2 / (d2 - d6));
+    }
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) {
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    }
+    float denominator = 1.0f / (va + vb + vc);
+    return a + ab * (vb * denominator) + ac * (vc * denominator);
+}
+
+// How far the proxy sticks out of the surface, measured at its vertices, edge midpoints and triangle centers.
+// A point is outside if it lies in front of the closest surface triangles. Where several are closest, at a shared
+// edge or corner, their normals are summed weighted by area, so slivers don't decide.
+float occluderOvershoot(const OccluderMesh& occluder, const std::vector<Vertex>& surface_vertices,
+                        const std::vector<unsigned int>& surface_indices) {
+    std::vector<glm::vec3> samples(occluder.positions);
+    for (size_t i = 0; i + 2 < occluder.indices.size(); i += 3) {
+        const glm::vec3& a = occluder.positions[occluder.indices[i]];
+        const glm::vec3& b = occluder.positions[occluder.indices[i + 1]];
+        const glm::vec3& c = occluder.positions[occluder.indices[i + 2]];
+        samples.insert(samples.end(), {(a + b) * 0.5f, (b + c) * 0.5f, (c + a) * 0.5f, (a + b + c) / 3.0f});
+    }
+    // Bounding spheres of the surface triangles, to skip those that cannot be closest.
+    std::vector<glm::vec4> spheres;
+    for (size_t i = 0; i + 2 < surface_indices.size(); i += 3) {
+        const glm::vec3& a = surface_vertices[surface_indices[i]].position;
+        const glm::vec3& b = surface_vertices[surface_indices[i + 1]].position;
+        const glm::vec3& c = surface_vertices[surface_indices[i + 2]].position;
+        glm::vec3 center = (a + b + c) / 3.0f;
+        float radius = std::max(glm::length(a - center), std::max(glm::length(b - center), glm::length(c - center)));
+        spheres.push_back(glm::vec4(center, radius));
+    }
+    float overshoot = 0.0f;
+    for (const glm::vec3& sample : samples) {
+        float closest_distance = INFINITY;
+        glm::vec3 closest_offset(0.0f);
+        glm::vec3 closest_normal(0.0f);
+        for (size_t i = 0; i + 2 < surface_indices.size(); i += 3) {
+            const glm::vec4& sphere = spheres[i / 3];
+            float tie = 1e-5f * (closest_distance + 1e-3f);
+            if (glm::length(sample - glm::vec3(sphere)) - sphere.w > closest_distance + tie) {
+                continue;
+            }
+            const glm::vec3& a = surface_vertices[surface_indices[i]].position;
+            const glm::vec3& b = surface_vertices[surface_indices[i + 1]].position;
+            const glm::vec3& c = surface_vertices[surface_indices[i + 2]].position;
+            glm::vec3 offset = sample - closestPointOnTriangle(sample, a, b, c);
+            float distance = glm::length(offset);
+            tie = 1e-5f * (distance + 1e-3f);
+            if (distance < closest_distance - tie) {
+                closest_distance = distance;
+                closest_offset = offset;
+                closest_normal = glm::cross(b - a, c - a);
+            } else if (distance <= closest_distance + tie) {
+                closest_normal += glm::cross(b - a, c - a);
+            }
+        }
+        if (glm::dot(closest_offset, closest_normal) > 0.0f) {
+            overshoot = std::max(overshoot, closest_distance);
+        }
+    }
+    return overshoot;
+}
+
+// Moves a simplified proxy inward along the normals of its vertices until it no longer sticks out of the surface
+// it was simplified from, as far as occluderOvershoot() can tell. The quadric simplifier places vertices where
+// they fit the planes around them best, which is outside of convex areas. A proxy that does not get inside within
+// a few steps, like one much thinner than its error, is cleared. Returns false in that case.
+bool shrinkOccluder(OccluderMesh& occluder, const std::vector<glm::vec3>& normals,
+                    const std::vector<Vertex>& surface_vertices, const std::vector<unsigned int>& surface_indices) {
+    const int MAX_STEPS = 4;
+    AABB bounds;
+    for (const Vertex& vertex : surface_vertices) {
+        bounds.extend(vertex.position);
+    }
+    float tolerance = 1e-4f * glm::length(bounds.max - bounds.min);
+    for (int step = 0; step < MAX_STEPS; ++step) {
+        float overshoot = occluderOvershoot(occluder, surface_vertices, surface_indices);
+        if (overshoot <= tolerance) {
+            return true;
+        }
+        for (size_t i = 0; i < occluder.positions.size(); ++i) {
+            float length = glm::length(normals[i]);
+            if (length > 0.0f) {
+                occluder.positions[i] -= normals[i] * ((overshoot + tolerance) / length);
+            }
+        }
+    }
+    if (occluderOvershoot(occluder, surface_vertices, surface_indices) <= tolerance) {
+        return true;
+    }
+    occluder = OccluderMesh();
+    return false;
+}
+
+// Triangles of one occluder, with its vertices in clip space.
+struct OccluderDraw {
+    ArrayView<const glm::vec4> clip_positions;
+    ArrayView<const unsigned int> indices;
+};
+
+// Summed over frames.
+struct OcclusionStats {
+    size_t frames = 0;
+    size_t occluders = 0;
+    size_t occluder_triangles = 0;
+    size_t tested = 0;
+    size_t culled = 0;
+    double render_ms = 0.0; // Picking, transforming and rasterizing occluders
+    double test_ms = 0.0;
+
+    double culledFraction() const {
+        return tested ? static_cast<double>(culled) / tested : 0.0;
+    }
+};
+
+// Coarse software depth buffer for occlusion culling. Occluder triangles are rasterized on the CPU, four pixels at
+// a time with SSE2, by bands of tile rows spread over the thread pool. Each tile keeps the farthest depth of its
+// pixels, so a box is usually found hidden with one compare per tile it covers. Depth is 1 / w, larger is nearer
+// and 0 is empty.
+class OcclusionBuffer {
+public:
+    static const int TILE_SIZE = 8;
+
+    explicit OcclusionBuffer(int width = 256, int height = 128, ThreadPool& pool = ThreadPool::instance()) :
+            width_((width + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE),
+            height_((height + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE), pool_(pool) {
+        tiles_x_ = width_ / TILE_SIZE;
+        tiles_y_ = height_ / TILE_SIZE;
+        depth_.resize(static_cast<size_t>(width_) * height_);
+        tile_depth_.resize(static_cast<size_t>(tiles_x_) * tiles_y_);
+    }
+
+    int width() const {
+        return width_;
+    }
+
+    int height() const {
+        return height_;
+    }
+
+    // Clears the buffer and rasterizes the occluders seen through view_projection. Back faces are skipped.
+    void render(const glm::mat4& view_projection, ArrayView<const OccluderDraw> draws, FrameArena& arena) {
+        view_projection_ = view_projection;
+        // Up to two triangles per occluder triangle once clipped by the near plane.
+        ArrayView<size_t> first_triangle = arena.allocate<size_t>(draws.size());
+        size_t max_triangles = 0;
+        for (size_t i = 0; i < draws.size(); ++i) {
+            first_triangle[i] = max_triangles;
+            max_triangles += draws[i].indices.size() / 3 * 2;
+        }
+        ArrayView<ScreenTriangle> triangles = arena.allocate<ScreenTriangle>(max_triangles);
+        ArrayView<size_t> num_triangles = arena.allocate<size_t>(draws.size());
+        pool_.parallelFor(draws.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                num_triangles[i] = setupTriangles(draws[i], &triangles[first_triangle[i]]);
+            }
+        });
+
+        pool_.parallelFor(tiles_y_, 1, [&](size_t begin, size_t end) {
+            for (size_t tile_row = begin; tile_row < end; ++tile_row) {
+                int first_row = static_cast<int>(tile_row) * TILE_SIZE;
+                std::fill(depth_.begin() + first_row * width_, depth_.begin() + (first_row + TILE_SIZE) * width_,
+                          0.0f);
+                for (size_t i = 0; i < draws.size(); ++i) {
+                    for (size_t t = 0; t < num_triangles[i]; ++t) {
+                        rasterize(triangles[first_triangle[i] + t], first_row, first_row + TILE_SIZE);
+                    }
+                }
+                updateTileRow(static_cast<int>(tile_row));
+            }
+        });
+    }
+
+    // False if the box is behind the occluders everywhere on screen. Boxes crossing the near plane are visible.
+    bool visible(const AABB& box) const {
+        if (box.empty()) {
+            return false;
+        }
+        glm::vec2 screen_min(FLT_MAX);
+        glm::vec2 screen_max(-FLT_MAX);
+        float nearest = 0.0f;
+        for (int corner = 0; corner < 8; ++corner) {
+            glm::vec4 clip = view_projection_ * glm::vec4(corner & 1 ? box.max.x : box.min.x,
+                                                          corner & 2 ? box.max.y : box.min.y,
+                                                          corner & 4 ? box.max.z : box.min.z, 1.0f);
+            if (clip.w <= 1e-5f || clip.z < -clip.w) {
+                return true;
+            }
+            float inverse_w = 1.0f / clip.w;
+            glm::vec2 screen = toScreen(clip, inverse_w);
+            screen_min = glm::min(screen_min, screen);
+            screen_max = glm::max(screen_max, screen);
+            nearest = std::max(nearest, inverse_w);
+        }
+        // Pixels count as covered by their centers, a box can show past an occluder edge within a pixel. One
+        // more pixel around the box catches that, only gaps narrower than a pixel are taken as closed.
+        int min_x = std::max(static_cast<int>(std::floor(screen_min.x)) - 1, 0);
+        int min_y = std::max(static_cast<int>(std::floor(screen_min.y)) - 1, 0);
+        int max_x = std::min(static_cast<int>(std::floor(screen_max.x)) + 1, width_ - 1);
+        int max_y = std::min(static_cast<int>(std::floor(screen_max.y)) + 1, height_ - 1);
+        if (min_x > max_x || min_y > max_y) {
+            return true;
+        }
+        for (int tile_y = min_y / TILE_SIZE; tile_y <= max_y / TILE_SIZE; ++tile_y) {
+            for (int tile_x = min_x / TILE_SIZE; tile_x <= max_x / TILE_SIZE; ++tile_x) {
+                if (tile_depth_[tile_y * tiles_x_ + tile_x] > nearest) {
+                    continue;
+                }
+                // Some pixel of the tile is farther than the box, look at the ones the box covers.
+                int row_end = std::min(max_y, tile_y * TILE_SIZE + TILE_SIZE - 1);
+                int column_end = std::min(max_x, tile_x * TILE_SIZE + TILE_SIZE - 1);
+                for (int y = std::max(min_y, tile_y * TILE_SIZE); y <= row_end; ++y) {
+                    const float* row = &depth_[y * width_];
+                    for (int x = std::max(min_x, tile_x * TILE_SIZE); x <= column_end; ++x) {
+                        if (row[x] <= nearest) {
+                            return true;
+                        }
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+private:
+    // Edge functions are positive inside, depth is a plane in screen space.
+    struct ScreenTriangle {
+        int min_x, min_y, max_x, max_y; // Pixels whose centers may be covered
+        float edge_a[3], edge_b[3], edge_c[3];
+        float depth_a, depth_b, depth_c;
+    };
+
+    glm::vec2 toScreen(const glm::vec4& clip, float inverse_w) const {
+        return glm::vec2((clip.x * inverse_w * 0.5f + 0.5f) * width_, (clip.y * inverse_w * 0.5f + 0.5f) * height_);
+    }
+
+    // Clips the triangles of an occluder by the near plane and sets up the front facing ones on screen. Returns
+    // how many were written.
+    size_t setupTriangles(const OccluderDraw& draw, ScreenTriangle* out) const {
+        size_t count = 0;
+        for (size_t i = 0; i + 2 < draw.indices.size(); i += 3) {
+            const glm::vec4 corners[3] = {draw.clip_positions[draw.indices[i]],
+                                          draw.clip_positions[draw.indices[i + 1]],
+                                          draw.clip_positions[draw.indices[i + 2]]};
+            // All outside of the same side plane.
+            if ((corners[0].x > corners[0].w && corners[1].x > corners[1].w && corners[2].x > corners[2].w) ||
+                (corners[0].x < -corners[0].w && corners[1].x < -corners[1].w && corners[2].x < -corners[2].w) ||
+                (corners[0].y > corners[0].w && corners[1].y > corners[1].w && corners[2].y > corners[2].w) ||
+                (corners[0].y < -corners[0].w && corners[1].y < -corners[1].w && corners[2].y < -corners[2].w)) {
+                continue;
+            }
+            glm::vec4 polygon[4];
+            int num_corners = 0;
+            for (int k = 0; k < 3; ++k) {
+                const glm::vec4& a = corners[k];
+                const glm::vec4& b = corners[(k + 1) % 3];
+                float distance_a = a.z + a.w;
+                float distance_b = b.z + b.w;
+                if (distance_a >= 0.0f) {
+                    polygon[num_corners++] = a;
+                }
+                if ((distance_a >= 0.0f) != (distance_b >= 0.0f)) {
+                    float t = distance_a / (distance_a - distance_b);
+                    polygon[num_corners++] = a + (b - a) * t;
+                }
+            }
+            for (int k = 1; k + 1 < num_corners; ++k) {
+                if (setupTriangle(polygon[0], polygon[k], polygon[k + 1], out[count])) {
+                    ++count;
+                }
+            }
+        }
+        return count;
+    }
+
+    bool setupTriangle(const glm::vec4& c0, const glm::vec4& c1, const glm::vec4& c2, ScreenTriangle& triangle) const {
+        const glm::vec4* clip[3] = {&c0, &c1, &c2};
+        glm::vec2 screen[3];
+        float depth[3];
+        for (int k = 0; k < 3; ++k) {
+            depth[k] = 1.0f / std::max(clip[k]->w, 1e-5f);
+            screen[k] = toScreen(*clip[k], depth[k]);
+        }
+        float area = (screen[1].x - screen[0].x) * (screen[2].y - screen[0].y) -
+                     (screen[1].y - screen[0].y) * (screen[2].x - screen[0].x);
+        if (!(area > 0.0f)) {
+            return false;
+        }
+        glm::vec2 low = glm::min(glm::min(screen[0], screen[1]), screen[2]);
+        glm::vec2 high = glm::max(glm::max(screen[0], screen[1]), screen[2]);
+        triangle.min_x = std::max(static_cast<int>(std::ceil(low.x - 0.5f)), 0);
+        triangle.min_y = std::max(static_cast<int>(std::ceil(low.y - 0.5f)), 0);
+        triangle.max_x = std::min(static_cast<int>(std::floor(high.x - 0.5f)), width_ - 1);
+        triangle.max_y = std::min(static_cast<int>(std::floor(high.y - 0.5f)), height_ - 1);
+        if (triangle.min_x > triangle.max_x || triangle.min_y > triangle.max_y) {
+            return false;
+        }
+        // Edge k runs from corner k to the next one, its function is the doubled area of the triangle it makes
+        // with the point, which is the barycentric weight of the opposite corner times the area.
+        float inverse_area = 1.0f / area;
+        triangle.depth_a = triangle.depth_b = triangle.depth_c = 0.0f;
+        for (int k = 0; k < 3; ++k) {
+            const glm::vec2& a = screen[k];
+            const glm::vec2& b = screen[(k + 1) % 3];
+            triangle.edge_a[k] = a.y - b.y;
+            triangle.edge_b[k] = b.x - a.x;
+            triangle.edge_c[k] = -(triangle.edge_a[k] * a.x + triangle.edge_b[k] * a.y);
+            float weight = depth[(k + 2) % 3] * inverse_area;
+            triangle.depth_a += triangle.edge_a[k] * weight;
+            triangle.depth_b += triangle.edge_b[k] * weight;
+            triangle.depth_c += triangle.edge_c[k] * weight;
+        }
+        // Evaluated at pixel centers, the offset gives a pixel the farthest depth of the triangle over it.
+        triangle.depth_c -= (std::fabs(triangle.depth_a) + std::fabs(triangle.depth_b)) * 0.5f;
+        return true;
+    }
+
+    // Keeps the nearer depth in the pixels of rows [first_row, end_row) whose centers are strictly inside.
+    void rasterize(const ScreenTriangle& triangle, int first_row, int end_row) {
+        int min_y = std::max(triangle.min_y, first_row);
+        int max_y = std::min(triangle.max_y, end_row - 1);
+        int min_x = triangle.min_x & ~3;
+        for (int y = min_y; y <= max_y; ++y) {
+            float center_y = y + 0.5f;
+            float* row = &depth_[y * width_];
+            int x = min_x;
+#if defined(__SSE2__)
+            __m128 center_x = _mm_add_ps(_mm_set1_ps(x + 0.5f), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+            __m128 edges[3], edge_steps[3];
+            for (int k = 0; k < 3; ++k) {
+                edges[k] = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(triangle.edge_a[k]), center_x),
+                                      _mm_set1_ps(triangle.edge_b[k] * center_y + triangle.edge_c[k]));
+                edge_steps[k] = _mm_set1_ps(triangle.edge_a[k] * 4.0f);
+            }
+            __m128 depth = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(triangle.depth_a), center_x),
+                                      _mm_set1_ps(triangle.depth_b * center_y + triangle.depth_c));
+            __m128 depth_step = _mm_set1_ps(triangle.depth_a * 4.0f);
+            __m128 zero = _mm_setzero_ps();
+            for (; x <= triangle.max_x; x += 4) {
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(edges[0], zero), _mm_cmpgt_ps(edges[1], zero)),
+                                           _mm_cmpgt_ps(edges[2], zero));
+                // Outside lanes become 0, which never wins against the stored depth.
+                __m128 stored = _mm_loadu_ps(row + x);
+                _mm_storeu_ps(row + x, _mm_max_ps(stored, _mm_and_ps(inside, depth)));
+                for (int k = 0; k < 3; ++k) {
+                    edges[k] = _mm_add_ps(edges[k], edge_steps[k]);
+                }
+                depth = _mm_add_ps(depth, depth_step);
+            }
+#endif
+            for (; x <= triangle.max_x; ++x) {
+                float center_x = x + 0.5f;
+                bool inside = true;
+                for (int k = 0; k < 3; ++k) {
+                    inside = inside && triangle.edge_a[k] * center_x + triangle.edge_b[k] * center_y +
+                                       triangle.edge_c[k] > 0.0f;
+                }
+                if (inside) {
+                    row[x] = std::max(row[x], triangle.depth_a * center_x + triangle.depth_b * center_y +
+                                              triangle.depth_c);
+                }
+            }
+        }
+    }
+
+    void updateTileRow(int tile_y) {
+        for (int tile_x = 0; tile_x < tiles_x_; ++tile_x) {
+            float farthest = FLT_MAX;
+            for (int y = tile_y * TILE_SIZE; y < (tile_y + 1) * TILE_SIZE; ++y) {
+                const float* row = &depth_[y * width_ + tile_x * TILE_SIZE];
+                for (int x = 0; x < TILE_SIZE; ++x) {
+                    farthest = std::min(farthest, row[x]);
+                }
+            }
+            tile_depth_[tile_y * tiles_x_ + tile_x] = farthest;
+        }
+    }
+
+    int width_;
+    int height_;
+    int tiles_x_;
+    int tiles_y_;
+    ThreadPool& pool_;
+    glm::mat4 view_projection_ = glm::mat4(1.0f);
+    std::vector<float> depth_;      // Row major, row 0 at the bottom like the viewport
+    std::vector<float> tile_depth_; // Farthest depth per tile
+};
+
+#endif //FIRST_TRY_OCCLUSION_CULLING_H
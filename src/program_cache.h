@@ -0,0 +1,162 @@
+#ifndef FIRST_TRY_PROGRAM_CACHE_H
+#define FIRST_TRY_PROGRAM_CACHE_H
+
+#include <glad/glad.h>
+
+#include "binary_io.h"
+#include "name_table.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+// Program binaries need GL 4.1 or ARB_get_program_binary in the glad loader. Without them the cache stays disabled.
+#if defined(GL_VERSION_4_1) || defined(GL_ARB_get_program_binary)
+#define FIRST_TRY_PROGRAM_BINARY
+#endif
+
+struct ProgramCacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t rejected = 0; // Found, but the driver refused the binary
+    size_t stores = 0;
+};
+
+// Linked program binaries on disk, one file per program. Entries are keyed by a hash of the shader sources and
+// of the driver strings, so an edited shader or a driver update misses and the program is built from source and
+// stored again. Needs a current context.
+class ProgramBinaryCache {
+public:
+    explicit ProgramBinaryCache(const std::string& directory) : directory_(directory) {
+        mkdir(directory_.c_str(), 0755);
+#ifdef GL_VERSION_4_1
+        supported_ = supported_ || GLAD_GL_VERSION_4_1;
+#endif
+#ifdef GL_ARB_get_program_binary
+        supported_ = supported_ || GLAD_GL_ARB_get_program_binary;
+#endif
+#ifdef FIRST_TRY_PROGRAM_BINARY
+        if (supported_) {
+            GLint num_formats = 0;
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+            supported_ = num_formats > 0;
+        }
+#endif
+        driver_ = glString(GL_VENDOR) + "\n" + glString(GL_RENDERER) + "\n" + glString(GL_VERSION);
+    }
+
+    bool supported() const {
+        return supported_;
+    }
+
+    uint64_t key(const std::string& vertex_source, const std::string& fragment_source) const {
+        uint64_t hash = hashName(vertex_source.data(), vertex_source.size());
+        hash = mixHash(hash, hashName(fragment_source.data(), fragment_source.size()));
+        return mixHash(hash, hashName(driver_.data(), driver_.size()));
+    }
+
+    // Creates a program from the stored binary. Returns 0 if there is none or the driver rejects it.
+    GLuint load(uint64_t key) {
+#ifndef FIRST_TRY_PROGRAM_BINARY
+        (void) key;
+        return 0;
+#else
+        if (!supported_) {
+            return 0;
+        }
+        std::ifstream file(path(key), std::ios::binary);
+        if (!file || readValue<uint32_t>(file) != MAGIC || readValue<uint64_t>(file) != key ||
+            readString(file) != driver_) {
+            ++stats_.misses;
+            return 0;
+        }
+        GLenum format = readValue<uint32_t>(file);
+        std::vector<char> binary;
+        readVector(file, binary);
+        if (!file || binary.empty()) {
+            ++stats_.misses;
+            return 0;
+        }
+
+        GLuint program = glCreateProgram();
+        glProgramBinary(program, format, binary.data(), static_cast<GLsizei>(binary.size()));
+        GLint linked = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (!linked) {
+            glDeleteProgram(program);
+            ++stats_.rejected;
+            return 0;
+        }
+        ++stats_.hits;
+        return program;
+#endif
+    }
+
+    // Stores the binary of a linked program, replacing the entry of the key.
+    void store(uint64_t key, GLuint program) {
+#ifdef FIRST_TRY_PROGRAM_BINARY
+        if (!supported_) {
+            return;
+        }
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0) {
+            return;
+        }
+        std::vector<char> binary(length);
+        GLenum format = 0;
+        glGetProgramBinary(program, length, NULL, &format, binary.data());
+
+        // Written next to the entry and renamed over it, a crash never leaves a truncated binary behind.
+        std::string entry_path = path(key);
+        std::string temporary_path = entry_path + ".tmp";
+        {
+            std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+            writeValue(file, uint32_t(MAGIC));
+            writeValue<uint64_t>(file, key);
+            writeString(file, driver_);
+            writeValue<uint32_t>(file, format);
+            writeVector(file, binary);
+            if (!file) {
+                std::cout << "ERROR::PROGRAM_CACHE::WRITE_FAILED " << temporary_path << std::endl;
+                return;
+            }
+        }
+        std::rename(temporary_path.c_str(), entry_path.c_str());
+        ++stats_.stores;
+#else
+        (void) key;
+        (void) program;
+#endif
+    }
+
+    const ProgramCacheStats& stats() const {
+        return stats_;
+    }
+
+private:
+    static const uint32_t MAGIC = 0x42475250; // "PRGB"
+
+    static std::string glString(GLenum name) {
+        const GLubyte* value = glGetString(name);
+        return value ? reinterpret_cast<const char*>(value) : "";
+    }
+
+    std::string path(uint64_t key) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(key));
+        return directory_ + "/" + name;
+    }
+
+    std::string directory_;
+    std::string driver_;
+    bool supported_ = false;
+    ProgramCacheStats stats_;
+};
+
+#endif //FIRST_TRY_PROGRAM_CACHE_H
@@ -0,0 +1,28 @@
+#version 330 core
+// Depth prepass for skeleton_shader.vert, the same blend of the position alone.
+const int MAX_JOINTS = 50;
+
+layout (location = 0) in vec3 aPos;
+layout (location = 3) in ivec4 boneIds;
+layout (location = 4) in vec4 boneWeights;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+uniform mat4 jointTransforms[MAX_JOINTS];
+
+invariant gl_Position;
+
+void main()
+{
+    vec4 totalLocalPos = vec4(0.0);
+
+    for(int i = 0; i < 4; i++){
+    		mat4 jointTransform = jointTransforms[boneIds[i]];
+    		vec4 posePosition = jointTransform * vec4(aPos, 1.0);
+    		totalLocalPos += posePosition * boneWeights[i];
+    }
+
+    gl_Position = projection * view * model * totalLocalPos;
+}
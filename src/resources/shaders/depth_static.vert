@@ -0,0 +1,15 @@
+#version 330 core
+// Depth prepass for meshes drawn with cube_shader.vert or lamp.vert, only reads the position stream. The position
+// is computed the same way and invariant, so the shading pass matches it with GL_EQUAL.
+layout (location = 0) in vec3 aPos;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+invariant gl_Position;
+
+void main()
+{
+    gl_Position = projection * view * model * vec4(aPos, 1.0);
+}
@@ -11,27 +11,66 @@ struct Material {
 };
 
 uniform Material material;
-uniform vec3 lightColor;
-uniform vec3 lightPos;
+uniform vec3 ambientColor;
 uniform vec3 viewPos;
+uniform mat4 view;
+
+// Lights binned into screen tiles and exponential depth slices, see clustered_lighting.h.
+uniform samplerBuffer lightData;      // Two texels per light: position and radius, color
+uniform usamplerBuffer clusterOffsets; // Lights of cluster i are at [offsets[i], offsets[i + 1])
+uniform usamplerBuffer clusterLights;
+uniform ivec3 clusterGrid;
+uniform vec2 clusterTileSize;
+uniform vec2 clusterDepth;            // Near plane, slices per log depth
+
+int clusterIndex()
+{
+    ivec2 tile = min(ivec2(gl_FragCoord.xy / clusterTileSize), clusterGrid.xy - 1);
+    float depth = -(view * vec4(FragPos, 1.0)).z;
+    int slice = clamp(int(log(depth / clusterDepth.x) * clusterDepth.y), 0, clusterGrid.z - 1);
+    return tile.x + clusterGrid.x * (tile.y + clusterGrid.y * slice);
+}
 
 void main()
 {
-    float ambientStrength = 0.1;
-    vec3 ambient = ambientStrength * lightColor * material.diffuse;
+    vec3 albedo = material.diffuse;
+    vec3 specularColor = material.specular;
+    vec3 ambient = ambientColor * albedo;
 
     float diffuseStrength = 1.0;
-    vec3 norm = normalize(Normal);
-    vec3 lightDir = normalize(lightPos - FragPos);
-    float diff = max(dot(norm, lightDir), 0.0);
-    vec3 diffuse = diffuseStrength * diff * lightColor * material.diffuse;
-
     float specularStrength = 0.25;
+    vec3 norm = normalize(Normal);
     vec3 viewDir = normalize(viewPos - FragPos);
-    vec3 reflectDir = reflect(-lightDir, norm);
-    float spec = pow(max(dot(viewDir, reflectDir), 0.0), material.shininess);
-    vec3 specular = specularStrength * spec * lightColor * material.specular;
+    vec3 lighting = vec3(0.0);
+
+    int cluster = clusterIndex();
+    int lightsEnd = int(texelFetch(clusterOffsets, cluster + 1).r);
+    for (int i = int(texelFetch(clusterOffsets, cluster).r); i < lightsEnd; ++i) {
+        int light = int(texelFetch(clusterLights, i).r);
+        vec4 positionRadius = texelFetch(lightData, 2 * light);
+        vec3 lightColor = texelFetch(lightData, 2 * light + 1).rgb;
+
+        vec3 toLight = positionRadius.xyz - FragPos;
+        float lightDistance = length(toLight);
+        // Smooth window reaching zero at the radius, close to 1 well inside it.
+        float ratio = lightDistance / positionRadius.w;
+        float window = clamp(1.0 - ratio * ratio * ratio * ratio, 0.0, 1.0);
+        float attenuation = window * window;
+        if (attenuation <= 0.0) {
+            continue;
+        }
+
+        vec3 lightDir = toLight / max(lightDistance, 1e-4);
+        float diff = max(dot(norm, lightDir), 0.0);
+        vec3 diffuse = diffuseStrength * diff * lightColor * albedo;
+
+        vec3 reflectDir = reflect(-lightDir, norm);
+        float spec = pow(max(dot(viewDir, reflectDir), 0.0), material.shininess);
+        vec3 specular = specularStrength * spec * lightColor * specularColor;
+
+        lighting += attenuation * (diffuse + specular);
+    }
 
-    vec3 result = ambient + diffuse + specular;
+    vec3 result = ambient + lighting;
     FragColor = vec4(result, 1.0);
-}
\ No newline at end of file
+}
@@ -18,6 +18,9 @@ uniform mat4 projection;
 
 uniform mat4 jointTransforms[MAX_JOINTS];
 
+// Matched by the depth prepass.
+invariant gl_Position;
+
 void main()
 {
     vec4 totalLocalPos = vec4(0.0);
@@ -0,0 +1,33 @@
+#version 330 core
+
+// Skins every vertex once into a transform feedback buffer laid out like Vertex, the passes after it draw the
+// buffer with cube_shader.vert. Same blend as skeleton_shader.vert.
+const int MAX_JOINTS = 50;
+
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 2) in vec2 aTexCoords;
+layout (location = 3) in ivec4 boneIds;
+layout (location = 4) in vec4 boneWeights;
+
+out vec3 skinnedPosition;
+out vec3 skinnedNormal;
+out vec2 skinnedTexCoords;
+
+uniform mat4 jointTransforms[MAX_JOINTS];
+
+void main()
+{
+    vec4 totalLocalPos = vec4(0.0);
+    vec4 totalNormal = vec4(0.0);
+
+    for(int i = 0; i < 4; i++){
+    		mat4 jointTransform = jointTransforms[boneIds[i]];
+    		totalLocalPos += jointTransform * vec4(aPos, 1.0) * boneWeights[i];
+    		totalNormal += jointTransform * vec4(aNormal, 0.0) * boneWeights[i];
+    }
+
+    skinnedPosition = totalLocalPos.xyz;
+    skinnedNormal = totalNormal.xyz;
+    skinnedTexCoords = aTexCoords;
+}
@@ -0,0 +1,688 @@
+#ifndef FIRST_TRY_SCENE_H
+#define FIRST_TRY_SCENE_H
+
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "mesh.h"
+#include "model.h"
+#include "culling.h"
+#include "draw_list.h"
+#include "frame_memory.h"
+#include "occlusion_culling.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Stays valid while its entity lives and never refers to a later entity that reuses the slot.
+struct EntityHandle {
+    uint32_t index;
+    uint32_t generation;
+
+    EntityHandle() : index(0xffffffff), generation(0) {}
+    EntityHandle(uint32_t index, uint32_t generation) : index(index), generation(generation) {}
+};
+
+// Something entities can draw, shared by all of them.
+struct Renderable {
+    const ShaderProgram* shader;
+    Mesh* mesh;           // Static mesh, or
+    AnimatedModel* model; // animated model
+    AABB bounds;          // Model space, only for static meshes
+    const OccluderMesh* occluder; // Of a static mesh, models have their own. Null if it hides nothing
+};
+
+// One draw of a frame, with everything the render side needs to submit it. Built by Scene::prepareDraws.
+struct DrawCommand {
+    // Prepass entities first, then by depth shader, shader, renderable and level.
+    uint64_t key;
+    uint32_t renderable;
+    uint32_t slot;       // Entity handle, the render side keys the skinned vertices of the entity by it
+    uint32_t generation;
+    uint8_t lod;
+    bool depth_prepass;
+    ArrayView<const glm::mat4> palette; // Of animated entities, in the frame arena
+    ArrayView<const uint8_t> mesh_visibility; // Per mesh of animated entities, in the frame arena. Empty draws all
+    glm::mat4 model;
+    glm::mat3 normal_model;
+};
+
+// What an animated entity plays and how its clock runs against the scene time.
+struct AnimationState {
+    AnimationPlayback playback; // Started through the play functions of the model, plays nothing if left empty
+    double time_offset = 0.0;
+    float speed = 1.0f;
+};
+
+// Entities stored as dense arrays of components. Every pass walks the arrays front to back, entity i has its
+// components at index i of each of them. Removing an entity moves the last one into its place, handles are
+// mapped to dense indices through a slot table.
+// The passes up to prepareDraws() are the simulation side and touch no GL. skin() and draw() are the render side,
+// they only read the draw commands and the renderables, so they can replay an earlier frame on the thread that owns
+// the GL context while the next one is simulated. Renderables and shaders have to be set up before that starts.
+class Scene {
+public:
+    uint32_t addRenderable(const Renderable& renderable) {
+        renderables_.push_back(renderable);
+        // Shaders are numbered for the sort keys of the draw list.
+        auto shader = std::find(shaders_.begin(), shaders_.end(), renderable.shader);
+        shader_ids_.push_back(static_cast<uint16_t>(shader - shaders_.begin()));
+        if (shader == shaders_.end()) {
+            shaders_.push_back(renderable.shader);
+        }
+        return static_cast<uint32_t>(renderables_.size() - 1);
+    }
+
+    uint32_t addMesh(Mesh* mesh, const AABB& bounds, const ShaderProgram* shader,
+                     const OccluderMesh* occluder = nullptr) {
+        return addRenderable({shader, mesh, nullptr, bounds, occluder});
+    }
+
+    uint32_t addModel(AnimatedModel* model, const ShaderProgram* shader) {
+        return addRenderable({shader, nullptr, model, AABB(), nullptr});
+    }
+
+    // With a skinning shader (skin_feedback.vert), skin() skins GPU skinned entities once per frame and every pass
+    // after it draws them from the captured vertices, so their renderables need a shader without skinning. Null
+    // skins in the vertex shader of every draw again.
+    void setSkinningShader(const ShaderProgram* feedback_shader) {
+        skinning_shader_ = feedback_shader;
+    }
+
+    // With depth shaders, depth_static.vert for meshes and models skinned once and depth_skeleton.vert for GPU
+    // skinned models, draw() lays down the depth of the visible entities first and then shades with GL_EQUAL, so
+    // every pixel runs the lighting once. CPU skinned models skin in their draw and are shaded without the prepass.
+    // Null shades in one pass.
+    void setDepthShaders(const ShaderProgram* static_shader, const ShaderProgram* skinned_shader) {
+        depth_static_shader_ = static_shader;
+        depth_skinned_shader_ = skinned_shader;
+    }
+
+    // With a buffer, cullOccluded() hides entities behind the occluders of the largest visible entities on
+    // screen: at most max_occluders of them, each covering at least min_occluder_size of the view height.
+    void setOcclusionBuffer(OcclusionBuffer* buffer, size_t max_occluders = 16, float min_occluder_size = 0.1f) {
+        occlusion_buffer_ = buffer;
+        max_occluders_ = max_occluders;
+        min_occluder_size_ = min_occluder_size;
+    }
+
+    const OcclusionStats& occlusionStats() const {
+        return occlusion_stats_;
+    }
+
+    EntityHandle createEntity(uint32_t renderable, const glm::mat4& transform,
+                              const AnimationState& animation = AnimationState()) {
+        uint32_t slot;
+        if (!free_slots_.empty()) {
+            slot = free_slots_.back();
+            free_slots_.pop_back();
+        } else {
+            slot = static_cast<uint32_t>(slots_.size());
+            slots_.push_back({0, 0});
+        }
+        slots_[slot].dense_index = static_cast<uint32_t>(transforms_.size());
+
+        transforms_.push_back(transform);
+        renderable_ids_.push_back(renderable);
+        animations_.push_back(animation);
+        bounds_.push_back(AABB());
+        palettes_.push_back(ArrayView<const glm::mat4>());
+        mesh_visibility_.push_back(ArrayView<const uint8_t>());
+        visible_.push_back(1);
+        lods_.push_back(0);
+        animation_lods_.push_back(0);
+        poses_.emplace_back();
+        if (renderables_[renderable].model) {
+            // Sized up front, entities coming into view later must not allocate.
+            size_t num_bones = renderables_[renderable].model->numBones();
+            poses_.back().previous.resize(num_bones);
+            poses_.back().next.resize(num_bones);
+            size_t num_meshes = renderables_[renderable].model->numMeshes();
+            poses_.back().next_mesh_bounds.resize(num_meshes);
+            poses_.back().mesh_bounds.resize(num_meshes);
+        }
+        dense_slots_.push_back(slot);
+        return EntityHandle(slot, slots_[slot].generation);
+    }
+
+    void destroyEntity(EntityHandle handle) {
+        if (!alive(handle)) {
+            return;
+        }
+        uint32_t index = slots_[handle.index].dense_index;
+        uint32_t last = static_cast<uint32_t>(transforms_.size() - 1);
+        transforms_[index] = transforms_[last];
+        renderable_ids_[index] = renderable_ids_[last];
+        std::swap(animations_[index], animations_[last]);
+        bounds_[index] = bounds_[last];
+        palettes_[index] = palettes_[last];
+        mesh_visibility_[index] = mesh_visibility_[last];
+        visible_[index] = visible_[last];
+        lods_[index] = lods_[last];
+        animation_lods_[index] = animation_lods_[last];
+        std::swap(poses_[index], poses_[last]);
+        dense_slots_[index] = dense_slots_[last];
+        slots_[dense_slots_[index]].dense_index = index;
+
+        transforms_.pop_back();
+        renderable_ids_.pop_back();
+        animations_.pop_back();
+        bounds_.pop_back();
+        palettes_.pop_back();
+        mesh_visibility_.pop_back();
+        visible_.pop_back();
+        lods_.pop_back();
+        animation_lods_.pop_back();
+        poses_.pop_back();
+        dense_slots_.pop_back();
+        ++slots_[handle.index].generation;
+        free_slots_.push_back(handle.index);
+    }
+
+    bool alive(EntityHandle handle) const {
+        // Destroying bumps the generation, so stale handles never match.
+        return handle.index < slots_.size() && slots_[handle.index].generation == handle.generation;
+    }
+
+    size_t size() const {
+        return transforms_.size();
+    }
+
+    // Dense index of a live entity, it changes when other entities are destroyed.
+    size_t indexOf(EntityHandle handle) const {
+        return slots_[handle.index].dense_index;
+    }
+
+    EntityHandle handleAt(size_t index) const {
+        uint32_t slot = dense_slots_[index];
+        return EntityHandle(slot, slots_[slot].generation);
+    }
+
+    // Component arrays for batch passes, all indexed by dense index.
+    ArrayView<glm::mat4> transforms() {
+        return transforms_;
+    }
+
+    ArrayView<AnimationState> animations() {
+        return animations_;
+    }
+
+    ArrayView<const AABB> bounds() const {
+        return bounds_;
+    }
+
+    ArrayView<const uint8_t> visibility() const {
+        return visible_;
+    }
+
+    // Updates the world bounds and culls. Animated entities that are being posed are bounded by their last two
+    // poses, the others by everything their model can play (see AnimatedModel::motionBounds). Posed entities also
+    // get a mask of their meshes in view, in the arena, which has to live until the frame is drawn.
+    void cull(const Frustum& frustum, FrameArena& arena) {
+        culler_.clear();
+        mesh_culler_.clear();
+        ArrayView<uint32_t> first_mesh = arena.allocate<uint32_t>(transforms_.size() + 1);
+        for (size_t i = 0; i < transforms_.size(); ++i) {
+            const Renderable& renderable = renderables_[renderable_ids_[i]];
+            first_mesh[i] = static_cast<uint32_t>(mesh_culler_.size());
+            if (renderable.model) {
+                const PoseCache& pose = poses_[i];
+                const AABB& bounds = pose.valid ? pose.bounds : renderable.model->motionBounds();
+                bounds_[i] = transformAABB(bounds, transforms_[i]);
+                // Entities created before all meshes were uploaded draw every mesh.
+                if (pose.valid && pose.mesh_bounds.size() == renderable.model->numMeshes()) {
+                    for (const AABB& mesh_bounds : pose.mesh_bounds) {
+                        mesh_culler_.add(transformAABB(mesh_bounds, transforms_[i]));
+                    }
+                }
+            } else {
+                bounds_[i] = transformAABB(renderable.bounds, transforms_[i]);
+            }
+            culler_.add(bounds_[i]);
+        }
+        first_mesh[transforms_.size()] = static_cast<uint32_t>(mesh_culler_.size());
+        culler_.cull(frustum, visible_.data());
+
+        ArrayView<uint8_t> mesh_visible = arena.allocate<uint8_t>(mesh_culler_.size());
+        mesh_culler_.cull(frustum, mesh_visible.data());
+        for (size_t i = 0; i < transforms_.size(); ++i) {
+            size_t num_meshes = first_mesh[i + 1] - first_mesh[i];
+            mesh_visibility_[i] = num_meshes == 0 ? ArrayView<const uint8_t>()
+                                                  : ArrayView<const uint8_t>(&mesh_visible[first_mesh[i]], num_meshes);
+        }
+    }
+
+    // Picks the level of detail of every animated entity from the height of its bounds on screen.
+    void selectLods(const glm::mat4& view, const glm::mat4& projection) {
+        for (size_t i = 0; i < transforms_.size(); ++i) {
+            const Renderable& renderable = renderables_[renderable_ids_[i]];
+            if (!renderable.model || bounds_[i].empty()) {
+                continue;
+            }
+            glm::vec3 center = (bounds_[i].min + bounds_[i].max) * 0.5f;
+            float radius = glm::length(bounds_[i].max - bounds_[i].min) * 0.5f;
+            float depth = std::max(-(view * glm::vec4(center, 1.0f)).z, 1e-3f);
+            // Diameter over the height of the view at that depth.
+            float screen_size = radius * projection[1][1] / depth;
+            lods_[i] = static_cast<uint8_t>(renderable.model->selectLod(screen_size, lods_[i]));
+            animation_lods_[i] = static_cast<uint8_t>(renderable.model->selectAnimationLod(screen_size,
+                                                                                          animation_lods_[i]));
+        }
+    }
+
+    // Poses the visible animated entities, after cull and selectLods. Each is posed with the skeleton of its mesh
+    // level. An entity on animation level n is posed every 2^n frames, one interval ahead of time, and drawn with
+    // its bone matrices blended from the pose before.
+    // Hidden entities are not posed at all and start over from the current time once they are visible again, unless
+    // they play a live stream, which no envelope bounds.
+    // Palettes are copied to the arena, which has to live until the frame is drawn.
+    void update(double time, FrameArena& arena) {
+        double frame_time = last_update_time_ < 0.0 ? 0.0 : time - last_update_time_;
+        last_update_time_ = time;
+        pose_count_ = 0;
+        for (size_t i = 0; i < renderables_.size(); ++i) {
+            AnimatedModel* model = renderables_[i].model;
+            // Once per model, renderables may share one.
+            bool first = std::none_of(renderables_.begin(), renderables_.begin() + i,
+                                      [model](const Renderable& other) { return other.model == model; });
+            if (model && first) {
+                model->beginFrame();
+            }
+        }
+        for (size_t i = 0; i < transforms_.size(); ++i) {
+            AnimatedModel* model = renderables_[renderable_ids_[i]].model;
+            if (!model) {
+                continue;
+            }
+            PoseCache& pose = poses_[i];
+            AnimationState& animation = animations_[i];
+            if (!visible_[i] && animation.playback.motionBounded()) {
+                pose.valid = false;
+                palettes_[i] = ArrayView<const glm::mat4>();
+                continue;
+            }
+
+            if (pose.frames_left > 0) {
+                --pose.frames_left;
+            }
+            // Palettes of different skeleton levels don't blend, a new level starts over.
+            if (!pose.valid || pose.frames_left == 0 || pose.lod != lods_[i]) {
+                bool restart = !pose.valid || pose.lod != lods_[i];
+                uint32_t interval = 1u << animation_lods_[i];
+                // Entities appearing together are spread over the interval, so they are not all posed on the
+                // same frame.
+                uint32_t frames_ahead = interval == 1 ? 0 : restart ? 1 + i % interval : interval;
+                double target_time = time + frames_ahead * frame_time;
+                model->update(animation.playback, animation.time_offset + target_time * animation.speed, arena,
+                              lods_[i]);
+                ++pose_count_;
+
+                ArrayView<const glm::mat4> palette = model->palette();
+                pose.previous.swap(pose.next);
+                std::copy(palette.begin(), palette.end(), pose.next.begin());
+                if (restart) {
+                    pose.previous = pose.next;
+                    pose.next_bounds = model->bounds();
+                    std::copy(model->meshBounds().begin(), model->meshBounds().begin() + pose.mesh_bounds.size(),
+                              pose.next_mesh_bounds.begin());
+                }
+                pose.palette_size = palette.size();
+                pose.lod = lods_[i];
+                pose.bounds = pose.next_bounds;
+                pose.bounds.extend(model->bounds());
+                pose.next_bounds = model->bounds();
+                for (size_t mesh = 0; mesh < pose.mesh_bounds.size(); ++mesh) {
+                    pose.mesh_bounds[mesh] = pose.next_mesh_bounds[mesh];
+                    pose.mesh_bounds[mesh].extend(model->meshBounds()[mesh]);
+                    pose.next_mesh_bounds[mesh] = model->meshBounds()[mesh];
+                }
+                pose.previous_time = time;
+                pose.next_time = target_time;
+                pose.frames_left = frames_ahead;
+                pose.valid = true;
+            }
+
+            // The pose cache changes with the next update, which may run before this frame is drawn.
+            ArrayView<glm::mat4> blended = arena.allocate<glm::mat4>(pose.palette_size);
+            if (pose.frames_left == 0 || pose.next_time <= pose.previous_time) {
+                std::copy(pose.next.begin(), pose.next.begin() + pose.palette_size, blended.begin());
+                palettes_[i] = blended;
+                continue;
+            }
+            float alpha = static_cast<float>((time - pose.previous_time) / (pose.next_time - pose.previous_time));
+            alpha = std::min(std::max(alpha, 0.0f), 1.0f);
+            for (size_t bone = 0; bone < blended.size(); ++bone) {
+                blended[bone] = pose.previous[bone] * (1.0f - alpha) + pose.next[bone] * alpha;
+            }
+            palettes_[i] = blended;
+        }
+    }
+
+    // Occlusion culling, after update so animated occluders are drawn in the pose of this frame and before
+    // anything is submitted. Occluders are never hidden themselves. Does nothing without an occlusion buffer.
+    void cullOccluded(const glm::mat4& view, const glm::mat4& projection, FrameArena& arena) {
+        if (!occlusion_buffer_) {
+            return;
+        }
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point start = Clock::now();
+        glm::mat4 view_projection = projection * view;
+
+        // The largest occluders on screen, by the same measure as selectLods.
+        ArrayView<Occluder> candidates = arena.allocate<Occluder>(transforms_.size());
+        size_t num_candidates = 0;
+        for (size_t i = 0; i < transforms_.size(); ++i) {
+            const OccluderMesh* occluder = occluderOf(i);
+            if (!visible_[i] || !occluder || bounds_[i].empty()) {
+                continue;
+            }
+            glm::vec3 center = (bounds_[i].min + bounds_[i].max) * 0.5f;
+            float radius = glm::length(bounds_[i].max - bounds_[i].min) * 0.5f;
+            float depth = std::max(-(view * glm::vec4(center, 1.0f)).z, 1e-3f);
+            float screen_size = radius * projection[1][1] / depth;
+            if (screen_size >= min_occluder_size_) {
+                candidates[num_candidates++] = {static_cast<uint32_t>(i), screen_size};
+            }
+        }
+        size_t num_occluders = std::min(num_candidates, max_occluders_);
+        std::partial_sort(candidates.begin(), candidates.begin() + num_occluders, candidates.begin() + num_candidates,
+                          [](const Occluder& a, const Occluder& b) { return a.screen_size > b.screen_size; });
+
+        ArrayView<size_t> first_vertex = arena.allocate<size_t>(num_occluders);
+        ArrayView<uint8_t> is_occluder = arena.allocate<uint8_t>(transforms_.size());
+        std::fill(is_occluder.begin(), is_occluder.end(), 0);
+        size_t num_vertices = 0;
+        for (size_t k = 0; k < num_occluders; ++k) {
+            uint32_t i = candidates[k].entity;
+            const OccluderMesh& occluder = *occluderOf(i);
+            first_vertex[k] = num_vertices;
+            num_vertices += occluder.positions.size();
+            is_occluder[i] = 1;
+            occlusion_stats_.occluder_triangles += occluder.indices.size() / 3;
+        }
+        ArrayView<glm::vec4> clip_positions = arena.allocate<glm::vec4>(num_vertices);
+        ArrayView<OccluderDraw> draws = arena.allocate<OccluderDraw>(num_occluders);
+        ThreadPool::instance().parallelFor(num_occluders, 1, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; ++k) {
+                uint32_t i = candidates[k].entity;
+                const Renderable& renderable = renderables_[renderable_ids_[i]];
+                const OccluderMesh& occluder = *occluderOf(i);
+                glm::vec4* occluder_positions = &clip_positions[first_vertex[k]];
+                draws[k] = {ArrayView<const glm::vec4>(occluder_positions, occluder.positions.size()),
+                            occluder.indices};
+                glm::mat4 model_view_projection = view_projection * transforms_[i];
+                if (renderable.model) {
+                    renderable.model->transformOccluder(palettes_[i], lods_[i], model_view_projection,
+                                                        occluder_positions);
+                } else {
+                    for (size_t v = 0; v < occluder.positions.size(); ++v) {
+                        occluder_positions[v] = model_view_projection * glm::vec4(occluder.positions[v], 1.0f);
+                    }
+                }
+            }
+        });
+        occlusion_buffer_->render(view_projection, draws, arena);
+        Clock::time_point rendered = Clock::now();
+
+        std::atomic<size_t> tested(0), culled(0);
+        ThreadPool::instance().parallelFor(transforms_.size(), 256, [&](size_t begin, size_t end) {
+            size_t chunk_tested = 0, chunk_culled = 0;
+            for (size_t i = begin; i < end; ++i) {
+                if (!visible_[i] || is_occluder[i]) {
+                    continue;
+                }
+                ++chunk_tested;
+                if (!occlusion_buffer_->visible(bounds_[i])) {
+                    visible_[i] = 0;
+                    ++chunk_culled;
+                }
+            }
+            tested += chunk_tested;
+            culled += chunk_culled;
+        });
+
+        ++occlusion_stats_.frames;
+        occlusion_stats_.occluders += num_occluders;
+        occlusion_stats_.tested += tested;
+        occlusion_stats_.culled += culled;
+        occlusion_stats_.render_ms += std::chrono::duration<double, std::milli>(rendered - start).count();
+        occlusion_stats_.test_ms += std::chrono::duration<double, std::milli>(Clock::now() - rendered).count();
+    }
+
+    // Entities posed by the last update.
+    size_t poseCount() const {
+        return pose_count_;
+    }
+
+    ArrayView<const uint8_t> lods() const {
+        return lods_;
+    }
+
+    // Draw list of the visible entities, after cullOccluded. Generated on the thread pool into the arena, which has
+    // to live until the frame is drawn.
+    ArrayView<const DrawCommand> prepareDraws(FrameArena& arena) {
+        return buildDrawList<DrawCommand>(transforms_.size(), arena,
+                                          [this](size_t begin, size_t end, DrawCommand* out) {
+                                              return generateDrawCommands(begin, end, out);
+                                          });
+    }
+
+    // Render side. Captures the skinned vertices of the entities in the draw list, before the passes that draw them.
+    // Does nothing without a skinning shader.
+    void skin(ArrayView<const DrawCommand> commands) {
+        if (!skinning_shader_) {
+            return;
+        }
+        skinning_shader_->use();
+        glEnable(GL_RASTERIZER_DISCARD);
+        for (const DrawCommand& command : commands) {
+            AnimatedModel* model = renderables_[command.renderable].model;
+            if (!skinsOnce(model)) {
+                continue;
+            }
+            SkinnedInstance& instance = skinnedInstance(command);
+            if (!instance.buffers || instance.generation != command.generation) {
+                // Once per entity, the first time it is seen.
+                ScopedAllocationAllowance allowance;
+                instance.buffers.reset(new SkinnedVertexBuffers(model->numMeshes()));
+                instance.generation = command.generation;
+            }
+            model->skin(*skinning_shader_, command.palette, command.lod, *instance.buffers,
+                        command.mesh_visibility.data());
+        }
+        glDisable(GL_RASTERIZER_DISCARD);
+    }
+
+    // Render side. Replays the draw list, after a depth prepass if there are depth shaders. View and projection have
+    // to be set on the shaders already.
+    void draw(ArrayView<const DrawCommand> commands) {
+        bool prepass = !commands.empty() && commands[0].depth_prepass;
+        if (prepass) {
+            drawDepth(commands);
+            glDepthFunc(GL_EQUAL);
+            glDepthMask(GL_FALSE);
+        }
+
+        const ShaderProgram* current_shader = nullptr;
+        for (const DrawCommand& command : commands) {
+            const Renderable& renderable = renderables_[command.renderable];
+            if (prepass && !command.depth_prepass) {
+                prepass = false;
+                glDepthFunc(GL_LESS);
+                glDepthMask(GL_TRUE);
+            }
+            if (renderable.shader != current_shader) {
+                current_shader = renderable.shader;
+                current_shader->use();
+            }
+            current_shader->setMat4("model", command.model);
+            current_shader->setMat3("normalModel", command.normal_model);
+            if (skinsOnce(renderable.model)) {
+                renderable.model->drawSkinned(*current_shader, *skinnedInstance(command).buffers, command.lod,
+                                              command.mesh_visibility.data());
+            } else if (renderable.model) {
+                renderable.model->draw(*current_shader, command.palette, command.mesh_visibility.data(),
+                                       command.lod);
+            } else {
+                renderable.mesh->draw(*current_shader);
+            }
+        }
+        if (prepass) {
+            glDepthFunc(GL_LESS);
+            glDepthMask(GL_TRUE);
+        }
+    }
+
+private:
+    bool skinsOnce(const AnimatedModel* model) const {
+        return skinning_shader_ && model && model->skinningMode() == SkinningMode::GPU;
+    }
+
+    // Null if the entity has none or is an animated one that was not posed.
+    const OccluderMesh* occluderOf(size_t entity) const {
+        const Renderable& renderable = renderables_[renderable_ids_[entity]];
+        if (renderable.model) {
+            return renderable.model->occluder().empty() || palettes_[entity].empty() ? nullptr
+                                                                                      : &renderable.model->occluder();
+        }
+        return renderable.occluder;
+    }
+
+    bool hasDepthPrepass(const Renderable& renderable) const {
+        return depth_static_shader_ && (!renderable.model || renderable.model->skinningMode() == SkinningMode::GPU);
+    }
+
+    struct Slot {
+        uint32_t dense_index;
+        uint32_t generation;
+    };
+
+    // Last two poses of an animated entity, drawn blended while it is on a lower animation level.
+    struct PoseCache {
+        std::vector<glm::mat4> previous, next; // Sized for the full skeleton
+        size_t palette_size = 0;               // Bones of the skeleton level posed
+        uint8_t lod = 0;
+        double previous_time = 0.0;
+        double next_time = 0.0;
+        uint32_t frames_left = 0; // Until the next pose
+        AABB next_bounds;         // Model space, of the next pose
+        AABB bounds;              // Model space, of both poses
+        std::vector<AABB> next_mesh_bounds, mesh_bounds; // The same per mesh, sized for every mesh
+        bool valid = false;       // Posed since it last came into view
+    };
+
+    // Runs on workers, reads the components only.
+    size_t generateDrawCommands(size_t begin, size_t end, DrawCommand* out) const {
+        size_t written = 0;
+        for (size_t i = begin; i < end; ++i) {
+            if (!visible_[i]) {
+                continue;
+            }
+            uint32_t renderable_id = renderable_ids_[i];
+            const Renderable& renderable = renderables_[renderable_id];
+            DrawCommand& command = out[written++];
+            command.renderable = renderable_id;
+            command.slot = dense_slots_[i];
+            command.generation = slots_[dense_slots_[i]].generation;
+            command.lod = renderable.model ? lods_[i] : 0;
+            command.depth_prepass = hasDepthPrepass(renderable);
+            bool skinned_depth = renderable.model && !skinsOnce(renderable.model);
+            command.key = static_cast<uint64_t>(!command.depth_prepass) << 63 |
+                          static_cast<uint64_t>(skinned_depth) << 62 |
+                          static_cast<uint64_t>(shader_ids_[renderable_id]) << 40 |
+                          static_cast<uint64_t>(renderable_id) << 8 | command.lod;
+            command.palette = palettes_[i];
+            command.mesh_visibility = mesh_visibility_[i];
+            command.model = transforms_[i];
+            command.normal_model = glm::mat3(transforms_[i]);
+        }
+        return written;
+    }
+
+    // Skinned vertices of an entity, kept by the render side.
+    struct SkinnedInstance {
+        uint32_t generation = 0; // Of the entity they were skinned for, the slot may be reused
+        std::unique_ptr<SkinnedVertexBuffers> buffers;
+    };
+
+    SkinnedInstance& skinnedInstance(const DrawCommand& command) {
+        if (command.slot >= skinned_.size()) {
+            ScopedAllocationAllowance allowance;
+            skinned_.resize(command.slot + 1);
+        }
+        return skinned_[command.slot];
+    }
+
+    struct Occluder {
+        uint32_t entity;
+        float screen_size;
+    };
+
+    // Depth of the entities with a prepass at the front of the draw list, color writes off.
+    void drawDepth(ArrayView<const DrawCommand> commands) {
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        const ShaderProgram* current_shader = nullptr;
+        for (const DrawCommand& command : commands) {
+            if (!command.depth_prepass) {
+                break;
+            }
+            const Renderable& renderable = renderables_[command.renderable];
+            bool skinned = renderable.model && !skinsOnce(renderable.model);
+            const ShaderProgram* shader = skinned ? depth_skinned_shader_ : depth_static_shader_;
+            if (shader != current_shader) {
+                current_shader = shader;
+                current_shader->use();
+            }
+            current_shader->setMat4("model", command.model);
+            if (skinsOnce(renderable.model)) {
+                renderable.model->drawSkinnedDepth(*skinnedInstance(command).buffers, command.lod,
+                                                   command.mesh_visibility.data());
+            } else if (renderable.model) {
+                renderable.model->drawDepth(*current_shader, command.palette, command.lod,
+                                            command.mesh_visibility.data());
+            } else {
+                renderable.mesh->drawDepth();
+            }
+        }
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    }
+
+    std::vector<Renderable> renderables_;
+    std::vector<uint16_t> shader_ids_; // Index of the shader of each renderable in shaders_
+    std::vector<const ShaderProgram*> shaders_;
+
+    // Components
+    std::vector<glm::mat4> transforms_;
+    std::vector<uint32_t> renderable_ids_;
+    std::vector<AnimationState> animations_;
+    std::vector<AABB> bounds_;                         // World space
+    std::vector<ArrayView<const glm::mat4>> palettes_; // Skinning matrices of the last update, in the frame arena
+    std::vector<ArrayView<const uint8_t>> mesh_visibility_; // Of the last cull, in the frame arena
+    std::vector<uint8_t> visible_;
+    std::vector<uint8_t> lods_;                        // Level of detail of animated entities
+    std::vector<uint8_t> animation_lods_;
+    std::vector<PoseCache> poses_;
+    std::vector<uint32_t> dense_slots_;                // Slot of each entity
+
+    std::vector<Slot> slots_;
+    std::vector<uint32_t> free_slots_;
+    std::vector<SkinnedInstance> skinned_; // Render side, by slot. Created once the entity is first skinned
+    BoundsCuller culler_;
+    BoundsCuller mesh_culler_; // Meshes of the posed entities, in entity order
+    const ShaderProgram* skinning_shader_ = nullptr;
+    const ShaderProgram* depth_static_shader_ = nullptr;
+    const ShaderProgram* depth_skinned_shader_ = nullptr;
+    OcclusionBuffer* occlusion_buffer_ = nullptr;
+    size_t max_occluders_ = 16;
+    float min_occluder_size_ = 0.1f;
+    OcclusionStats occlusion_stats_;
+    double last_update_time_ = -1.0;
+    size_t pose_count_ = 0;
+};
+
+#endif //FIRST_TRY_SCENE_H
@@ -10,6 +10,9 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include "array_view.h"
+#include "program_cache.h"
+
 #include <iostream>
 #include <fstream>
 #include <vector>
@@ -20,16 +23,31 @@ std::string ReadFile(const std::string& filename) {
     return { std::istreambuf_iterator<char>(infile), std::istreambuf_iterator<char>() };
 }
 
+// Lets the driver compile and link on its own threads, glLinkProgram then returns right away and programs link
+// while the caller goes on loading assets. Call once after the context is created. Does nothing unless the glad
+// loader was generated with KHR_parallel_shader_compile.
+void enableParallelShaderCompile() {
+#ifdef GL_KHR_parallel_shader_compile
+    if (GLAD_GL_KHR_parallel_shader_compile) {
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+    }
+#endif
+}
+
+// Compiling and linking is only started by the constructor. Errors are checked, and the binary stored in the cache,
+// on the first use() or an explicit finish(), which waits for the link if the driver is still working on it.
 class ShaderProgram {
 private:
-    unsigned int CompileShader(const std::string& filename, unsigned int shaderType) {
+    unsigned int CompileShader(const std::string& source, unsigned int shaderType) {
         unsigned int shader;
         shader = glCreateShader(shaderType);
-        std::string shaderFile = ReadFile(filename);
-        const char *shaderFilePtr = shaderFile.c_str();
+        const char *shaderFilePtr = source.c_str();
         glShaderSource(shader, 1, &shaderFilePtr, NULL);
         glCompileShader(shader);
+        return shader;
+    }
 
+    void CheckShader(unsigned int shader, const std::string& filename) const {
         int success;
         char infoLog[512];
         glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
@@ -38,45 +56,75 @@ private:
             success_ = false;
             std::cout << "ERROR::SHADER::COMPILATION_FAILED\n" << filename << "\n"<< infoLog << std::endl;
         }
-        return shader;
     }
 
 public:
-    ShaderProgram(const std::string& vertexFilepath, const std::string& fragmentFilepath) {
+    ShaderProgram(const std::string& vertexFilepath, const std::string& fragmentFilepath,
+                  ProgramBinaryCache* cache = nullptr) :
+            vertex_path_(vertexFilepath), fragment_path_(fragmentFilepath) {
         success_ = true;
-        unsigned int vertexShaderId;
+        std::string vertexSource, fragmentSource;
         try {
-            vertexShaderId = CompileShader(vertexFilepath, GL_VERTEX_SHADER);
+            vertexSource = ReadFile(vertexFilepath);
         } catch (std::ifstream::failure e) {
             std::cout << "ERROR::VERTEX_SHADER::FILE_NOT_SUCCESSFULLY_READ" << std::endl;
             success_ = false;
         }
-        unsigned int fragmentShaderId;
         try {
-            fragmentShaderId = CompileShader(fragmentFilepath, GL_FRAGMENT_SHADER);
+            fragmentSource = ReadFile(fragmentFilepath);
         } catch (std::ifstream::failure e) {
             std::cout << "ERROR::FRAGMENT_SHADER::FILE_NOT_SUCCESSFULLY_READ" << std::endl;
             success_ = false;
         }
-        if (success_) {
-            id_ = glCreateProgram();
-            glAttachShader(id_, vertexShaderId);
-            glAttachShader(id_, fragmentShaderId);
-            glLinkProgram(id_);
-            int success;
-            char infoLog[512];
-            glGetProgramiv(id_, GL_LINK_STATUS, &success);
-            if (!success) {
-                glGetProgramInfoLog(id_, 512, NULL, infoLog);
-                success_ = false;
-                std::cout << "ERROR::SHADER_PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+        if (!success_) {
+            return;
+        }
+        if (cache) {
+            cache_key_ = cache->key(vertexSource, fragmentSource);
+            id_ = cache->load(cache_key_);
+            if (id_) {
+                return;
             }
-            glDeleteShader(vertexShaderId);
-            glDeleteShader(fragmentShaderId);
+            cache_ = cache;
+        }
+        vertex_shader_ = CompileShader(vertexSource, GL_VERTEX_SHADER);
+        fragment_shader_ = CompileShader(fragmentSource, GL_FRAGMENT_SHADER);
+        id_ = glCreateProgram();
+#ifdef FIRST_TRY_PROGRAM_BINARY
+        if (cache_) {
+            glProgramParameteri(id_, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
         }
+#endif
+        glAttachShader(id_, vertex_shader_);
+        glAttachShader(id_, fragment_shader_);
+        glLinkProgram(id_);
+        pending_ = true;
+    }
+
+    // Vertex only program whose outputs are captured with transform feedback, interleaved in the given order.
+    // Draw with GL_RASTERIZER_DISCARD enabled.
+    ShaderProgram(const std::string& vertexFilepath, const std::vector<const char*>& feedbackVaryings) :
+            vertex_path_(vertexFilepath) {
+        success_ = true;
+        std::string vertexSource;
+        try {
+            vertexSource = ReadFile(vertexFilepath);
+        } catch (std::ifstream::failure e) {
+            std::cout << "ERROR::VERTEX_SHADER::FILE_NOT_SUCCESSFULLY_READ" << std::endl;
+            success_ = false;
+            return;
+        }
+        vertex_shader_ = CompileShader(vertexSource, GL_VERTEX_SHADER);
+        id_ = glCreateProgram();
+        glAttachShader(id_, vertex_shader_);
+        glTransformFeedbackVaryings(id_, static_cast<GLsizei>(feedbackVaryings.size()), feedbackVaryings.data(),
+                                    GL_INTERLEAVED_ATTRIBS);
+        glLinkProgram(id_);
+        pending_ = true;
     }
 
     ShaderProgram(unsigned int vertexShaderId, unsigned int fragmentShaderId) {
+        success_ = true;
         id_ = glCreateProgram();
         glAttachShader(id_, vertexShaderId);
         glAttachShader(id_, fragmentShaderId);
@@ -91,65 +139,122 @@ public:
         }
     }
 
-    void use() {
+    // False while the driver is still compiling or linking in the background. Always true without
+    // KHR_parallel_shader_compile, the link is done by the time anything can ask.
+    bool ready() const {
+#ifdef GL_KHR_parallel_shader_compile
+        if (!pending_ || !GLAD_GL_KHR_parallel_shader_compile) {
+            return true;
+        }
+        int done = 0;
+        glGetProgramiv(id_, GL_COMPLETION_STATUS_KHR, &done);
+        return done != 0;
+#else
+        return true;
+#endif
+    }
+
+    // Waits for the link, reports errors and stores the binary of a successful link.
+    void finish() const {
+        if (!pending_) {
+            return;
+        }
+        pending_ = false;
+        CheckShader(vertex_shader_, vertex_path_);
+        if (fragment_shader_) {
+            CheckShader(fragment_shader_, fragment_path_);
+        }
+        int success;
+        char infoLog[512];
+        glGetProgramiv(id_, GL_LINK_STATUS, &success);
+        if (!success) {
+            glGetProgramInfoLog(id_, 512, NULL, infoLog);
+            success_ = false;
+            std::cout << "ERROR::SHADER_PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+        } else if (cache_) {
+            cache_->store(cache_key_, id_);
+        }
+        glDeleteShader(vertex_shader_);
+        if (fragment_shader_) {
+            glDeleteShader(fragment_shader_);
+        }
+    }
+
+    bool success() const {
+        finish();
+        return success_;
+    }
+
+    void use() const {
+        finish();
         glUseProgram(id_);
     }
 
-    void setBool(const std::string &name, bool value) const {
-        glUniform1i(glGetUniformLocation(id_, name.c_str()), (int)value);
+    // Uniform setters take C strings, a std::string per call would allocate for longer names.
+    void setBool(const char* name, bool value) const {
+        glUniform1i(glGetUniformLocation(id_, name), (int)value);
     }
 
-    void setInt(const std::string &name, int value) const {
-        glUniform1i(glGetUniformLocation(id_, name.c_str()), value);
+    void setInt(const char* name, int value) const {
+        glUniform1i(glGetUniformLocation(id_, name), value);
     }
 
-    void setInt(const std::string &name, std::vector<int> values) const {
+    void setInt(const char* name, ArrayView<const int> values) const {
         if (values.size() == 1) {
-            glUniform1iv(glGetUniformLocation(id_, name.c_str()), 1, &values[0]);
+            glUniform1iv(glGetUniformLocation(id_, name), 1, values.data());
         } else if (values.size() == 2) {
-            glUniform2iv(glGetUniformLocation(id_, name.c_str()), 1, &values[0]);
+            glUniform2iv(glGetUniformLocation(id_, name), 1, values.data());
         } else if (values.size() == 3) {
-            glUniform3iv(glGetUniformLocation(id_, name.c_str()), 1, &values[0]);
+            glUniform3iv(glGetUniformLocation(id_, name), 1, values.data());
         } else if (values.size() == 4) {
-            glUniform4iv(glGetUniformLocation(id_, name.c_str()), 1, &values[0]);
+            glUniform4iv(glGetUniformLocation(id_, name), 1, values.data());
         }
     }
 
-    void setFloat(const std::string &name, float value) const {
-        glUniform1f(glGetUniformLocation(id_, name.c_str()), value);
+    void setFloat(const char* name, float value) const {
+        glUniform1f(glGetUniformLocation(id_, name), value);
     }
 
-    void setFloatVector(const std::string &name, const std::vector<float>& values) const {
+    void setFloatVector(const char* name, ArrayView<const float> values) const {
         if (values.size() == 1) {
-            glUniform1fv(glGetUniformLocation(id_, name.c_str()), 1, &values[0]);
+            glUniform1fv(glGetUniformLocation(id_, name), 1, values.data());
         } else if (values.size() == 2) {
-            glUniform2fv(glGetUniformLocation(id_, name.c_str()), 1, &values[0]);
+            glUniform2fv(glGetUniformLocation(id_, name), 1, values.data());
         } else if (values.size() == 3) {
-            glUniform3fv(glGetUniformLocation(id_, name.c_str()), 1, &values[0]);
+            glUniform3fv(glGetUniformLocation(id_, name), 1, values.data());
         } else if (values.size() == 4) {
-            glUniform4fv(glGetUniformLocation(id_, name.c_str()), 1, &values[0]);
+            glUniform4fv(glGetUniformLocation(id_, name), 1, values.data());
         }
     }
 
-    void setVec3(const std::string &name, const glm::vec3& value) const {
-        glUniform3fv(glGetUniformLocation(id_, name.c_str()), 1, glm::value_ptr(value));
+    void setVec3(const char* name, const glm::vec3& value) const {
+        glUniform3fv(glGetUniformLocation(id_, name), 1, glm::value_ptr(value));
     }
 
-    void setMat4(const std::string &name, glm::mat4 value) {
-        glUniformMatrix4fv(glGetUniformLocation(id_, name.c_str()), 1, GL_FALSE, glm::value_ptr(value));
+    void setMat4(const char* name, const glm::mat4& value) const {
+        glUniformMatrix4fv(glGetUniformLocation(id_, name), 1, GL_FALSE, glm::value_ptr(value));
     }
 
-    void setMat4v(const std::string &name, std::vector<glm::mat4> value) {
-        glUniformMatrix4fv(glGetUniformLocation(id_, name.c_str()), value.size(), GL_FALSE, (float*)(&value[0]));
+    void setMat4v(const char* name, ArrayView<const glm::mat4> values) const {
+        glUniformMatrix4fv(glGetUniformLocation(id_, name), values.size(), GL_FALSE,
+                           reinterpret_cast<const float*>(values.data()));
     }
 
-    void setMat3(const std::string &name, glm::mat3 value) {
-        glUniformMatrix3fv(glGetUniformLocation(id_, name.c_str()), 1, GL_FALSE, glm::value_ptr(value));
+    void setMat3(const char* name, const glm::mat3& value) const {
+        glUniformMatrix3fv(glGetUniformLocation(id_, name), 1, GL_FALSE, glm::value_ptr(value));
     }
 
 private:
-    unsigned int id_;
-    bool success_;
+    unsigned int id_ = 0;
+    mutable bool success_;
+    // Link in flight, see finish()
+    mutable bool pending_ = false;
+    unsigned int vertex_shader_ = 0;
+    unsigned int fragment_shader_ = 0;
+    std::string vertex_path_;
+    std::string fragment_path_;
+    ProgramBinaryCache* cache_ = nullptr;
+    uint64_t cache_key_ = 0;
 };
 
 
@@ -0,0 +1,258 @@
+#ifndef FIRST_TRY_SKINNING_H
+#define FIRST_TRY_SKINNING_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "mesh.h"
+#include "thread_pool.h"
+
+#include <vector>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#define SKINNING_AVX2
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#define SKINNING_SSE4
+#include <smmintrin.h>
+#endif
+
+// Vertices per parallel task. Small meshes are skinned on the calling thread.
+const size_t SKINNING_CHUNK_SIZE = 2048;
+
+// Same math as skeleton_shader.vert: every vertex is transformed by the weighted sum of its bone matrices.
+// Normals are not renormalized, the fragment shaders do it anyway.
+void skinVerticesScalar(const Vertex* vertices, const VertexBoneAttribute* bones, size_t count,
+                        const glm::mat4* palette, Vertex* out) {
+    for (size_t i = 0; i < count; ++i) {
+        glm::mat4 transform = palette[bones[i].bones[0]] * bones[i].weights[0] +
+                              palette[bones[i].bones[1]] * bones[i].weights[1] +
+                              palette[bones[i].bones[2]] * bones[i].weights[2] +
+                              palette[bones[i].bones[3]] * bones[i].weights[3];
+        out[i].position = glm::vec3(transform * glm::vec4(vertices[i].position, 1.0f));
+        out[i].normal = glm::vec3(transform * glm::vec4(vertices[i].normal, 0.0f));
+        out[i].tex_coords = vertices[i].tex_coords;
+    }
+}
+
+#if defined(SKINNING_AVX2)
+// One blended matrix is held in two registers: columns 0-1 and columns 2-3.
+void skinVerticesSimd(const Vertex* vertices, const VertexBoneAttribute* bones, size_t count,
+                      const glm::mat4* palette, Vertex* out) {
+    const __m256 w_one = _mm256_setr_ps(0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f, 1.0f);
+    for (size_t i = 0; i < count; ++i) {
+        const VertexBoneAttribute& bone = bones[i];
+        __m256 cols01 = _mm256_setzero_ps();
+        __m256 cols23 = _mm256_setzero_ps();
+        for (int j = 0; j < 4; ++j) {
+            const float* matrix = &palette[bone.bones[j]][0][0];
+            __m256 weight = _mm256_set1_ps(bone.weights[j]);
+            cols01 = _mm256_fmadd_ps(_mm256_loadu_ps(matrix), weight, cols01);
+            cols23 = _mm256_fmadd_ps(_mm256_loadu_ps(matrix + 8), weight, cols23);
+        }
+
+        const Vertex& vertex = vertices[i];
+        __m256 xy = _mm256_setr_ps(vertex.position.x, vertex.position.x, vertex.position.x, vertex.position.x,
+                                   vertex.position.y, vertex.position.y, vertex.position.y, vertex.position.y);
+        __m256 z1 = _mm256_blend_ps(_mm256_set1_ps(vertex.position.z), w_one, 0xF0);
+        __m256 position = _mm256_fmadd_ps(cols01, xy, _mm256_mul_ps(cols23, z1));
+
+        __m256 nxy = _mm256_setr_ps(vertex.normal.x, vertex.normal.x, vertex.normal.x, vertex.normal.x,
+                                    vertex.normal.y, vertex.normal.y, vertex.normal.y, vertex.normal.y);
+        __m256 nz0 = _mm256_setr_ps(vertex.normal.z, vertex.normal.z, vertex.normal.z, vertex.normal.z,
+                                    0.0f, 0.0f, 0.0f, 0.0f);
+        __m256 normal = _mm256_fmadd_ps(cols01, nxy, _mm256_mul_ps(cols23, nz0));
+
+        // The 16 byte stores spill into the following member, which is written right after.
+        Vertex& result = out[i];
+        _mm_storeu_ps(&result.position.x,
+                      _mm_add_ps(_mm256_castps256_ps128(position), _mm256_extractf128_ps(position, 1)));
+        _mm_storeu_ps(&result.normal.x,
+                      _mm_add_ps(_mm256_castps256_ps128(normal), _mm256_extractf128_ps(normal, 1)));
+        result.tex_coords = vertex.tex_coords;
+    }
+}
+#elif defined(SKINNING_SSE4)
+void skinVerticesSimd(const Vertex* vertices, const VertexBoneAttribute* bones, size_t count,
+                      const glm::mat4* palette, Vertex* out) {
+    for (size_t i = 0; i < count; ++i) {
+        const VertexBoneAttribute& bone = bones[i];
+        __m128 col0 = _mm_setzero_ps();
+        __m128 col1 = _mm_setzero_ps();
+        __m128 col2 = _mm_setzero_ps();
+        __m128 col3 = _mm_setzero_ps();
+        for (int j = 0; j < 4; ++j) {
+            const float* matrix = &palette[bone.bones[j]][0][0];
+            __m128 weight = _mm_set1_ps(bone.weights[j]);
+            col0 = _mm_add_ps(col0, _mm_mul_ps(_mm_loadu_ps(matrix), weight));
+            col1 = _mm_add_ps(col1, _mm_mul_ps(_mm_loadu_ps(matrix + 4), weight));
+            col2 = _mm_add_ps(col2, _mm_mul_ps(_mm_loadu_ps(matrix + 8), weight));
+            col3 = _mm_add_ps(col3, _mm_mul_ps(_mm_loadu_ps(matrix + 12), weight));
+        }
+
+        const Vertex& vertex = vertices[i];
+        __m128 position = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(col0, _mm_set1_ps(vertex.position.x)),
+                           _mm_mul_ps(col1, _mm_set1_ps(vertex.position.y))),
+                _mm_add_ps(_mm_mul_ps(col2, _mm_set1_ps(vertex.position.z)), col3));
+        __m128 normal = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(col0, _mm_set1_ps(vertex.normal.x)),
+                           _mm_mul_ps(col1, _mm_set1_ps(vertex.normal.y))),
+                _mm_mul_ps(col2, _mm_set1_ps(vertex.normal.z)));
+
+        // The 16 byte stores spill into the following member, which is written right after.
+        Vertex& result = out[i];
+        _mm_storeu_ps(&result.position.x, position);
+        _mm_storeu_ps(&result.normal.x, normal);
+        result.tex_coords = vertex.tex_coords;
+    }
+}
+#else
+void skinVerticesSimd(const Vertex* vertices, const VertexBoneAttribute* bones, size_t count,
+                      const glm::mat4* palette, Vertex* out) {
+    skinVerticesScalar(vertices, bones, count, palette, out);
+}
+#endif
+
+// Skins all vertices, splitting the work across the thread pool.
+void skinVertices(const std::vector<Vertex>& vertices, const std::vector<VertexBoneAttribute>& bones,
+                  const glm::mat4* palette, std::vector<Vertex>& out,
+                  ThreadPool& pool = ThreadPool::instance()) {
+    out.resize(vertices.size());
+    const Vertex* source = vertices.data();
+    const VertexBoneAttribute* source_bones = bones.data();
+    Vertex* destination = out.data();
+    pool.parallelFor(vertices.size(), SKINNING_CHUNK_SIZE, [=](size_t begin, size_t end) {
+        skinVerticesSimd(source + begin, source_bones + begin, end - begin, palette, destination + begin);
+    });
+}
+
+// Replaces PositionalAttributes + BonesAttributes when skinning on the CPU. Exposes the same attribute
+// locations as PositionalAttributes, so the mesh is drawn with a non-skinning shader like cube_shader.vert.
+class CpuSkinnedAttributes : public VertexAttributes {
+public:
+    CpuSkinnedAttributes(std::vector<Vertex>&& vertices, std::vector<VertexBoneAttribute>&& vertex_bones) :
+            vertices_(std::move(vertices)), vertex_bones_(std::move(vertex_bones)),
+            skinned_vertices_(vertices_) {}
+
+    void initAttributes() override {
+        glGenBuffers(1, &VBO);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferData(GL_ARRAY_BUFFER, skinned_vertices_.size() * sizeof(Vertex), &skinned_vertices_[0],
+                     GL_STREAM_DRAW);
+
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, tex_coords));
+    }
+
+    void unloadAttributes() override {
+        glDeleteBuffers(1, &VBO);
+    }
+
+    size_t numVertices() const override {
+        return skinned_vertices_.size();
+    }
+
+    size_t bufferBytes() const override {
+        return skinned_vertices_.size() * sizeof(Vertex);
+    }
+
+    // Skins the mesh with the given bone palette and streams the result to the vertex buffer.
+    void update(const glm::mat4* palette) {
+        skinVertices(vertices_, vertex_bones_, palette, skinned_vertices_);
+
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        // Orphan the previous storage so the driver doesn't stall on a buffer still used by the last frame.
+        size_t size = skinned_vertices_.size() * sizeof(Vertex);
+        glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, size, &skinned_vertices_[0]);
+    }
+
+    // Posed vertices from the last update, for CPU-side consumers like picking and bounds.
+    const std::vector<Vertex>& skinnedVertices() const {
+        return skinned_vertices_;
+    }
+
+private:
+    std::vector<Vertex> vertices_;
+    std::vector<VertexBoneAttribute> vertex_bones_;
+    std::vector<Vertex> skinned_vertices_;
+    unsigned int VBO;
+};
+
+// Output of the skin-once pass for one instance of a model: per mesh, a buffer the skinned vertices are captured
+// into with transform feedback, in model space and with the layout of Vertex, and a vertex array that draws them
+// like a static mesh, e.g. with cube_shader.vert.
+class SkinnedVertexBuffers : public GpuResource {
+public:
+    explicit SkinnedVertexBuffers(size_t num_meshes) : buffers_(num_meshes) {
+        ResidencyManager::instance().add(this);
+    }
+
+    ~SkinnedVertexBuffers() {
+        ResidencyManager::instance().remove(this);
+        for (const auto& buffer : buffers_) {
+            glDeleteVertexArrays(1, &buffer.VAO);
+            glDeleteBuffers(1, &buffer.VBO);
+        }
+    }
+
+    size_t size() const {
+        return buffers_.size();
+    }
+
+    // Makes room for num_vertices in the buffer of a mesh. Only grows, so levels of detail switch without
+    // reallocating once the largest was used.
+    void reserve(size_t mesh, size_t num_vertices) {
+        Buffer& buffer = buffers_[mesh];
+        if (!buffer.VAO) {
+            glGenVertexArrays(1, &buffer.VAO);
+            glGenBuffers(1, &buffer.VBO);
+            glBindVertexArray(buffer.VAO);
+            glBindBuffer(GL_ARRAY_BUFFER, buffer.VBO);
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+            glEnableVertexAttribArray(1);
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+            glEnableVertexAttribArray(2);
+            glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, tex_coords));
+            glBindVertexArray(0);
+        }
+        if (num_vertices > buffer.capacity) {
+            glBindBuffer(GL_ARRAY_BUFFER, buffer.VBO);
+            glBufferData(GL_ARRAY_BUFFER, num_vertices * sizeof(Vertex), NULL, GL_DYNAMIC_COPY);
+            setResidentBytes(residentBytes() + (num_vertices - buffer.capacity) * sizeof(Vertex));
+            buffer.capacity = num_vertices;
+        }
+    }
+
+    // Binds the index buffer the captured vertices are drawn with.
+    void setIndexBuffer(size_t mesh, unsigned int index_buffer) {
+        glBindVertexArray(buffers_[mesh].VAO);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+        glBindVertexArray(0);
+    }
+
+    unsigned int vertexBuffer(size_t mesh) const {
+        return buffers_[mesh].VBO;
+    }
+
+    unsigned int vertexArray(size_t mesh) const {
+        return buffers_[mesh].VAO;
+    }
+
+private:
+    struct Buffer {
+        unsigned int VAO = 0;
+        unsigned int VBO = 0;
+        size_t capacity = 0; // In vertices
+    };
+
+    std::vector<Buffer> buffers_;
+};
+
+#endif //FIRST_TRY_SKINNING_H
@@ -0,0 +1,59 @@
+#ifndef FIRST_TRY_SPSC_RING_H
+#define FIRST_TRY_SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Bounded queue between exactly one producing and one consuming thread, without locks. Elements are created up
+// front and written and read in place, so elements holding buffers are reused instead of reallocated.
+template<typename T>
+class SpscRing {
+public:
+    // Holds capacity elements, copies of the prototype.
+    explicit SpscRing(size_t capacity, const T& prototype = T()) : elements_(capacity, prototype) {}
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    size_t capacity() const {
+        return elements_.size();
+    }
+
+    // Producer: the element to write next, null if the ring is full.
+    T* beginPush() {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == elements_.size()) {
+            return nullptr;
+        }
+        return &elements_[tail % elements_.size()];
+    }
+
+    // Producer: publishes the element of beginPush().
+    void endPush() {
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer: the oldest element, null if the ring is empty.
+    T* front() {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &elements_[head % elements_.size()];
+    }
+
+    // Consumer: hands the element of front() back to the producer.
+    void pop() {
+        head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    std::vector<T> elements_;
+    // Kept a cache line apart, each is written by one side only.
+    std::atomic<size_t> head_{0};
+    char padding_[64];
+    std::atomic<size_t> tail_{0};
+};
+
+#endif //FIRST_TRY_SPSC_RING_H
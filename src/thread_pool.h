@@ -0,0 +1,184 @@
+#ifndef FIRST_TRY_THREAD_POOL_H
+#define FIRST_TRY_THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads fed from a single FIFO queue.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned num_threads = defaultThreadCount()) {
+        for (unsigned i = 0; i < num_threads; ++i) {
+            workers_.emplace_back([this]() { workerLoop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        condition_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Pool shared by all CPU-side subsystems.
+    static ThreadPool& instance() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    static unsigned defaultThreadCount() {
+        unsigned hardware_threads = std::thread::hardware_concurrency();
+        // One core is left for the thread that owns the GL context.
+        return hardware_threads > 1 ? hardware_threads - 1 : 1;
+    }
+
+    size_t size() const {
+        return workers_.size();
+    }
+
+    void enqueue(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back(std::move(task));
+        }
+        condition_.notify_one();
+    }
+
+    // Calls body(begin, end) over chunks of [0, count) and returns once all of them are processed.
+    // The calling thread takes chunks too, so this is safe to call from inside a worker. The body is called
+    // through a plain function pointer and the job lives in the pool, so nothing is allocated per call.
+    template<typename Body>
+    void parallelFor(size_t count, size_t min_chunk, const Body& body) {
+        if (count == 0) {
+            return;
+        }
+        min_chunk = std::max<size_t>(min_chunk, 1);
+        size_t num_chunks = std::min((count + min_chunk - 1) / min_chunk, workers_.size() + 1);
+        ParallelJob* job = num_chunks > 1 ? openJob() : nullptr;
+        if (!job) {
+            body(0, count);
+            return;
+        }
+
+        job->body = &body;
+        job->invoke = [](const void* body, size_t begin, size_t end) {
+            (*static_cast<const Body*>(body))(begin, end);
+        };
+        job->count = count;
+        job->num_chunks = num_chunks;
+        job->chunk_size = (count + num_chunks - 1) / num_chunks;
+        job->next_chunk = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job->open = true;
+        }
+        condition_.notify_all();
+
+        runChunks(*job);
+
+        // Workers only join while the job is open and always finish the chunk they took.
+        std::unique_lock<std::mutex> lock(mutex_);
+        job->open = false;
+        job_done_.wait(lock, [job]() { return job->active_workers == 0; });
+        job->in_use = false;
+    }
+
+private:
+    // One parallelFor call. Its chunks are handed out through an atomic counter.
+    struct ParallelJob {
+        const void* body;
+        void (*invoke)(const void* body, size_t begin, size_t end);
+        size_t count;
+        size_t num_chunks;
+        size_t chunk_size;
+        std::atomic<size_t> next_chunk;
+        // Guarded by mutex_.
+        bool in_use = false;
+        bool open = false;
+        int active_workers = 0;
+    };
+
+    // Nested or concurrent parallelFor calls beyond this run on the calling thread alone.
+    static const int MAX_PARALLEL_JOBS = 8;
+
+    ParallelJob* openJob() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& job : jobs_) {
+            if (!job.in_use) {
+                job.in_use = true;
+                return &job;
+            }
+        }
+        return nullptr;
+    }
+
+    static void runChunks(ParallelJob& job) {
+        size_t chunk;
+        while ((chunk = job.next_chunk++) < job.num_chunks) {
+            size_t begin = chunk * job.chunk_size;
+            job.invoke(job.body, begin, std::min(begin + job.chunk_size, job.count));
+        }
+    }
+
+    // Open job with chunks left, called with mutex_ held.
+    ParallelJob* findOpenJob() {
+        for (auto& job : jobs_) {
+            if (job.open && job.next_chunk < job.num_chunks) {
+                return &job;
+            }
+        }
+        return nullptr;
+    }
+
+    void workerLoop() {
+        while (true) {
+            std::function<void()> task;
+            ParallelJob* job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                condition_.wait(lock, [this]() { return stopping_ || !tasks_.empty() || findOpenJob(); });
+                job = findOpenJob();
+                if (job) {
+                    ++job->active_workers;
+                } else if (stopping_ && tasks_.empty()) {
+                    return;
+                } else {
+                    task = std::move(tasks_.front());
+                    tasks_.pop_front();
+                }
+            }
+            if (job) {
+                runChunks(*job);
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (--job->active_workers == 0) {
+                    job_done_.notify_all();
+                }
+                continue;
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::condition_variable job_done_;
+    ParallelJob jobs_[MAX_PARALLEL_JOBS];
+    bool stopping_ = false;
+};
+
+#endif //FIRST_TRY_THREAD_POOL_H